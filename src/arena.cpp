@@ -0,0 +1,97 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "arena.h"
+
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+namespace brie {
+
+// Buffers kept for reuse; bigger ones are released to the system
+static constexpr size_t MaxPooled = 8;
+static constexpr size_t MaxPooledSize = 64 * 1024 * 1024;
+
+static std::mutex poolMutex;
+static std::vector<Buffer*> pool;
+
+void Buffer::resize(size_t value)
+{
+    if (value > capacity) {
+        size_t newCapacity = capacity == 0 ? 4096 : capacity;
+        while (newCapacity < value) newCapacity *= 2;
+
+        std::unique_ptr<char[]> newData(new char[newCapacity]);
+        if (size != 0) memcpy(newData.get(), data.get(), size);
+        data = std::move(newData);
+        capacity = newCapacity;
+    }
+
+    size = value;
+}
+
+static void release_buffer(Buffer* buf)
+{
+    if (buf->capacity <= MaxPooledSize) {
+        std::lock_guard<std::mutex> lock(poolMutex);
+        if (pool.size() < MaxPooled) {
+            buf->size = 0;
+            pool.push_back(buf);
+            return;
+        }
+    }
+
+    delete buf;
+}
+
+BufferPtr acquire_buffer(size_t size)
+{
+    Buffer* buf = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(poolMutex);
+
+        // Prefer the smallest buffer that fits, otherwise the largest one
+        size_t best = pool.size();
+        for (size_t i = 0; i < pool.size(); i++) {
+            if (best == pool.size()) {
+                best = i;
+                continue;
+            }
+
+            const size_t cap = pool[i]->capacity;
+            const size_t bestCap = pool[best]->capacity;
+            bool fits = cap >= size;
+            bool bestFits = bestCap >= size;
+            if ((fits && (!bestFits || cap < bestCap)) || (!fits && !bestFits && cap > bestCap)) {
+                best = i;
+            }
+        }
+
+        if (best != pool.size()) {
+            buf = pool[best];
+            pool.erase(pool.begin() + best);
+        }
+    }
+
+    if (buf == nullptr) buf = new Buffer;
+    buf->resize(size);
+
+    return BufferPtr(buf, release_buffer);
+}
+
+} // namespace brie
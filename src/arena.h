@@ -0,0 +1,46 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <cstddef>
+#include <memory>
+
+namespace brie {
+
+/*****************************************************************
+ *   Growing buffer that is not initialized on resize.
+ */
+struct Buffer
+{
+    std::unique_ptr<char[]> data;
+    size_t capacity = 0;
+    size_t size = 0;
+
+    void resize(size_t value);
+};
+
+using BufferPtr = std::shared_ptr<Buffer>;
+
+/*****************************************************************
+ *   Take a buffer of "size" bytes from the pool of reusable buffers.
+ *   The buffer goes back to the pool when the last reference to it
+ *   is released, so sources opened one after another keep reusing
+ *   the same memory instead of allocating it.
+ */
+BufferPtr acquire_buffer(size_t size);
+
+} // namespace brie
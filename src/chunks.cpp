@@ -0,0 +1,70 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "chunks.h"
+#include "error.h"
+#include "utils/log.h"
+
+#include <thread>
+
+namespace brie {
+
+std::vector<ChunkRange> split_chunks(size_t size, size_t count, const AlignFunc& align)
+{
+    std::vector<ChunkRange> ranges;
+    size_t start = 0;
+
+    for (size_t i = 1; i < count; i++) {
+        const size_t target = size / count * i + size % count * i / count;
+        if (target <= start) continue;
+
+        const size_t boundary = align(target);
+        if (boundary >= size) break;
+        if (boundary <= start) continue;
+
+        ranges.push_back(ChunkRange{ start, boundary - start });
+        start = boundary;
+    }
+
+    ranges.push_back(ChunkRange{ start, size - start });
+    return ranges;
+}
+
+std::vector<ChunkResult> run_chunks(const std::vector<ChunkRange>& ranges, const ChunkWork& work)
+{
+    std::vector<ChunkResult> results(ranges.size());
+    std::vector<std::thread> threads;
+
+    for (size_t i = 0; i < ranges.size(); i++) {
+        threads.emplace_back([&work, &ranges, &results, i] {
+            try {
+                work(i, ranges[i], results[i]);
+            } catch (const Error& err) {
+                results[i].error = err.what();
+            } catch (const std::exception& ex) {
+                results[i].error = ex.what();
+            }
+        });
+    }
+
+    for (std::thread& t: threads) t.join();
+
+    LOG_DEBUG << "Ran " << ranges.size() << " chunks";
+    return results;
+}
+
+} // namespace brie
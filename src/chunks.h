@@ -0,0 +1,64 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "incremental.h"
+#include "sample.h"
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace brie {
+
+/*****************************************************************
+ *   Byte range of a source that a chunk worker runs the body over.
+ */
+struct ChunkRange
+{
+    size_t offset = 0;
+    size_t size = 0;
+};
+
+/*****************************************************************
+ *   What a chunk worker produced: the text the body printed, the
+ *   values it passed to emit(), what it sampled and the error that
+ *   stopped it.
+ */
+struct ChunkResult
+{
+    std::string output;
+    Contributions sums;
+    Sampler sampler;
+    std::string error;
+};
+
+// Returns the first record boundary at or after a position, or a
+// position at or past the end if there is none
+using AlignFunc = std::function<size_t(size_t)>;
+
+// Split "size" bytes into up to "count" ranges of about the same size
+// that start at record boundaries. Ranges without a boundary inside
+// are merged with the previous one.
+std::vector<ChunkRange> split_chunks(size_t size, size_t count, const AlignFunc& align);
+
+// Run "work" for every range on its own thread and wait for all of
+// them. Results are in the order of the ranges.
+using ChunkWork = std::function<void(size_t index, const ChunkRange& range, ChunkResult& result)>;
+std::vector<ChunkResult> run_chunks(const std::vector<ChunkRange>& ranges, const ChunkWork& work);
+
+} // namespace brie
@@ -0,0 +1,164 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dedupe.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace brie {
+
+// Size of each of the samples at the start, the middle and the end
+static constexpr size_t SampleSize = 64 * 1024;
+static constexpr size_t ReadSize = 1024 * 1024;
+
+static uint64_t mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t hash_bytes(const void* data, size_t len, uint64_t seed)
+{
+    constexpr uint64_t Prime = 0x9e3779b97f4a7c15ull;
+
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    uint64_t h = seed ^ (len * Prime);
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        h = (h ^ mix(word)) * Prime;
+        h = (h << 31) | (h >> 33);
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, p, len);
+    return mix(h ^ mix(tail));
+}
+
+// Hash of "len" bytes of "fd" at "offset" combined with "hash"
+static bool hash_range(int fd, size_t offset, size_t len, std::vector<char>& buffer, uint64_t& hash)
+{
+    while (len > 0) {
+        const ssize_t n = pread(fd, buffer.data(), std::min(len, buffer.size()), offset);
+        if (n <= 0) return false;
+        hash = hash_bytes(buffer.data(), n, hash);
+        offset += n;
+        len -= n;
+    }
+    return true;
+}
+
+// True if both files have the same bytes
+static bool same_content(const std::string& left, const std::string& right)
+{
+    const int leftFd = open(left.c_str(), O_RDONLY);
+    const int rightFd = open(right.c_str(), O_RDONLY);
+    struct stat leftSt, rightSt;
+    bool same = leftFd >= 0 && rightFd >= 0
+        && fstat(leftFd, &leftSt) == 0 && fstat(rightFd, &rightSt) == 0
+        && leftSt.st_size == rightSt.st_size;
+
+    std::vector<char> leftBuf(ReadSize);
+    std::vector<char> rightBuf(ReadSize);
+    for (off_t offset = 0; same && offset < leftSt.st_size; ) {
+        const size_t want = std::min<off_t>(ReadSize, leftSt.st_size - offset);
+        same = pread(leftFd, leftBuf.data(), want, offset) == (ssize_t)want
+            && pread(rightFd, rightBuf.data(), want, offset) == (ssize_t)want
+            && memcmp(leftBuf.data(), rightBuf.data(), want) == 0;
+        offset += want;
+    }
+
+    if (leftFd >= 0) close(leftFd);
+    if (rightFd >= 0) close(rightFd);
+    return same;
+}
+
+/**********************************************************************
+ */
+std::string DuplicateFinder::find(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return "";
+
+    struct stat st;
+    std::vector<char> buffer(SampleSize);
+    uint64_t sample = hash_bytes(nullptr, 0, 0);
+    bool ok = fstat(fd, &st) == 0;
+    const size_t size = ok ? st.st_size : 0;
+
+    // Small files are hashed completely
+    const bool whole = size <= 3 * SampleSize;
+    if (ok && whole) {
+        ok = hash_range(fd, 0, size, buffer, sample);
+    } else if (ok) {
+        ok = hash_range(fd, 0, SampleSize, buffer, sample)
+            && hash_range(fd, size / 2 - SampleSize / 2, SampleSize, buffer, sample)
+            && hash_range(fd, size - SampleSize, SampleSize, buffer, sample);
+    }
+    close(fd);
+    if (!ok) return "";
+
+    const uint64_t key = mix(sample ^ size);
+
+    File file;
+    file.path = path;
+    file.hashed = whole;
+    file.hash = whole ? key : 0;
+
+    std::vector<File>& files = m_files[key];
+    for (File& other: files) {
+        const bool hashesMatch = whole || (full_hash(other) && full_hash(file) && other.hash == file.hash);
+
+        // A hash collision must not skip the body of a real input
+        if (hashesMatch && same_content(other.path, path)) {
+            return other.path;
+        }
+    }
+
+    files.push_back(std::move(file));
+    return "";
+}
+
+bool DuplicateFinder::full_hash(File& file)
+{
+    if (file.hashed) return true;
+
+    int fd = open(file.path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    std::vector<char> buffer(ReadSize);
+    uint64_t hash = 0;
+    const bool ok = fstat(fd, &st) == 0 && hash_range(fd, 0, st.st_size, buffer, hash);
+    close(fd);
+    if (!ok) return false;
+
+    file.hash = mix(hash ^ st.st_size);
+    file.hashed = true;
+    return true;
+}
+
+} // namespace brie
@@ -0,0 +1,59 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace brie {
+
+/*****************************************************************
+ *   Finds files with the same content as a file seen before. A file
+ *   is first hashed by its size and a few samples, which is cheap
+ *   even for huge files. Only when the samples match an earlier
+ *   file both files are hashed completely, and when the hashes match
+ *   too the bytes are compared to confirm it.
+ */
+class DuplicateFinder
+{
+public:
+    // Path of an earlier file with the same content as "path", or an
+    // empty string if there is none; then "path" is remembered.
+    // Files that cannot be read have no duplicates.
+    std::string find(const std::string& path);
+
+private:
+    struct File
+    {
+        std::string path;
+        bool hashed = false; // "hash" is the hash of the whole content
+        uint64_t hash = 0;
+    };
+
+    bool full_hash(File& file);
+
+private:
+    std::unordered_map<uint64_t, std::vector<File>> m_files; // By sample hash
+};
+
+// Fast non-cryptographic hash of "len" bytes
+uint64_t hash_bytes(const void* data, size_t len, uint64_t seed = 0);
+
+} // namespace brie
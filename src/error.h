@@ -32,6 +32,6 @@ private:
 };
 
 // Utility function that throws Error exception
-void throwex(const std::string& msg);
+[[noreturn]] void throwex(const std::string& msg);
 
 } // namespace brie
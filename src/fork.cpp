@@ -0,0 +1,240 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fork.h"
+#include "error.h"
+#include "utils/log.h"
+
+#include <cerrno>
+#include <map>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace brie {
+
+// Sources finished ahead of an earlier one that is still running are
+// kept until they can be passed on; past this many per worker no more
+// sources are handed out.
+static constexpr size_t MaxAheadPerWorker = 16;
+
+/**********************************************************************
+ *   Messages: a source is its name on a line; a result is a status
+ *   byte and the FileResult as written by write_result().
+ */
+static bool write_task(FILE* f, const std::string& cfg)
+{
+    return fprintf(f, "%s\n", cfg.c_str()) > 0 && fflush(f) == 0;
+}
+
+static bool read_task(FILE* f, std::string& cfg)
+{
+    char* line = nullptr;
+    size_t size = 0;
+    const ssize_t len = getline(&line, &size, f);
+    if (len > 0) cfg.assign(line, line[len - 1] == '\n' ? len - 1 : len);
+    free(line);
+    return len > 0;
+}
+
+WorkerPool::WorkerPool(size_t count, Task task)
+{
+    // A dead worker must not kill the parent with SIGPIPE; stop()
+    // puts the old handler back
+    struct sigaction ignore = {};
+    ignore.sa_handler = SIG_IGN;
+    sigemptyset(&ignore.sa_mask);
+    m_sigpipeSaved = sigaction(SIGPIPE, &ignore, &m_oldSigpipe) == 0;
+
+    fflush(stdout);
+    fflush(stderr);
+
+    for (size_t i = 0; i < count; i++) {
+        int toWorker[2];
+        int fromWorker[2];
+        if (pipe(toWorker) != 0) throwex("Failed to create a pipe");
+        if (pipe(fromWorker) != 0) {
+            close(toWorker[0]);
+            close(toWorker[1]);
+            throwex("Failed to create a pipe");
+        }
+
+        const pid_t pid = fork();
+        if (pid < 0) {
+            for (int fd: { toWorker[0], toWorker[1], fromWorker[0], fromWorker[1] }) close(fd);
+            stop();
+            throwex("Failed to fork a worker");
+        }
+
+        if (pid == 0) {
+            // Pipes of earlier workers would keep them from seeing
+            // the end of their tasks
+            for (Worker& w: m_workers) {
+                fclose(w.tasks);
+                fclose(w.results);
+            }
+            close(toWorker[1]);
+            close(fromWorker[0]);
+            serve(fdopen(toWorker[0], "rb"), fdopen(fromWorker[1], "wb"), task);
+        }
+
+        close(toWorker[0]);
+        close(fromWorker[1]);
+
+        Worker w;
+        w.pid = pid;
+        w.tasks = fdopen(toWorker[1], "wb");
+        w.results = fdopen(fromWorker[0], "rb");
+        m_workers.push_back(w);
+    }
+
+    LOG_DEBUG << "Forked " << count << " workers";
+}
+
+WorkerPool::~WorkerPool()
+{
+    stop();
+}
+
+void WorkerPool::stop()
+{
+    for (Worker& w: m_workers) {
+        if (w.tasks != nullptr) fclose(w.tasks);
+        w.tasks = nullptr;
+    }
+
+    for (Worker& w: m_workers) {
+        if (w.results != nullptr) fclose(w.results);
+        w.results = nullptr;
+        if (w.pid > 0) waitpid(w.pid, nullptr, 0);
+        w.pid = -1;
+    }
+
+    if (m_sigpipeSaved) sigaction(SIGPIPE, &m_oldSigpipe, nullptr);
+    m_sigpipeSaved = false;
+}
+
+void WorkerPool::serve(FILE* tasks, FILE* results, const Task& task)
+{
+    std::string cfg;
+    while (tasks != nullptr && results != nullptr && read_task(tasks, cfg)) {
+        FileResult result;
+        bool ok = false;
+        try {
+            ok = task(cfg, result);
+        } catch (const Error& err) {
+            fprintf(stderr, "Failed: %s\n", err.what().c_str());
+        }
+
+        fputc(ok ? 1 : 0, results);
+        if (!write_result(results, result) || fflush(results) != 0) break;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    _exit(0);
+}
+
+bool WorkerPool::run(const NextFunc& next, const DoneFunc& done)
+{
+    struct Finished
+    {
+        bool ok = false;
+        bool died = false; // The worker died; there is no result to pass on
+        FileResult result;
+    };
+
+    std::map<size_t, std::string> cfgs;      // Handed out, by number
+    std::map<size_t, Finished> finished;     // Not passed on yet
+    size_t seq = 0;
+    size_t nextDone = 0;
+    bool more = true;
+    bool ok = true;
+
+    auto hand_out = [&](Worker& w) {
+        if (!more || !ok || finished.size() >= MaxAheadPerWorker * m_workers.size()) return;
+
+        std::string cfg;
+        if (!next(cfg)) {
+            more = false;
+            return;
+        }
+        if (!write_task(w.tasks, cfg)) {
+            fprintf(stderr, "Failed: worker %d is gone, %s is not processed\n", (int)w.pid, cfg.c_str());
+            ok = false;
+            return;
+        }
+        w.busy = true;
+        w.seq = seq++;
+        cfgs[w.seq] = cfg;
+    };
+
+    for (Worker& w: m_workers) hand_out(w);
+
+    std::vector<pollfd> fds;
+    std::vector<Worker*> polled;
+    while (true) {
+        fds.clear();
+        polled.clear();
+        for (Worker& w: m_workers) {
+            if (!w.busy) continue;
+            fds.push_back(pollfd{ fileno(w.results), POLLIN, 0 });
+            polled.push_back(&w);
+        }
+        if (fds.empty()) break;
+
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            throwex("Failed to wait for workers");
+        }
+
+        for (size_t i = 0; i < fds.size(); i++) {
+            if (fds[i].revents == 0) continue;
+
+            // A worker writes a whole result at once
+            Worker& w = *polled[i];
+            w.busy = false;
+            Finished& f = finished[w.seq];
+            const int status = fgetc(w.results);
+            if (status == EOF || !read_result(w.results, f.result)) {
+                // Keep its place, so the sources after it are passed on
+                fprintf(stderr, "Failed: worker %d died on %s\n", (int)w.pid, cfgs[w.seq].c_str());
+                f.died = true;
+                continue;
+            }
+            f.ok = status == 1;
+        }
+
+        // Pass on results in the order of the sources
+        for (auto it = finished.find(nextDone); it != finished.end(); it = finished.find(nextDone)) {
+            if (!it->second.died) done(cfgs[nextDone], it->second.result);
+            if (!it->second.ok) ok = false;
+            finished.erase(it);
+            cfgs.erase(nextDone);
+            nextDone++;
+        }
+
+        for (Worker& w: m_workers) {
+            if (!w.busy) hand_out(w);
+        }
+    }
+
+    return ok;
+}
+
+} // namespace brie
@@ -0,0 +1,85 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "incremental.h"
+#include <cstddef>
+#include <functional>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <signal.h>
+#include <sys/types.h>
+
+namespace brie {
+
+/*****************************************************************
+ *   Processes forked from the current one that run a task for each
+ *   source handed to them over a pipe. They start with a copy-on-write
+ *   image of the parent, e.g. of a Lua state the prefix initialized,
+ *   and send back what the task produced over another pipe.
+ *
+ *   Each worker has one source at a time. Results are passed on in
+ *   the order of the sources, whatever order the workers finish in.
+ */
+class WorkerPool
+{
+public:
+    // Runs in a worker for a source; returns false on failure
+    using Task = std::function<bool(const std::string& cfg, FileResult& result)>;
+    using NextFunc = std::function<bool(std::string& cfg)>;
+    using DoneFunc = std::function<void(const std::string& cfg, const FileResult& result)>;
+
+    // Fork "count" workers. The parent must have no other threads.
+    WorkerPool(size_t count, Task task);
+
+    // Close the pipes and wait for the workers to exit
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    // Run the task for every source "next" gives and call "done" for
+    // them in that order. Stops handing out sources after a failure
+    // or if a worker dies; returns false then. The sources already
+    // handed out are still passed on, except those whose worker died,
+    // which are reported on stderr.
+    bool run(const NextFunc& next, const DoneFunc& done);
+
+    size_t size() const { return m_workers.size(); }
+
+private:
+    struct Worker
+    {
+        pid_t pid = -1;
+        FILE* tasks = nullptr;   // Sources to the worker
+        FILE* results = nullptr; // Results from the worker
+        bool busy = false;
+        size_t seq = 0;          // Number of the source it runs
+    };
+
+    [[noreturn]] static void serve(FILE* tasks, FILE* results, const Task& task);
+    void stop();
+
+private:
+    std::vector<Worker> m_workers;
+    struct sigaction m_oldSigpipe = {}; // Restored by stop()
+    bool m_sigpipeSaved = false;
+};
+
+} // namespace brie
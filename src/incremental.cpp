@@ -0,0 +1,232 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "incremental.h"
+#include "utils/log.h"
+
+#include <cstring>
+
+#include <unistd.h>
+
+namespace brie {
+
+static const char StoreMagic[8] = { 'B', 'R', 'I', 'E', 'R', 'E', 'S', '1' };
+
+// FNV-1a
+uint64_t hash_text(const std::string& text, uint64_t hash)
+{
+    for (unsigned char c: text) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/**********************************************************************
+ *   Store file: the magic, the number of entries and the entries.
+ *   Strings are written as a 64-bit length and the bytes.
+ */
+static bool write_u64(FILE* f, uint64_t value)
+{
+    return fwrite(&value, sizeof(value), 1, f) == 1;
+}
+
+static bool write_str(FILE* f, const std::string& str)
+{
+    return write_u64(f, str.size()) && (str.empty() || fwrite(str.data(), str.size(), 1, f) == 1);
+}
+
+static bool read_u64(FILE* f, uint64_t& value)
+{
+    return fread(&value, sizeof(value), 1, f) == 1;
+}
+
+static bool read_str(FILE* f, std::string& str)
+{
+    // Strings longer than this mean a damaged store
+    constexpr uint64_t MaxLen = 1ull << 32;
+
+    uint64_t len = 0;
+    if (!read_u64(f, len) || len > MaxLen) return false;
+    str.resize(len);
+    return len == 0 || fread(&str[0], len, 1, f) == 1;
+}
+
+bool write_result(FILE* f, const FileResult& result)
+{
+    bool ok = write_u64(f, result.sums.size());
+    for (const Contribution& sum: result.sums) {
+        uint64_t value = static_cast<uint64_t>(sum.intValue);
+        if (!sum.isInt) memcpy(&value, &sum.floatValue, sizeof(value));
+        ok = ok && write_str(f, sum.name) && write_u64(f, sum.isInt) && write_u64(f, value);
+    }
+
+    return ok && write_str(f, result.output);
+}
+
+bool read_result(FILE* f, FileResult& result)
+{
+    uint64_t sums = 0;
+    bool ok = read_u64(f, sums);
+
+    result.sums.clear();
+    for (uint64_t j = 0; ok && j < sums; j++) {
+        Contribution sum;
+        uint64_t isInt = 0;
+        uint64_t value = 0;
+        ok = read_str(f, sum.name) && read_u64(f, isInt) && read_u64(f, value);
+        sum.isInt = isInt != 0;
+        if (sum.isInt) sum.intValue = static_cast<int64_t>(value);
+        else memcpy(&sum.floatValue, &value, sizeof(value));
+        result.sums.push_back(std::move(sum));
+    }
+
+    return ok && read_str(f, result.output);
+}
+
+ResultStore::ResultStore(const std::string& path, uint64_t scriptHash)
+    : m_path(path), m_scriptHash(scriptHash)
+{
+}
+
+void ResultStore::load()
+{
+    m_entries.clear();
+
+    FILE* f = fopen(m_path.c_str(), "rb");
+    if (f == nullptr) return;
+
+    char magic[sizeof(StoreMagic)];
+    uint64_t count = 0;
+    bool ok = fread(magic, sizeof(magic), 1, f) == 1 && memcmp(magic, StoreMagic, sizeof(magic)) == 0
+        && read_u64(f, count);
+
+    for (uint64_t i = 0; ok && i < count; i++) {
+        std::string path;
+        Entry entry;
+        ok = read_str(f, path) && read_u64(f, entry.inode) && read_u64(f, entry.size)
+            && read_u64(f, entry.mtimeSec) && read_u64(f, entry.mtimeNsec) && read_u64(f, entry.scriptHash)
+            && read_result(f, entry.result);
+        if (ok) m_entries[path] = std::move(entry);
+    }
+    fclose(f);
+
+    if (!ok) {
+        LOG_DEBUG << "Ignore damaged result store " << m_path;
+        m_entries.clear();
+    }
+}
+
+bool ResultStore::save() const
+{
+    const std::string tmpPath = m_path + "." + std::to_string(getpid());
+    FILE* f = fopen(tmpPath.c_str(), "wb");
+    if (f == nullptr) return false;
+
+    bool ok = fwrite(StoreMagic, sizeof(StoreMagic), 1, f) == 1 && write_u64(f, m_entries.size());
+    for (const auto& it: m_entries) {
+        const Entry& entry = it.second;
+        ok = ok && write_str(f, it.first) && write_u64(f, entry.inode) && write_u64(f, entry.size)
+            && write_u64(f, entry.mtimeSec) && write_u64(f, entry.mtimeNsec) && write_u64(f, entry.scriptHash)
+            && write_result(f, entry.result);
+    }
+
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmpPath.c_str(), m_path.c_str()) != 0) {
+        unlink(tmpPath.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+const FileResult* ResultStore::find(const std::string& cfg, const struct stat& st) const
+{
+    auto it = m_entries.find(cfg);
+    if (it == m_entries.end()) return nullptr;
+
+    const Entry& entry = it->second;
+    const bool same = entry.inode == (uint64_t)st.st_ino && entry.size == (uint64_t)st.st_size
+        && entry.mtimeSec == (uint64_t)st.st_mtim.tv_sec && entry.mtimeNsec == (uint64_t)st.st_mtim.tv_nsec
+        && entry.scriptHash == m_scriptHash;
+
+    return same ? &entry.result : nullptr;
+}
+
+void ResultStore::put(const std::string& cfg, const struct stat& st, FileResult result)
+{
+    Entry& entry = m_entries[cfg];
+    entry.inode = st.st_ino;
+    entry.size = st.st_size;
+    entry.mtimeSec = st.st_mtim.tv_sec;
+    entry.mtimeNsec = st.st_mtim.tv_nsec;
+    entry.scriptHash = m_scriptHash;
+    entry.result = std::move(result);
+}
+
+/**********************************************************************
+ */
+OutputCapture::~OutputCapture()
+{
+    if (m_saved >= 0) {
+        std::string output;
+        finish(output);
+    }
+}
+
+bool OutputCapture::start()
+{
+    fflush(stdout);
+
+    m_file = tmpfile();
+    if (m_file == nullptr) return false;
+
+    m_saved = dup(STDOUT_FILENO);
+    if (m_saved < 0 || dup2(fileno(m_file), STDOUT_FILENO) < 0) {
+        if (m_saved >= 0) close(m_saved);
+        m_saved = -1;
+        fclose(m_file);
+        m_file = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+void OutputCapture::finish(std::string& output, bool echo)
+{
+    output.clear();
+    if (m_file == nullptr) return;
+
+    fflush(stdout);
+    dup2(m_saved, STDOUT_FILENO);
+    close(m_saved);
+    m_saved = -1;
+
+    rewind(m_file);
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), m_file)) > 0) {
+        output.append(buf, n);
+    }
+    fclose(m_file);
+    m_file = nullptr;
+
+    if (echo) fwrite(output.data(), 1, output.size(), stdout);
+}
+
+} // namespace brie
@@ -0,0 +1,119 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <cstdint>
+#include <stdio.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+
+namespace brie {
+
+/*****************************************************************
+ *   Value a script body added to an aggregate with emit().
+ */
+struct Contribution
+{
+    std::string name;
+    bool isInt = true;
+    int64_t intValue = 0;
+    double floatValue = 0;
+};
+
+using Contributions = std::vector<Contribution>;
+
+/*****************************************************************
+ *   What the body produced for one file: the sums it emitted and
+ *   everything it printed to stdout.
+ */
+struct FileResult
+{
+    Contributions sums;
+    std::string output;
+};
+
+// Write or read a result as the numbers of the sums, the sums and
+// the output. Return false on errors or damaged data.
+bool write_result(FILE* f, const FileResult& result);
+bool read_result(FILE* f, FileResult& result);
+
+/*****************************************************************
+ *   Results of the body for files processed by earlier runs, kept
+ *   in one store file. A result is reused only for the same path,
+ *   inode, size, mtime and script.
+ */
+class ResultStore
+{
+public:
+    ResultStore(const std::string& path, uint64_t scriptHash);
+
+    // Read the store; a missing or damaged store is empty.
+    void load();
+
+    // Write the store; returns false on failure.
+    bool save() const;
+
+    const FileResult* find(const std::string& cfg, const struct stat& st) const;
+    void put(const std::string& cfg, const struct stat& st, FileResult result);
+
+private:
+    struct Entry
+    {
+        uint64_t inode = 0;
+        uint64_t size = 0;
+        uint64_t mtimeSec = 0;
+        uint64_t mtimeNsec = 0;
+        uint64_t scriptHash = 0;
+        FileResult result;
+    };
+
+private:
+    std::string m_path;
+    uint64_t m_scriptHash;
+    std::unordered_map<std::string, Entry> m_entries; // By source path
+};
+
+/*****************************************************************
+ *   Redirects stdout to a temporary file until finish(), which
+ *   returns the captured text and writes it to the real stdout
+ *   unless "echo" is false.
+ */
+class OutputCapture
+{
+public:
+    OutputCapture() : m_saved(-1), m_file(nullptr) {}
+    ~OutputCapture();
+
+    OutputCapture(const OutputCapture&) = delete;
+    OutputCapture& operator=(const OutputCapture&) = delete;
+
+    // Returns false if stdout could not be redirected
+    bool start();
+    void finish(std::string& output, bool echo = true);
+
+private:
+    int m_saved;   // Descriptor of the real stdout
+    FILE* m_file;
+};
+
+// Stable hash of text, e.g. of a script
+uint64_t hash_text(const std::string& text, uint64_t hash = 14695981039346656037ull);
+
+} // namespace brie
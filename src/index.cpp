@@ -0,0 +1,330 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "index.h"
+#include "error.h"
+#include "utils/log.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace brie {
+
+static const char IndexMagic[8] = { 'B', 'R', 'I', 'E', 'O', 'F', 'S', '1' };
+
+// Sidecar layout: the header, "count" entries in the order they were
+// added, "count" entry numbers sorted by key and the key strings.
+struct RecordIndex::Header
+{
+    char magic[8];
+    uint32_t keyType;
+    uint32_t reserved;
+    uint64_t inode;
+    uint64_t fileSize;
+    uint64_t mtimeSec;
+    uint64_t mtimeNsec;
+    uint64_t count;
+    uint64_t stringsSize;
+};
+
+struct RecordIndex::Entry
+{
+    uint64_t offset;
+    uint64_t key;    // Integer key or hash of a string key
+    uint32_t strPos; // String key in the strings
+    uint32_t strLen;
+};
+
+// FNV-1a
+static uint64_t hash_str(const char* str, size_t len)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= static_cast<unsigned char>(str[i]);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static bool same_file(const struct stat& left, const struct stat& right)
+{
+    return left.st_ino == right.st_ino && left.st_size == right.st_size
+        && left.st_mtim.tv_sec == right.st_mtim.tv_sec && left.st_mtim.tv_nsec == right.st_mtim.tv_nsec;
+}
+
+/**********************************************************************
+ */
+std::string sidecar_path(const std::string& path, const std::string& suffix, const std::string& dir)
+{
+    if (dir.empty()) return path + suffix;
+
+    char* real = realpath(path.c_str(), nullptr);
+    std::string name = real != nullptr ? real : path;
+    free(real);
+    std::replace(name.begin(), name.end(), '/', '%');
+    return dir + "/" + name + suffix;
+}
+
+static std::string index_suffix(const std::string& name, size_t base)
+{
+    if (base == 0) return "." + name + ".bidx";
+    return "." + name + "@" + std::to_string(base) + ".bidx";
+}
+
+RecordIndex::RecordIndex(const std::string& path, const std::string& name, size_t base, const std::string& dir)
+    : m_path(path)
+    , m_sidecar(sidecar_path(path, index_suffix(name, base), dir))
+    , m_building(false)
+    , m_buildType(KeyNone)
+    , m_map(nullptr)
+    , m_mapSize(0)
+    , m_header(nullptr)
+    , m_mapEntries(nullptr)
+    , m_sorted(nullptr)
+    , m_mapStrings(nullptr)
+{
+    memset(&m_stat, 0, sizeof(m_stat));
+}
+
+RecordIndex::~RecordIndex()
+{
+    unmap();
+}
+
+void RecordIndex::unmap()
+{
+    if (m_map != nullptr) munmap(const_cast<char*>(m_map), m_mapSize);
+    m_map = nullptr;
+    m_header = nullptr;
+}
+
+bool RecordIndex::load()
+{
+    unmap();
+
+    struct stat st;
+    if (stat(m_path.c_str(), &st) != 0) return false;
+
+    int fd = open(m_sidecar.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat sidecarStat;
+    void* ptr = MAP_FAILED;
+    if (fstat(fd, &sidecarStat) == 0 && (size_t)sidecarStat.st_size >= sizeof(Header)) {
+        ptr = mmap(nullptr, sidecarStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (ptr == MAP_FAILED) return false;
+
+    m_map = static_cast<const char*>(ptr);
+    m_mapSize = sidecarStat.st_size;
+
+    const Header* header = reinterpret_cast<const Header*>(m_map);
+    const size_t count = header->count;
+    const bool valid = memcmp(header->magic, IndexMagic, sizeof(IndexMagic)) == 0
+        && header->keyType <= KeyStr && header->inode == (uint64_t)st.st_ino
+        && header->fileSize == (uint64_t)st.st_size && header->mtimeSec == (uint64_t)st.st_mtim.tv_sec
+        && header->mtimeNsec == (uint64_t)st.st_mtim.tv_nsec
+        && count <= m_mapSize / (sizeof(Entry) + sizeof(uint64_t))
+        && m_mapSize == sizeof(Header) + count * (sizeof(Entry) + sizeof(uint64_t)) + header->stringsSize;
+    if (!valid) {
+        LOG_DEBUG << "Ignore stale index " << m_sidecar;
+        unmap();
+        return false;
+    }
+
+    m_header = header;
+    m_mapEntries = reinterpret_cast<const Entry*>(m_map + sizeof(Header));
+    m_sorted = reinterpret_cast<const uint64_t*>(m_mapEntries + count);
+    m_mapStrings = reinterpret_cast<const char*>(m_sorted + count);
+    return true;
+}
+
+/**********************************************************************
+ */
+void RecordIndex::start(KeyType type)
+{
+    if (m_building) {
+        if (type != m_buildType) throwex("Index keys must all be of the same type");
+        return;
+    }
+
+    if (stat(m_path.c_str(), &m_stat) != 0) throwex("Index: failed to get file status of " + m_path);
+
+    m_building = true;
+    m_buildType = type;
+    m_entries.clear();
+    m_strings.clear();
+}
+
+void RecordIndex::add(uint64_t offset)
+{
+    start(KeyNone);
+    m_entries.push_back(Entry{ offset, 0, 0, 0 });
+}
+
+void RecordIndex::add(uint64_t offset, int64_t key)
+{
+    start(KeyInt);
+    m_entries.push_back(Entry{ offset, static_cast<uint64_t>(key), 0, 0 });
+}
+
+void RecordIndex::add(uint64_t offset, const std::string& key)
+{
+    start(KeyStr);
+    if (m_strings.size() + key.size() > UINT32_MAX) throwex("Index keys are too long");
+
+    m_entries.push_back(Entry{ offset, hash_str(key.data(), key.size()), (uint32_t)m_strings.size(), (uint32_t)key.size() });
+    m_strings += key;
+}
+
+bool RecordIndex::save()
+{
+    if (!m_building) return false;
+    m_building = false;
+
+    struct stat st;
+    if (stat(m_path.c_str(), &st) != 0 || !same_file(st, m_stat)) {
+        LOG_DEBUG << "File changed while indexing " << m_path;
+        return false;
+    }
+
+    // Entry numbers in the order of keys; equal keys keep the record order
+    std::vector<uint64_t> sorted(m_entries.size());
+    std::iota(sorted.begin(), sorted.end(), 0);
+    if (m_buildType == KeyInt) {
+        std::stable_sort(sorted.begin(), sorted.end(), [this](uint64_t left, uint64_t right) {
+            return (int64_t)m_entries[left].key < (int64_t)m_entries[right].key;
+        });
+    } else if (m_buildType == KeyStr) {
+        std::stable_sort(sorted.begin(), sorted.end(), [this](uint64_t left, uint64_t right) {
+            return m_entries[left].key < m_entries[right].key;
+        });
+    }
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IndexMagic, sizeof(IndexMagic));
+    header.keyType = m_buildType;
+    header.inode = st.st_ino;
+    header.fileSize = st.st_size;
+    header.mtimeSec = st.st_mtim.tv_sec;
+    header.mtimeNsec = st.st_mtim.tv_nsec;
+    header.count = m_entries.size();
+    header.stringsSize = m_strings.size();
+
+    unmap();
+
+    const std::string tmpPath = m_sidecar + "." + std::to_string(getpid());
+    FILE* f = fopen(tmpPath.c_str(), "wb");
+    if (f == nullptr) {
+        LOG_DEBUG << "Failed to create index " << m_sidecar;
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = ok && (m_entries.empty() || fwrite(m_entries.data(), sizeof(Entry), m_entries.size(), f) == m_entries.size());
+    ok = ok && (sorted.empty() || fwrite(sorted.data(), sizeof(uint64_t), sorted.size(), f) == sorted.size());
+    ok = ok && (m_strings.empty() || fwrite(m_strings.data(), m_strings.size(), 1, f) == 1);
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmpPath.c_str(), m_sidecar.c_str()) != 0) {
+        LOG_DEBUG << "Failed to write index " << m_sidecar;
+        unlink(tmpPath.c_str());
+        return false;
+    }
+
+    m_entries.clear();
+    m_entries.shrink_to_fit();
+    m_strings.clear();
+
+    return load();
+}
+
+/**********************************************************************
+ */
+size_t RecordIndex::count() const
+{
+    return m_header != nullptr ? m_header->count : 0;
+}
+
+RecordIndex::KeyType RecordIndex::key_type() const
+{
+    return m_header != nullptr ? static_cast<KeyType>(m_header->keyType) : KeyNone;
+}
+
+uint64_t RecordIndex::offset(size_t i) const
+{
+    return m_mapEntries[i].offset;
+}
+
+int64_t RecordIndex::int_key(size_t i) const
+{
+    return static_cast<int64_t>(m_mapEntries[i].key);
+}
+
+std::string RecordIndex::str_key(size_t i) const
+{
+    const Entry& entry = m_mapEntries[i];
+    if ((uint64_t)entry.strPos + entry.strLen > m_header->stringsSize) throwex("Index is corrupted");
+    return std::string(m_mapStrings + entry.strPos, entry.strLen);
+}
+
+size_t RecordIndex::find(int64_t key) const
+{
+    if (key_type() != KeyInt) return npos;
+
+    const uint64_t* end = m_sorted + count();
+    const uint64_t* it = std::lower_bound(m_sorted, end, key, [this](uint64_t i, int64_t value) {
+        return static_cast<int64_t>(m_mapEntries[i].key) < value;
+    });
+    if (it == end || static_cast<int64_t>(m_mapEntries[*it].key) != key) return npos;
+    return *it;
+}
+
+size_t RecordIndex::find(const std::string& key) const
+{
+    if (key_type() != KeyStr) return npos;
+    return find_hash(hash_str(key.data(), key.size()), key.data(), key.size());
+}
+
+size_t RecordIndex::find_hash(uint64_t hash, const char* str, size_t len) const
+{
+    const uint64_t* end = m_sorted + count();
+    const uint64_t* it = std::lower_bound(m_sorted, end, hash, [this](uint64_t i, uint64_t value) {
+        return m_mapEntries[i].key < value;
+    });
+
+    // Strings with the same hash follow each other
+    for (; it != end && m_mapEntries[*it].key == hash; ++it) {
+        const Entry& entry = m_mapEntries[*it];
+        if (entry.strLen == len && (uint64_t)entry.strPos + len <= m_header->stringsSize
+            && memcmp(m_mapStrings + entry.strPos, str, len) == 0) {
+            return *it;
+        }
+    }
+
+    return npos;
+}
+
+} // namespace brie
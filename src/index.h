@@ -0,0 +1,114 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+namespace brie {
+
+/*****************************************************************
+ *   Offsets of records in a file, optionally with a key of each
+ *   record, saved in a sidecar "<file>.<name>.bidx" next to it or in
+ *   the index directory (--index-dir). Offsets of an index of a part
+ *   of the file that starts at "base" are relative to that part and
+ *   the sidecar is "<file>.<name>@<base>.bidx". A later run maps the sidecar and jumps to a record by its key
+ *   or walks the offsets instead of parsing every record from the
+ *   start. The sidecar is used only while the inode, size and mtime
+ *   of the file match the ones it was built for.
+ *
+ *   Keys are integers or strings; strings are looked up by a hash
+ *   and then compared. An index with no keys only keeps offsets.
+ */
+class RecordIndex
+{
+public:
+    enum KeyType { KeyNone, KeyInt, KeyStr };
+
+    RecordIndex(const std::string& path, const std::string& name, size_t base = 0, const std::string& dir = std::string());
+    ~RecordIndex();
+
+    RecordIndex(const RecordIndex&) = delete;
+    RecordIndex& operator=(const RecordIndex&) = delete;
+
+    // Map the sidecar. Returns false if it is missing or was built
+    // for another version of the file.
+    bool load();
+
+    // Record a new entry. The first entry starts a new index.
+    void add(uint64_t offset);
+    void add(uint64_t offset, int64_t key);
+    void add(uint64_t offset, const std::string& key);
+
+    // Write the entries added so far to the sidecar and map it.
+    // Nothing is written if the file changed meanwhile.
+    bool save();
+
+    bool loaded() const { return m_map != nullptr; }
+    bool building() const { return m_building; }
+    const std::string& sidecar() const { return m_sidecar; }
+
+    // Entries of the loaded index in the order they were added
+    size_t count() const;
+    KeyType key_type() const;
+    uint64_t offset(size_t i) const;
+    int64_t int_key(size_t i) const;
+    std::string str_key(size_t i) const;
+
+    // Number of the first entry with "key" or npos
+    size_t find(int64_t key) const;
+    size_t find(const std::string& key) const;
+
+    static constexpr size_t npos = SIZE_MAX;
+
+private:
+    struct Header;
+    struct Entry;
+
+    void start(KeyType type);
+    void unmap();
+    size_t find_hash(uint64_t hash, const char* str, size_t len) const;
+
+private:
+    std::string m_path;
+    std::string m_sidecar;
+    struct stat m_stat;  // The file when the index was started
+
+    // Entries being added
+    bool m_building;
+    KeyType m_buildType;
+    std::vector<Entry> m_entries;
+    std::string m_strings;
+
+    // Mapped sidecar
+    const char* m_map;
+    size_t m_mapSize;
+    const Header* m_header;
+    const Entry* m_mapEntries;
+    const uint64_t* m_sorted;
+    const char* m_mapStrings;
+};
+
+// Path of a file kept for "path" with "suffix": next to it, or in
+// "dir" under the real path of the file with '/' turned into '%'
+std::string sidecar_path(const std::string& path, const std::string& suffix, const std::string& dir);
+
+} // namespace brie
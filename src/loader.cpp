@@ -0,0 +1,462 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "loader.h"
+#include "error.h"
+#include "stats.h"
+#include "utils/log.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace brie {
+
+// Files handled by one round trip to io_uring
+static constexpr unsigned RingBatch = 64;
+
+// Threads used when io_uring is not available
+static constexpr size_t PoolThreads = 8;
+
+static constexpr int OpenFlags = O_RDONLY | O_NONBLOCK | O_CLOEXEC;
+
+/**********************************************************************
+ */
+struct BatchLoader::Slot
+{
+    const std::string* cfg = nullptr;
+
+    int statRes = -1;
+    struct statx stx;
+
+    int fd = -1;
+    BufferPtr buffer;
+    size_t want = 0;
+    ssize_t readRes = -1;
+};
+
+/**********************************************************************
+ *   Minimal io_uring wrapper: it is used with raw system calls
+ *   to avoid depending on liburing.
+ */
+struct BatchLoader::Ring
+{
+    ~Ring();
+
+    bool init(unsigned entries);
+    io_uring_sqe* get_sqe();
+    int submit_and_wait(unsigned count);
+
+    template <class F> void reap(F func);
+
+    int fd = -1;
+    unsigned sqEntries = 0;
+
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned* sqMask = nullptr;
+    unsigned* sqArray = nullptr;
+    io_uring_sqe* sqes = nullptr;
+    unsigned localTail = 0;
+
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned* cqMask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+
+    void* sqPtr = MAP_FAILED;
+    size_t sqLen = 0;
+    void* cqPtr = MAP_FAILED;
+    size_t cqLen = 0;
+    size_t sqesLen = 0;
+};
+
+BatchLoader::Ring::~Ring()
+{
+    if (sqes != nullptr) munmap(sqes, sqesLen);
+    if (cqPtr != MAP_FAILED && cqPtr != sqPtr) munmap(cqPtr, cqLen);
+    if (sqPtr != MAP_FAILED) munmap(sqPtr, sqLen);
+    if (fd != -1) close(fd);
+}
+
+bool BatchLoader::Ring::init(unsigned entries)
+{
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) {
+        fd = -1;
+        return false;
+    }
+
+    sqEntries = p.sq_entries;
+    sqLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqLen = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+
+    const bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) sqLen = cqLen = std::max(sqLen, cqLen);
+
+    sqPtr = mmap(nullptr, sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sqPtr == MAP_FAILED) return false;
+
+    cqPtr = single ? sqPtr
+                   : mmap(nullptr, cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cqPtr == MAP_FAILED) return false;
+
+    sqesLen = p.sq_entries * sizeof(io_uring_sqe);
+    void* ptr = mmap(nullptr, sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ptr == MAP_FAILED) return false;
+    sqes = static_cast<io_uring_sqe*>(ptr);
+
+    char* sq = static_cast<char*>(sqPtr);
+    sqHead = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    sqTail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sqMask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    localTail = *sqTail;
+
+    char* cq = static_cast<char*>(cqPtr);
+    cqHead = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cqMask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+    return true;
+}
+
+io_uring_sqe* BatchLoader::Ring::get_sqe()
+{
+    unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    if (localTail - head >= sqEntries) return nullptr;
+
+    unsigned idx = localTail & *sqMask;
+    sqArray[idx] = idx;
+    localTail++;
+
+    io_uring_sqe* sqe = &sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int BatchLoader::Ring::submit_and_wait(unsigned count)
+{
+    __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, fd, count, count, IORING_ENTER_GETEVENTS, nullptr, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+}
+
+template <class F>
+void BatchLoader::Ring::reap(F func)
+{
+    unsigned head = *cqHead;
+    unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        const io_uring_cqe& cqe = cqes[head & *cqMask];
+        func(cqe.user_data, cqe.res);
+    }
+
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+}
+
+/**********************************************************************
+ *   Pool of threads that runs one job for every index of a batch.
+ */
+struct BatchLoader::Pool
+{
+    Pool(size_t count);
+    ~Pool();
+
+    void run(size_t count, const std::function<void(size_t)>& job);
+    void work();
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable cond;
+    const std::function<void(size_t)>* job = nullptr;
+    size_t count = 0;
+    std::atomic<size_t> next{0};
+    size_t busy = 0;
+    size_t generation = 0;
+    bool stop = false;
+};
+
+BatchLoader::Pool::Pool(size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        threads.emplace_back(&Pool::work, this);
+    }
+}
+
+BatchLoader::Pool::~Pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cond.notify_all();
+
+    for (auto& t: threads) t.join();
+}
+
+void BatchLoader::Pool::run(size_t n, const std::function<void(size_t)>& func)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    job = &func;
+    count = n;
+    next = 0;
+    busy = threads.size();
+    generation++;
+    cond.notify_all();
+
+    cond.wait(lock, [this] { return busy == 0; });
+    job = nullptr;
+}
+
+void BatchLoader::Pool::work()
+{
+    size_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this, seen] { return stop || generation != seen; });
+            if (stop) return;
+            seen = generation;
+        }
+
+        for (size_t i = next++; i < count; i = next++) {
+            (*job)(i);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--busy == 0) cond.notify_all();
+    }
+}
+
+/**********************************************************************
+ */
+BatchLoader::BatchLoader(size_t bytes, bool useUring)
+  : m_bytes(bytes), m_opts(default_source_options())
+{
+    if (useUring) {
+        m_ring = std::make_unique<Ring>();
+        if (!m_ring->init(2 * RingBatch)) {
+            LOG_DEBUG << "io_uring is not available: " << strerror(errno);
+            m_ring.reset();
+        }
+    }
+
+    if (!m_ring) m_pool = std::make_unique<Pool>(PoolThreads);
+}
+
+BatchLoader::~BatchLoader()
+{
+}
+
+void BatchLoader::load(const std::vector<std::string>& cfgs, std::vector<PreparedSource>& items)
+{
+    std::vector<Slot> slots(cfgs.size());
+    for (size_t i = 0; i < cfgs.size(); i++) {
+        slots[i].cfg = &cfgs[i];
+    }
+
+    if (m_ring) {
+        load_uring(slots);
+    } else {
+        load_pool(slots);
+    }
+
+    items.resize(cfgs.size());
+    for (size_t i = 0; i < cfgs.size(); i++) {
+        items[i].cfg = cfgs[i];
+        complete(slots[i], items[i]);
+    }
+}
+
+// Decide how much to read after the file is opened and its size is known
+void BatchLoader::prepare_read(Slot& slot)
+{
+    if (slot.statRes != 0 || slot.fd < 0 || !S_ISREG(slot.stx.stx_mode)) return;
+
+    // Direct reads must not touch the page cache, followed files are mapped
+    if (m_opts.direct != 0 || m_opts.follow) return;
+
+    size_t size = slot.stx.stx_size;
+    size_t end = m_opts.limit != 0 ? std::min<size_t>(size, m_opts.limit) : size;
+
+    slot.want = size < m_opts.smallFile ? end : std::min(end, m_bytes);
+    slot.buffer = acquire_buffer(slot.want);
+}
+
+void BatchLoader::load_uring(std::vector<Slot>& slots)
+{
+    for (size_t start = 0; start < slots.size(); start += RingBatch) {
+        const size_t end = std::min(slots.size(), start + RingBatch);
+
+        // Round 1: statx and openat for the whole batch
+        unsigned count = 0;
+        for (size_t i = start; i < end; i++) {
+            Slot& slot = slots[i];
+
+            io_uring_sqe* sqe = m_ring->get_sqe();
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uint64_t>(slot.cfg->c_str());
+            sqe->len = STATX_TYPE | STATX_SIZE;
+            sqe->off = reinterpret_cast<uint64_t>(&slot.stx);
+            sqe->user_data = i * 2;
+
+            sqe = m_ring->get_sqe();
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uint64_t>(slot.cfg->c_str());
+            sqe->open_flags = OpenFlags;
+            sqe->user_data = i * 2 + 1;
+
+            count += 2;
+        }
+
+        if (m_ring->submit_and_wait(count) < 0) {
+            // The ring is unusable: the rest goes through the thread pool
+            LOG_DEBUG << "io_uring submit failed: " << strerror(errno);
+            m_ring.reset();
+            m_pool = std::make_unique<Pool>(PoolThreads);
+
+            std::vector<Slot> rest(std::make_move_iterator(slots.begin() + start),
+                                   std::make_move_iterator(slots.end()));
+            load_pool(rest);
+            std::move(rest.begin(), rest.end(), slots.begin() + start);
+            return;
+        }
+
+        for (unsigned done = 0; done < count; ) {
+            m_ring->reap([&](uint64_t data, int res) {
+                Slot& slot = slots[data / 2];
+                if (data % 2 == 0) slot.statRes = res < 0 ? res : 0;
+                else slot.fd = res;
+                done++;
+            });
+            if (done < count) m_ring->submit_and_wait(0);
+        }
+
+        // Round 2: first read of every regular file
+        count = 0;
+        for (size_t i = start; i < end; i++) {
+            Slot& slot = slots[i];
+            prepare_read(slot);
+            if (!slot.buffer || slot.want == 0) continue;
+
+            io_uring_sqe* sqe = m_ring->get_sqe();
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = slot.fd;
+            sqe->addr = reinterpret_cast<uint64_t>(slot.buffer->data.get());
+            sqe->len = slot.want;
+            sqe->off = 0;
+            sqe->user_data = i;
+            count++;
+        }
+
+        if (count == 0) continue;
+        m_ring->submit_and_wait(count);
+
+        for (unsigned done = 0; done < count; ) {
+            m_ring->reap([&](uint64_t data, int res) {
+                slots[data].readRes = res;
+                done++;
+            });
+            if (done < count) m_ring->submit_and_wait(0);
+        }
+    }
+}
+
+void BatchLoader::load_pool(std::vector<Slot>& slots)
+{
+    m_pool->run(slots.size(), [this, &slots](size_t i) {
+        Slot& slot = slots[i];
+        const char* path = slot.cfg->c_str();
+
+        slot.statRes = statx(AT_FDCWD, path, 0, STATX_TYPE | STATX_SIZE, &slot.stx);
+        if (slot.statRes != 0) return;
+
+        slot.fd = open(path, OpenFlags);
+        prepare_read(slot);
+        if (!slot.buffer || slot.want == 0) return;
+
+        slot.readRes = pread(slot.fd, slot.buffer->data.get(), slot.want, 0);
+    });
+}
+
+// Create the source for a loaded slot
+void BatchLoader::complete(Slot& slot, PreparedSource& item)
+{
+    try {
+        if (!slot.buffer) {
+            // Not a regular file: the usual way handles it and its errors
+            if (slot.fd >= 0) close(slot.fd);
+            slot.fd = -1;
+            item.source = make_source(item.cfg.c_str(), m_opts);
+            return;
+        }
+
+        // Finish short or failed reads synchronously
+        size_t len = slot.readRes > 0 ? slot.readRes : 0;
+        while (len < slot.want) {
+            ssize_t n = pread(slot.fd, slot.buffer->data.get() + len, slot.want - len, len);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            len += n;
+        }
+        stats().bytesRead += len;
+
+        const size_t size = slot.stx.stx_size;
+        if (size < m_opts.smallFile) {
+            close(slot.fd);
+            slot.fd = -1;
+            item.source = make_small_file_source(item.cfg.c_str(), slot.buffer, len < slot.want ? len : size, m_opts);
+        } else {
+            slot.buffer.reset();
+            int fd = slot.fd;
+            slot.fd = -1;
+            item.source = make_file_source(item.cfg.c_str(), fd, m_opts);
+        }
+    } catch (const Error& err) {
+        item.error = err.what();
+    }
+
+    if (slot.fd >= 0) close(slot.fd);
+}
+
+} // namespace brie
@@ -0,0 +1,78 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "source.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace brie {
+
+/*****************************************************************
+ *   Source opened ahead of processing.
+ */
+struct PreparedSource
+{
+    std::string cfg;
+    SourcePtr source;   // Empty if the source failed to open
+    std::string error;  // Error message if the source failed to open
+};
+
+/*****************************************************************
+ *   Opens many files at once. Stat, open and the first read of
+ *   every file in a batch are issued together through io_uring,
+ *   so one thread keeps a deep storage queue busy. Without io_uring
+ *   the same steps run on a pool of threads using pread().
+ *
+ *   Small files are read completely and become SmallFileSource;
+ *   for larger ones the first "bytes" are read to warm the cache
+ *   and the file is mapped. Anything that is not a regular file
+ *   goes through make_source().
+ */
+class BatchLoader
+{
+public:
+    BatchLoader(size_t bytes, bool useUring);
+    ~BatchLoader();
+
+    BatchLoader(const BatchLoader&) = delete;
+    BatchLoader& operator=(const BatchLoader&) = delete;
+
+    // Open sources for "cfgs"; results are in the same order.
+    void load(const std::vector<std::string>& cfgs, std::vector<PreparedSource>& items);
+
+    bool uses_uring() const { return m_ring != nullptr; }
+
+private:
+    struct Slot;
+    struct Ring;
+    struct Pool;
+
+    void load_uring(std::vector<Slot>& slots);
+    void load_pool(std::vector<Slot>& slots);
+    void prepare_read(Slot& slot);
+    void complete(Slot& slot, PreparedSource& item);
+
+private:
+    size_t m_bytes;
+    SourceOptions m_opts;
+    std::unique_ptr<Ring> m_ring;
+    std::unique_ptr<Pool> m_pool;
+};
+
+} // namespace brie
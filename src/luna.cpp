@@ -21,21 +21,49 @@
 #include "parser.h"
 #include "error.h"
 #include "structs.h"
+#include "index.h"
+#include "sample.h"
+#include "where.h"
 #include "utils/log.h"
 #include <string.h>
+#include <algorithm>
+#include <new>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 namespace brie {
 
-static SourcePtr source;
-static bool isError = false;
-static std::string lastError;
+// Per thread, so chunk workers run their own Lua states in parallel
+static thread_local SourcePtr source;
+static thread_local std::vector<SourcePtr> savedSources; // Sources replaced by snapshots
+struct OpenIndex
+{
+    std::weak_ptr<Source> owner; // Underlying source; saved once it is gone
+    std::unique_ptr<RecordIndex> index;
+};
+static thread_local std::unordered_map<std::string, OpenIndex> indexes; // By file, base and index name
+static thread_local Contributions* contributions = nullptr; // Recording of emit()
+static thread_local size_t emitCount = 0;
+static thread_local bool isError = false;
+static thread_local std::string lastError;
+
+// Sync marker declared with sync()
+struct SyncMarker
+{
+    std::string pattern; // Masked
+    std::string mask;
+    int validate = LUA_NOREF; // Function in the registry
+};
+static thread_local SyncMarker syncMarker;
 
 // Names of global variables
 static const char* BRIE_POS = "BRIE_POS";
 static const char* BRIE_PATH = "BRIE_PATH";
 static const char* BRIE_SIZE = "BRIE_SIZE";
+static const char* BRIE_DUP_OF = "BRIE_DUP_OF";
+static const char* BRIE_CHUNK = "BRIE_CHUNK";
+static const char* BRIE_OFFSET = "BRIE_OFFSET";
 
 /**************************************************************************
  */ 
@@ -44,6 +72,14 @@ void set_brie_pos_var(lua_State* L)
     if (!source) return;
     lua_pushinteger(L, source->pos());
     lua_setglobal(L, BRIE_POS);
+
+    // Until a stream ends BRIE_SIZE is kept past BRIE_POS, so loops
+    // "while BRIE_POS < BRIE_SIZE" read all of it
+    if (!source->sized()) {
+        if (source->pos() >= source->size()) source->grow(source->pos() + 1);
+        lua_pushinteger(L, source->size());
+        lua_setglobal(L, BRIE_SIZE);
+    }
 }
 
 void set_brie_path_var(lua_State* L)
@@ -60,11 +96,41 @@ void set_brie_size_var(lua_State* L)
     lua_setglobal(L, BRIE_SIZE);
 }
 
+void set_duplicate_vars(lua_State* L, const char* path, const char* dupOf)
+{
+    lua_pushstring(L, path);
+    lua_setglobal(L, BRIE_PATH);
+
+    if (dupOf != nullptr) lua_pushstring(L, dupOf);
+    else lua_pushnil(L);
+    lua_setglobal(L, BRIE_DUP_OF);
+}
+
 /**************************************************************************
  */ 
 int set_source(const char* cfg, lua_State *L)
 {
-    source = make_source(cfg);
+    return set_source(make_source(cfg), L);
+}
+
+// Save the indexes of sources that are no longer used
+static void flush_finished_indexes()
+{
+    for (auto it = indexes.begin(); it != indexes.end();) {
+        if (!it->second.owner.expired()) {
+            ++it;
+            continue;
+        }
+        it->second.index->save();
+        it = indexes.erase(it);
+    }
+}
+
+int set_source(SourcePtr src, lua_State *L)
+{
+    source = src;
+    savedSources.clear();
+    flush_finished_indexes();
     if (source) {
         set_brie_pos_var(L);
         set_brie_path_var(L);
@@ -74,21 +140,68 @@ int set_source(const char* cfg, lua_State *L)
     return source.get() != nullptr ? 0 : -1;
 }
 
+SourcePtr current_source()
+{
+    return source;
+}
+
+void flush_indexes()
+{
+    for (auto& it: indexes) {
+        it.second.index->save();
+    }
+    indexes.clear();
+}
+
 /**************************************************************************
  */ 
 static void retrieve(lua_State *L, const DataItem& item);
 
+// Makes another source, such as a snapshot, current until destroyed
+struct SourceSwitch
+{
+    SourceSwitch(SourcePtr other) : live(source) { source = other; }
+    ~SourceSwitch() { source = live; }
+    SourcePtr live;
+};
+
+// Copy "len" bytes at "pos" of the current source into a new source
+static SourcePtr make_snapshot(size_t pos, size_t len, size_t seqPos, Type seqType, size_t extra = 0)
+{
+    BufferPtr buffer = acquire_buffer(len + extra);
+    source->snapshot(pos, len, buffer->data.get(), seqPos, seqType);
+    memset(buffer->data.get() + len, 0, extra);
+
+    return make_buffer_source(source->name().c_str(), std::move(buffer), len + extra);
+}
+
 static void retrieve_struct(lua_State *L, const std::string& name)
 {
     const StructPtr sp = get_struct(name);
     const FieldList& fields = *sp;
 
+    // A struct with a sequence counter is decoded from a consistent copy.
+    // One zero byte is added for a fixed string at the end of the struct.
+    std::unique_ptr<SourceSwitch> snapshot;
+    size_t end = 0;
+    if (const Seqlock* seqlock = get_seqlock(name)) {
+        const size_t pos = source->pos();
+        const size_t size = get_sizeof(name.c_str());
+        snapshot = std::make_unique<SourceSwitch>(make_snapshot(pos, size, pos + seqlock->offset, seqlock->type, 1));
+        end = pos + size;
+    }
+
     lua_createtable(L, 0, fields.size());
 
     for (const Field& f: fields) {
         retrieve(L, f);
         if (f.type != VOID) lua_setfield(L, -2, f.name.c_str());
     }
+
+    if (snapshot) {
+        snapshot.reset();
+        source->set_pos(end);
+    }
 }
 
 static void retrieve(lua_State *L, const DataItem& item)
@@ -198,6 +311,174 @@ static int func_read (lua_State *L)
     return 0;
 }
 
+/**************************************************************************
+ */
+static size_t get_size_field(lua_State* L, int idx, const char* name, size_t value)
+{
+    int type = lua_getfield(L, idx, name);
+    if (type != LUA_TNIL) {
+        int64_t num = luaL_checkinteger(L, -1);
+        if (num < 0) throwex(std::string("Invalid value of option ") + name);
+        value = num;
+    }
+    lua_pop(L, 1);
+    return value;
+}
+
+// Read source options from the table at "idx" on top of the defaults
+static void get_source_options(lua_State* L, int idx, SourceOptions& opts)
+{
+    opts = default_source_options();
+    if (lua_isnoneornil(L, idx)) return;
+    luaL_checktype(L, idx, LUA_TTABLE);
+
+    if (lua_getfield(L, idx, "hint") != LUA_TNIL) {
+        opts.hints = 0;
+        opts.header = 0;
+        parse_hints(luaL_checkstring(L, -1), opts);
+    }
+    lua_pop(L, 1);
+
+    opts.retention = get_size_field(L, idx, "retain", opts.retention);
+    opts.window = get_size_field(L, idx, "window", opts.window);
+    opts.smallFile = get_size_field(L, idx, "small_file", opts.smallFile);
+    opts.limit = get_size_field(L, idx, "limit", opts.limit);
+    opts.direct = get_size_field(L, idx, "odirect", opts.direct);
+    opts.cache = get_size_field(L, idx, "cache", opts.cache);
+}
+
+/**************************************************************************
+ *   Handles of open sources. Each handle keeps its own position, so a
+ *   script can read several sources without reopening them. The global
+ *   functions work on the current source, which is the last opened one
+ *   or the one selected with use().
+ */
+static const char* HandleMeta = "brie.source";
+
+static void push_handle(lua_State* L, SourcePtr src)
+{
+    void* mem = lua_newuserdata(L, sizeof(SourcePtr));
+    new (mem) SourcePtr(std::move(src));
+    luaL_setmetatable(L, HandleMeta);
+}
+
+static SourcePtr& check_handle(lua_State* L, int idx)
+{
+    SourcePtr& src = *static_cast<SourcePtr*>(luaL_checkudata(L, idx, HandleMeta));
+    if (!src) luaL_error(L, "Source is closed");
+    return src;
+}
+
+static int func_read(lua_State* L);
+static int func_set_position(lua_State* L);
+static int func_find(lua_State* L);
+static int func_slice(lua_State* L);
+static int func_inflate(lua_State* L);
+
+// Call "func" with the arguments that follow the handle while its
+// source is current
+static int call_with_handle(lua_State* L, lua_CFunction func)
+{
+    int status;
+    {
+        SourceSwitch handle(check_handle(L, 1));
+        lua_pushcfunction(L, func);
+        lua_replace(L, 1);
+        status = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+    }
+    set_brie_pos_var(L);
+
+    if (status != LUA_OK) return lua_error(L);
+    return lua_gettop(L);
+}
+
+static int handle_read(lua_State* L)
+{
+    return call_with_handle(L, func_read);
+}
+
+static int handle_set_position(lua_State* L)
+{
+    return call_with_handle(L, func_set_position);
+}
+
+static int handle_find(lua_State* L)
+{
+    return call_with_handle(L, func_find);
+}
+
+static int handle_slice(lua_State* L)
+{
+    return call_with_handle(L, func_slice);
+}
+
+static int handle_inflate(lua_State* L)
+{
+    return call_with_handle(L, func_inflate);
+}
+
+static int handle_pos(lua_State* L)
+{
+    lua_pushinteger(L, check_handle(L, 1)->pos());
+    return 1;
+}
+
+static int handle_size(lua_State* L)
+{
+    lua_pushinteger(L, check_handle(L, 1)->size());
+    return 1;
+}
+
+static int handle_path(lua_State* L)
+{
+    lua_pushstring(L, check_handle(L, 1)->name().c_str());
+    return 1;
+}
+
+// Make the source of the handle current
+static int handle_use(lua_State* L)
+{
+    set_source(check_handle(L, 1), L);
+    return 0;
+}
+
+// Release the source; it stays alive while it is current
+static int handle_close(lua_State* L)
+{
+    check_handle(L, 1).reset();
+    return 0;
+}
+
+static int handle_gc(lua_State* L)
+{
+    static_cast<SourcePtr*>(luaL_checkudata(L, 1, HandleMeta))->~SourcePtr();
+    return 0;
+}
+
+static void register_handle(lua_State* L)
+{
+    static const luaL_Reg methods[] = {
+        { "read", handle_read },
+        { "setpos", handle_set_position },
+        { "find", handle_find },
+        { "slice", handle_slice },
+        { "inflate", handle_inflate },
+        { "pos", handle_pos },
+        { "size", handle_size },
+        { "path", handle_path },
+        { "use", handle_use },
+        { "close", handle_close },
+        { "__gc", handle_gc },
+        { nullptr, nullptr }
+    };
+
+    luaL_newmetatable(L, HandleMeta);
+    luaL_setfuncs(L, methods, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+}
+
 /**************************************************************************
  */
 static int func_open_wrapped(lua_State* L)
@@ -208,7 +489,11 @@ static int func_open_wrapped(lua_State* L)
         return 0;
     }
 
-    source = make_source(cfg);
+    SourceOptions opts;
+    get_source_options(L, 2, opts);
+
+    source = open_source(cfg, opts);
+    savedSources.clear();
     if (!source) {
         luaL_error(L, "%s %s", "Failed to open source ", cfg);
         return 0;
@@ -217,7 +502,9 @@ static int func_open_wrapped(lua_State* L)
     set_brie_path_var(L);
     set_brie_size_var(L);
 
-    return 0;
+    push_handle(L, source);
+
+    return 1;
 }
 
 static int func_open(lua_State* L)
@@ -236,7 +523,7 @@ static int func_open(lua_State* L)
 static int func_declare_wrapped(lua_State* L)
 {
     int count = lua_gettop(L);
-    if (count != 1 && count != 2) {
+    if (count != 1 && count != 2 && count != 3) {
         luaL_error(L, "Invalid parameters count");
         return 0;
     }
@@ -263,6 +550,14 @@ static int func_declare_wrapped(lua_State* L)
 
     add_struct(name, sp);
 
+    if (count == 3) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        if (lua_getfield(L, 3, "seqlock") != LUA_TNIL) {
+            set_seqlock(name, luaL_checkstring(L, -1));
+        }
+        lua_pop(L, 1);
+    }
+
     return 0;
 }
 
@@ -293,6 +588,7 @@ static int func_set_position_wrapped(lua_State* L)
     if (paramType == LUA_TSTRING) {
         const char* param = luaL_checkstring(L, 1);
         source->set_test_pos(param);
+        set_brie_pos_var(L);
         return 0;
     }
 
@@ -359,6 +655,746 @@ static int func_find(lua_State* L)
     return 0;
 }
 
+/**************************************************************************
+ */
+static int func_slice_wrapped(lua_State* L)
+{
+    if (!source) throwex("Source is not set");
+
+    const int64_t offset = luaL_checkinteger(L, 1);
+    const int64_t len = luaL_checkinteger(L, 2);
+    if (offset < 0 || len < 0) {
+        luaL_error(L, "Invalid slice bounds");
+        return 0;
+    }
+
+    push_handle(L, make_slice(source, offset, len));
+
+    return 1;
+}
+
+// Handle of a part of the current source with its own position
+static int func_slice(lua_State* L)
+{
+    try {
+        return func_slice_wrapped(L);
+    } catch (const Error& err) {
+        luaL_error(L, "%s", err.what().c_str());
+    }
+
+    return 0;
+}
+
+/**************************************************************************
+ */
+static int func_inflate_wrapped(lua_State* L)
+{
+    if (!source) throwex("Source is not set");
+
+    const int64_t offset = luaL_checkinteger(L, 1);
+    const int64_t len = luaL_checkinteger(L, 2);
+    if (offset < 0 || len <= 0) {
+        luaL_error(L, "Invalid compressed data bounds");
+        return 0;
+    }
+
+    bool raw = false;
+    if (!lua_isnoneornil(L, 3)) {
+        const char* format = luaL_checkstring(L, 3);
+        if (strcmp(format, "raw") == 0) raw = true;
+        else if (strcmp(format, "zlib") != 0) throwex("Invalid compression format");
+    }
+
+    push_handle(L, source->inflate(offset, len, raw));
+
+    return 1;
+}
+
+// Handle of a source with decompressed data of the current source
+static int func_inflate(lua_State* L)
+{
+    try {
+        return func_inflate_wrapped(L);
+    } catch (const Error& err) {
+        luaL_error(L, "%s", err.what().c_str());
+    }
+
+    return 0;
+}
+
+/**************************************************************************
+ *   Record indexes of the current source.
+ */
+// The source a slice of the current source is cut from and the offset
+// of the current source in it, so slices and handles of a file share
+// its indexes
+static SourcePtr index_base(size_t& base)
+{
+    SourcePtr src = source;
+    base = 0;
+    while (const SliceSource* slice = dynamic_cast<const SliceSource*>(src.get())) {
+        base += slice->offset();
+        src = slice->parent();
+    }
+    return src;
+}
+
+static std::string index_key(const char* name)
+{
+    if (!source) throwex("Source is not set");
+    if (*name == '\0' || strchr(name, '/') != nullptr) throwex("Invalid index name");
+
+    size_t base = 0;
+    const SourcePtr owner = index_base(base);
+    return owner->name() + '\n' + std::to_string(base) + '\n' + name;
+}
+
+static RecordIndex& get_index(const std::string& key, const char* name)
+{
+    size_t base = 0;
+    const SourcePtr owner = index_base(base);
+
+    OpenIndex& open = indexes[key];
+    open.owner = owner;
+    if (!open.index) {
+        open.index = std::make_unique<RecordIndex>(owner->name(), name, base, default_source_options().indexDir);
+    }
+    return *open.index;
+}
+
+// Index saved for the current version of the source or nullptr
+static RecordIndex* ready_index(const char* name)
+{
+    const std::string key = index_key(name);
+    RecordIndex& index = get_index(key, name);
+    if (index.building()) index.save();
+    if (!index.loaded()) index.load();
+
+    return index.loaded() ? &index : nullptr;
+}
+
+static int func_index_wrapped(lua_State* L)
+{
+    const char* name = luaL_checkstring(L, 1);
+    RecordIndex& index = get_index(index_key(name), name);
+
+    if (lua_isnoneornil(L, 2)) {
+        index.add(source->pos());
+    } else if (lua_isinteger(L, 2)) {
+        index.add(source->pos(), (int64_t)lua_tointeger(L, 2));
+    } else if (lua_type(L, 2) == LUA_TSTRING) {
+        size_t len = 0;
+        const char* key = lua_tolstring(L, 2, &len);
+        index.add(source->pos(), std::string(key, len));
+    } else {
+        throwex("Index key must be an integer or a string");
+    }
+
+    return 0;
+}
+
+// Add the current position with an optional key to an index
+static int func_index(lua_State* L)
+{
+    try {
+        return func_index_wrapped(L);
+    } catch (const Error& err) {
+        luaL_error(L, "%s", err.what().c_str());
+    }
+
+    return 0;
+}
+
+static int func_seek_index_wrapped(lua_State* L)
+{
+    const char* name = luaL_checkstring(L, 1);
+    luaL_checkany(L, 2);
+
+    const RecordIndex* index = ready_index(name);
+    if (index == nullptr) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    size_t entry = RecordIndex::npos;
+    if (lua_isinteger(L, 2)) {
+        entry = index->find((int64_t)lua_tointeger(L, 2));
+    } else if (lua_type(L, 2) == LUA_TSTRING) {
+        size_t len = 0;
+        const char* key = lua_tolstring(L, 2, &len);
+        entry = index->find(std::string(key, len));
+    }
+
+    if (entry != RecordIndex::npos) {
+        source->set_pos(index->offset(entry));
+        set_brie_pos_var(L);
+    }
+
+    lua_pushboolean(L, entry != RecordIndex::npos);
+    return 1;
+}
+
+// Go to the first record with a key: true if found, false if not, nil
+// if there is no index for this version of the source
+static int func_seek_index(lua_State* L)
+{
+    try {
+        return func_seek_index_wrapped(L);
+    } catch (const Error& err) {
+        luaL_error(L, "%s", err.what().c_str());
+    }
+
+    return 0;
+}
+
+static int func_index_count_wrapped(lua_State* L)
+{
+    const RecordIndex* index = ready_index(luaL_checkstring(L, 1));
+    if (index == nullptr) {
+        lua_pushnil(L);
+    } else {
+        lua_pushinteger(L, index->count());
+    }
+
+    return 1;
+}
+
+// Number of entries of an index or nil if there is none
+static int func_index_count(lua_State* L)
+{
+    try {
+        return func_index_count_wrapped(L);
+    } catch (const Error& err) {
+        luaL_error(L, "%s", err.what().c_str());
+    }
+
+    return 0;
+}
+
+static int index_next_wrapped(lua_State* L)
+{
+    const char* key = lua_tostring(L, lua_upvalueindex(1));
+    const lua_Integer i = lua_tointeger(L, lua_upvalueindex(2));
+
+    auto it = indexes.find(key);
+    if (it == indexes.end() || !it->second.index->loaded()) throwex("Index is closed");
+
+    const RecordIndex& index = *it->second.index;
+    if ((size_t)i >= index.count()) return 0;
+
+    lua_pushinteger(L, i + 1);
+    lua_replace(L, lua_upvalueindex(2));
+
+    lua_pushinteger(L, index.offset(i));
+    switch (index.key_type()) {
+        case RecordIndex::KeyInt:
+            lua_pushinteger(L, index.int_key(i));
+            return 2;
+        case RecordIndex::KeyStr: {
+            const std::string str = index.str_key(i);
+            lua_pushlstring(L, str.c_str(), str.length());
+            return 2;
+        }
+        default:
+            return 1;
+    }
+}
+
+static int index_next(lua_State* L)
+{
+    try {
+        return index_next_wrapped(L);
+    } catch (const Error& err) {
+        luaL_error(L, "%s", err.what().c_str());
+    }
+
+    return 0;
+}
+
+static int func_index_entries_wrapped(lua_State* L)
+{
+    const char* name = luaL_checkstring(L, 1);
+    if (ready_index(name) == nullptr) throwex(std::string("No index ") + name + " for this source");
+
+    const std::string key = index_key(name);
+    lua_pushlstring(L, key.c_str(), key.length());
+    lua_pushinteger(L, 0);
+    lua_pushcclosure(L, index_next, 2);
+    return 1;
+}
+
+// Iterator over the offsets and keys of an index in record order
+static int func_index_entries(lua_State* L)
+{
+    try {
+        return func_index_entries_wrapped(L);
+    } catch (const Error& err) {
+        luaL_error(L, "%s", err.what().c_str());
+    }
+
+    return 0;
+}
+
+/**************************************************************************
+ */
+static int func_atomic_snapshot_wrapped(lua_State* L)
+{
+    if (!source) throwex("Source is not set");
+
+    const int count = lua_gettop(L);
+    if (count < 2 || count > 4) {
+        luaL_error(L, "Invalid parameters count");
+        return 0;
+    }
+
+    const int64_t pos = luaL_checkinteger(L, 1);
+    const int64_t len = luaL_checkinteger(L, 2);
+    if (pos < 0 || len <= 0) {
+        luaL_error(L, "Invalid snapshot region");
+        return 0;
+    }
+
+    // Optional sequence counter: position and type, u32 by default
+    size_t seqPos = Source::nopos();
+    Type seqType = U32;
+    if (count >= 3) {
+        const int64_t value = luaL_checkinteger(L, 3);
+        if (value < 0) {
+            luaL_error(L, "Invalid sequence counter position");
+            return 0;
+        }
+        seqPos = value;
+    }
+    if (count == 4) {
+        DataItemList items;
+        parse_read_str(luaL_checkstring(L, 4), items);
+        if (items.size() != 1) throwex("Invalid sequence counter type");
+        seqType = items[0].type;
+    }
+
+    SourcePtr snapshot = make_snapshot(pos, len, seqPos, seqType);
+    savedSources.push_back(source);
+    source = snapshot;
+
+    set_brie_pos_var(L);
+    set_brie_size_var(L);
+
+    return 0;
+}
+
+static int func_atomic_snapshot(lua_State* L)
+{
+    try {
+        return func_atomic_snapshot_wrapped(L);
+    } catch (const Error& err) {
+        luaL_error(L, "%s", err.what().c_str());
+    }
+
+    return 0;
+}
+
+// Return to the source that was current before atomic_snapshot()
+static int func_restore(lua_State* L)
+{
+    if (savedSources.empty()) {
+        luaL_error(L, "No snapshot to restore from");
+        return 0;
+    }
+
+    source = savedSources.back();
+    savedSources.pop_back();
+
+    set_brie_pos_var(L);
+    set_brie_size_var(L);
+
+    return 0;
+}
+
+/**************************************************************************
+ *   Aggregates are global numbers that emit() adds to. The values can
+ *   be recorded per source and added again by a later run.
+ */
+void record_contributions(Contributions* to)
+{
+    contributions = to;
+}
+
+static void add_to_aggregate(lua_State* L, const char* name, int valueIdx, bool sample = true)
+{
+    const int type = lua_getglobal(L, name);
+    if (type != LUA_TNIL && type != LUA_TNUMBER) {
+        lua_pop(L, 1);
+        throwex(std::string("Aggregate ") + name + " is not a number");
+    }
+
+    if (type == LUA_TNIL) {
+        lua_pushvalue(L, valueIdx);
+    } else if (lua_isinteger(L, -1) && lua_isinteger(L, valueIdx)) {
+        lua_pushinteger(L, lua_tointeger(L, -1) + lua_tointeger(L, valueIdx));
+    } else {
+        lua_pushnumber(L, lua_tonumber(L, -1) + lua_tonumber(L, valueIdx));
+    }
+    lua_setglobal(L, name);
+    lua_pop(L, 1);
+
+    if (sample) sampler().add(name, lua_tonumber(L, valueIdx));
+}
+
+static void record(const char* name, lua_State* L, int valueIdx)
+{
+    auto it = std::find_if(contributions->begin(), contributions->end(),
+                           [name](const Contribution& c) { return c.name == name; });
+    if (it == contributions->end()) {
+        contributions->push_back(Contribution());
+        it = contributions->end() - 1;
+        it->name = name;
+    }
+
+    if (it->isInt && lua_isinteger(L, valueIdx)) {
+        it->intValue += lua_tointeger(L, valueIdx);
+        return;
+    }
+
+    if (it->isInt) {
+        it->isInt = false;
+        it->floatValue = it->intValue;
+    }
+    it->floatValue += lua_tonumber(L, valueIdx);
+}
+
+size_t emit_count()
+{
+    return emitCount;
+}
+
+void replay_contributions(lua_State* L, const Contributions& sums, bool sample)
+{
+    for (const Contribution& sum: sums) {
+        if (sum.isInt) lua_pushinteger(L, sum.intValue);
+        else lua_pushnumber(L, sum.floatValue);
+
+        add_to_aggregate(L, sum.name.c_str(), lua_gettop(L), sample);
+        if (contributions != nullptr) record(sum.name.c_str(), L, lua_gettop(L));
+        lua_pop(L, 1);
+    }
+}
+
+static int func_emit_wrapped(lua_State* L)
+{
+    const char* name = luaL_checkstring(L, 1);
+    luaL_checknumber(L, 2);
+
+    add_to_aggregate(L, name, 2);
+    if (contributions != nullptr) record(name, L, 2);
+    emitCount++;
+
+    return 0;
+}
+
+// Add a number to a global aggregate
+static int func_emit(lua_State* L)
+{
+    try {
+        return func_emit_wrapped(L);
+    } catch (const Error& err) {
+        luaL_error(L, "%s", err.what().c_str());
+    }
+
+    return 0;
+}
+
+/**************************************************************************
+ *   Parallel chunks of a source
+ */
+static int capture_print(lua_State* L)
+{
+    std::string* to = static_cast<std::string*>(lua_touserdata(L, lua_upvalueindex(1)));
+
+    const int count = lua_gettop(L);
+    for (int i = 1; i <= count; i++) {
+        size_t len = 0;
+        const char* str = luaL_tolstring(L, i, &len);
+        if (i > 1) to->push_back('\t');
+        to->append(str, len);
+        lua_pop(L, 1);
+    }
+    to->push_back('\n');
+
+    return 0;
+}
+
+static int capture_write(lua_State* L)
+{
+    std::string* to = static_cast<std::string*>(lua_touserdata(L, lua_upvalueindex(1)));
+
+    const int count = lua_gettop(L);
+    for (int i = 1; i <= count; i++) {
+        char buf[64];
+        if (lua_type(L, i) == LUA_TNUMBER) {
+            if (lua_isinteger(L, i)) snprintf(buf, sizeof(buf), LUA_INTEGER_FMT, lua_tointeger(L, i));
+            else snprintf(buf, sizeof(buf), LUA_NUMBER_FMT, lua_tonumber(L, i));
+            to->append(buf);
+        } else {
+            size_t len = 0;
+            const char* str = luaL_checklstring(L, i, &len);
+            to->append(str, len);
+        }
+    }
+
+    // io.write() returns the file, so calls can be chained
+    lua_getglobal(L, "io");
+    lua_getfield(L, -1, "stdout");
+    return 1;
+}
+
+void capture_output(lua_State* L, std::string* to)
+{
+    lua_pushlightuserdata(L, to);
+    lua_pushcclosure(L, capture_print, 1);
+    lua_setglobal(L, "print");
+
+    lua_getglobal(L, "io");
+    lua_pushlightuserdata(L, to);
+    lua_pushcclosure(L, capture_write, 1);
+    lua_setfield(L, -2, "write");
+    lua_pop(L, 1);
+}
+
+size_t call_resync(lua_State* L, size_t pos)
+{
+    if (!source) throwex("Source is not set");
+
+    if (lua_getglobal(L, "resync") != LUA_TFUNCTION) {
+        lua_pop(L, 1);
+        throwex("resync() is not defined");
+    }
+
+    const size_t saved = source->pos();
+    source->set_pos(pos);
+    set_brie_pos_var(L);
+
+    lua_pushinteger(L, pos);
+    if (lua_pcall(L, 1, 1, 0) != 0) {
+        const std::string msg = lua_tostring(L, -1) ? lua_tostring(L, -1) : "";
+        lua_pop(L, 1);
+        throwex("resync() failed: " + msg);
+    }
+
+    const size_t result = lua_isinteger(L, -1) && lua_tointeger(L, -1) >= 0 ? lua_tointeger(L, -1) : Source::nopos();
+    lua_pop(L, 1);
+
+    source->set_pos(saved);
+    set_brie_pos_var(L);
+
+    return result;
+}
+
+// Run the validation function of the sync marker for a candidate at
+// "pos". Errors, e.g. reading past the end, reject the candidate.
+static bool sync_valid(lua_State* L, size_t pos)
+{
+    source->set_pos(pos);
+    set_brie_pos_var(L);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, syncMarker.validate);
+    lua_pushinteger(L, pos);
+    const bool valid = lua_pcall(L, 1, 1, 0) == 0 && lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    return valid;
+}
+
+bool has_sync_marker()
+{
+    return !syncMarker.pattern.empty();
+}
+
+size_t find_sync(lua_State* L, size_t pos)
+{
+    if (!source) throwex("Source is not set");
+    if (!has_sync_marker()) throwex("Sync marker is not declared");
+
+    const size_t saved = source->pos();
+    size_t result = Source::nopos();
+    try {
+        while (true) {
+            const size_t found = source->find_masked(pos, syncMarker.pattern, syncMarker.mask);
+            if (found == Source::nopos()) break;
+
+            if (syncMarker.validate == LUA_NOREF || sync_valid(L, found)) {
+                result = found;
+                break;
+            }
+            pos = found + 1;
+        }
+    } catch (const Error&) {
+        source->set_pos(saved);
+        set_brie_pos_var(L);
+        throw;
+    }
+
+    source->set_pos(saved);
+    set_brie_pos_var(L);
+    return result;
+}
+
+// sync(pattern [, mask] [, validate]) - declare the sync marker that
+// starts records: bytes ANDed with "mask" equal "pattern". A candidate
+// is a record boundary if validate(pos) returns true.
+static int func_sync_wrapped(lua_State* L)
+{
+    size_t len = 0;
+    const char* pattern = luaL_checklstring(L, 1, &len);
+    if (len == 0) throwex("Empty sync pattern");
+
+    std::string mask(len, '\xFF');
+    int next = 2;
+    if (lua_type(L, next) == LUA_TSTRING) {
+        size_t maskLen = 0;
+        const char* str = lua_tolstring(L, next, &maskLen);
+        if (maskLen != len) throwex("Sync mask and pattern differ in length");
+        mask.assign(str, len);
+        next++;
+    }
+
+    int validate = LUA_NOREF;
+    if (!lua_isnoneornil(L, next)) {
+        luaL_checktype(L, next, LUA_TFUNCTION);
+        lua_pushvalue(L, next);
+        validate = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    if (syncMarker.validate != LUA_NOREF) luaL_unref(L, LUA_REGISTRYINDEX, syncMarker.validate);
+    syncMarker.pattern.assign(pattern, len);
+    syncMarker.mask = mask;
+    syncMarker.validate = validate;
+    for (size_t i = 0; i < len; i++) syncMarker.pattern[i] &= mask[i];
+
+    return 0;
+}
+
+static int func_sync(lua_State* L)
+{
+    try {
+        return func_sync_wrapped(L);
+    } catch (const Error& err) {
+        luaL_error(L, "%s", err.what().c_str());
+    }
+
+    return 0;
+}
+
+// find_sync([pos]) - position of the first record boundary at or after
+// "pos" (BRIE_POS by default) or -1
+static int func_find_sync_wrapped(lua_State* L)
+{
+    if (!source) throwex("Source is not set");
+
+    const int64_t pos = lua_isnoneornil(L, 1) ? source->pos() : luaL_checkinteger(L, 1);
+    if (pos < 0) throwex("Invalid position value");
+
+    const size_t found = find_sync(L, pos);
+    lua_pushinteger(L, found == Source::nopos() ? -1 : (int64_t)found);
+    return 1;
+}
+
+static int func_find_sync(lua_State* L)
+{
+    try {
+        return func_find_sync_wrapped(L);
+    } catch (const Error& err) {
+        luaL_error(L, "%s", err.what().c_str());
+    }
+
+    return 0;
+}
+
+void set_chunk_vars(lua_State* L, size_t index, size_t offset)
+{
+    lua_pushinteger(L, index);
+    lua_setglobal(L, BRIE_CHUNK);
+    lua_pushinteger(L, offset);
+    lua_setglobal(L, BRIE_OFFSET);
+}
+
+// where_match([pos]) - true if the record at "pos" (BRIE_POS by default)
+// passes --where; always true without --where
+static int func_where_match_wrapped(lua_State* L)
+{
+    if (!source) throwex("Source is not set");
+
+    const int64_t pos = lua_isnoneornil(L, 1) ? source->pos() : luaL_checkinteger(L, 1);
+    if (pos < 0) throwex("Invalid position value");
+
+    const Predicate* predicate = where_predicate();
+    lua_pushboolean(L, predicate == nullptr || predicate->match(*source, pos));
+    return 1;
+}
+
+static int func_where_match(lua_State* L)
+{
+    try {
+        return func_where_match_wrapped(L);
+    } catch (const Error& err) {
+        luaL_error(L, "%s", err.what().c_str());
+    }
+
+    return 0;
+}
+
+/**************************************************************************
+ *   Sampling of records and estimates of aggregates
+ */
+static int func_sample_wrapped(lua_State* L)
+{
+    if (!source) throwex("Source is not set");
+
+    const double rate = luaL_checknumber(L, 1);
+    if (rate < 0 || rate > 1) throwex("Sampling rate must be between 0 and 1");
+
+    if (lua_gettop(L) < 2) {
+        lua_pushboolean(L, sampler().pick_record(source->name(), rate));
+        return 1;
+    }
+
+    // Fixed-size records: move to the next sampled one
+    const int64_t size = luaL_checkinteger(L, 2);
+    if (size <= 0) throwex("Invalid record size");
+
+    const size_t left = source->pos() < source->size() ? (source->size() - source->pos()) / size : 0;
+    const size_t skip = sampler().skip_records(source->name(), rate, left);
+    const bool found = skip < left;
+
+    source->set_pos(found ? source->pos() + skip * size : source->size());
+    set_brie_pos_var(L);
+
+    lua_pushboolean(L, found);
+    return 1;
+}
+
+// sample(rate) - true if the current record is in the sample
+// sample(rate, size) - move to the next sampled record of "size" bytes
+static int func_sample(lua_State* L)
+{
+    try {
+        return func_sample_wrapped(L);
+    } catch (const Error& err) {
+        luaL_error(L, "%s", err.what().c_str());
+    }
+
+    return 0;
+}
+
+// Scaled total of an aggregate and its 95% error bound
+static int func_estimate(lua_State* L)
+{
+    const char* name = luaL_checkstring(L, 1);
+    const Estimate e = sampler().estimate(name);
+    lua_pushnumber(L, e.value);
+    lua_pushnumber(L, e.bound);
+    return 2;
+}
+
 /**************************************************************************
  */ 
 static int func_error(lua_State* L)
@@ -435,6 +1471,53 @@ void Luna::init()
     lua_pushcfunction(m_state, func_finish);
     lua_setglobal(m_state, "finish");
 
+    lua_pushcfunction(m_state, func_atomic_snapshot);
+    lua_setglobal(m_state, "atomic_snapshot");
+
+    lua_pushcfunction(m_state, func_restore);
+    lua_setglobal(m_state, "restore");
+
+    lua_pushcfunction(m_state, func_slice);
+    lua_setglobal(m_state, "slice");
+
+    lua_pushcfunction(m_state, func_inflate);
+    lua_setglobal(m_state, "inflate");
+
+    lua_pushcfunction(m_state, func_emit);
+    lua_setglobal(m_state, "emit");
+
+    lua_pushcfunction(m_state, func_sync);
+    lua_setglobal(m_state, "sync");
+
+    lua_pushcfunction(m_state, func_find_sync);
+    lua_setglobal(m_state, "find_sync");
+
+    lua_pushcfunction(m_state, func_where_match);
+    lua_setglobal(m_state, "where_match");
+
+    lua_pushcfunction(m_state, func_sample);
+    lua_setglobal(m_state, "sample");
+
+    lua_pushcfunction(m_state, func_estimate);
+    lua_setglobal(m_state, "estimate");
+
+    lua_pushcfunction(m_state, func_index);
+    lua_setglobal(m_state, "index");
+
+    lua_pushcfunction(m_state, func_seek_index);
+    lua_setglobal(m_state, "seek_index");
+
+    lua_pushcfunction(m_state, func_index_count);
+    lua_setglobal(m_state, "index_count");
+
+    lua_pushcfunction(m_state, func_index_entries);
+    lua_setglobal(m_state, "index_entries");
+
+    register_handle(m_state);
+
+    lua_pushcfunction(m_state, handle_use);
+    lua_setglobal(m_state, "use");
+
     const char* printf_str = "printf = function(s,...); return io.write(s:format(...)); end";
     luaL_loadstring(m_state, printf_str);
     lua_pcall(m_state, 0, LUA_MULTRET, 0);
@@ -17,6 +17,8 @@
 
 #pragma once
 #include "lua.hpp"
+#include "source.h"
+#include "incremental.h"
 #include <string>
 
 namespace brie {
@@ -52,6 +54,50 @@ private:
  *  Global function that sets a current source for binary reading
  */
 int set_source(const char* cfg, lua_State *L);
+int set_source(SourcePtr src, lua_State *L);
+SourcePtr current_source();
+
+// Collect the values passed to emit() into "to" until called with
+// nullptr. Values with the same name are summed.
+void record_contributions(Contributions* to);
+
+// Number of emit() calls made by scripts so far in this thread
+size_t emit_count();
+
+// Add values recorded by an earlier run to the aggregates, and to the
+// sampler unless its state is merged apart
+void replay_contributions(lua_State* L, const Contributions& sums, bool sample = true);
+
+// Make print() and io.write() of "L" append to "to" instead of
+// writing to stdout, so threads can collect their output apart.
+void capture_output(lua_State* L, std::string* to);
+
+// Call resync(pos) defined by the script with the current source at
+// "pos". Returns the first record boundary at or after "pos" or
+// Source::nopos() if resync() returns nil. Throws if resync() is not
+// defined or fails. The position of the source is not changed.
+size_t call_resync(lua_State* L, size_t pos);
+
+// True if the script declared a sync marker with sync()
+bool has_sync_marker();
+
+// Position of the first valid sync marker of the current source at or
+// after "pos", or Source::nopos(). The position of the source is not
+// changed. Throws if no marker is declared.
+size_t find_sync(lua_State* L, size_t pos);
+
+// Set BRIE_CHUNK to the number of the chunk a worker runs the body
+// for and BRIE_OFFSET to its offset in the whole source
+void set_chunk_vars(lua_State* L, size_t index, size_t offset);
+
+// Set BRIE_PATH to "path" and BRIE_DUP_OF to the path of the file it
+// duplicates, or to nil if "dupOf" is nullptr.
+void set_duplicate_vars(lua_State* L, const char* path, const char* dupOf);
+
+// Save the record indexes built by index() and forget all indexes.
+// Indexes are saved by set_source() only once their source is no
+// longer used; this saves the rest at the end of a run.
+void flush_indexes();
 
 } // namespace brie
 
@@ -19,12 +19,27 @@
  *   main.cpp
  */
 #include "luna.h"
+#include "source.h"
+#include "prefetch.h"
+#include "stats.h"
+#include "incremental.h"
+#include "dedupe.h"
+#include "where.h"
+#include "sample.h"
+#include "chunks.h"
+#include "fork.h"
+#include "structs.h"
 #include "error.h"
 #include <readline/readline.h>
 #include <readline/history.h>
 #include "utils/log.h"
+#include <signal.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <algorithm>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 using Lines = std::vector<std::string>;
@@ -37,6 +52,17 @@ static char defaultPrompt[] = "> ";
 static char inProcessPrompt[] = ">> ";
 static bool scriptToRepl = false;
 static size_t lineNum = 1;
+static bool showStats = false;
+static size_t prefetchDepth = 0;
+static size_t prefetchBytes = 128 * 1024;
+static size_t batchSize = 0;
+static bool useUring = true;
+static std::string incrementalStore;
+static bool dedupe = false;
+static size_t chunkCount = 0;
+static std::string resultOptions; // Options that change the results, see script_hash()
+static size_t forkCount = 0;
+static std::string recordStruct;
 
 struct LineCleaner { ~LineCleaner() { if (line != nullptr) { free(line); line = nullptr; }}};
 static char* my_readline(char* prompt = defaultPrompt);
@@ -45,6 +71,7 @@ static int process_script(brie::Luna& luna, const char* path, bool first, bool l
 static int process_multiple_files(int argc, char* argv[]);
 static int read_script(const char* path);
 static int process_lines(brie::Luna& luna, const Lines& lines, size_t lineNum);
+static int parse_options(int argc, char* argv[]);
 
 static brie::Luna luna;
 
@@ -53,8 +80,204 @@ static constexpr size_t MAX_PATH = 512;
 int main(int argc, char* argv[])
 {
     luna.init();
-    if (argc >= 2) return process_multiple_files(argc-1, argv+1);
-    return repl();
+
+    int count = parse_options(argc-1, argv+1);
+    if (count < 0) return 1;
+    argc -= count;
+    argv += count;
+
+    if (argc < 2) {
+        int ret = repl();
+        brie::flush_indexes();
+        return ret;
+    }
+
+    if (showStats) brie::start_stats();
+    int ret = process_multiple_files(argc-1, argv+1);
+    brie::flush_indexes();
+    if (showStats) brie::print_stats(stderr);
+
+    return ret;
+}
+
+/*****************************************************************
+ *   Command-line options precede the script. Each option is
+ *   either a flag "--name" or "--name value" or "--name=value".
+ */
+static bool parse_size(const char* str, size_t& value)
+{
+    char* end = nullptr;
+    unsigned long long num = strtoull(str, &end, 0);
+    if (end == str) return false;
+
+    switch (*end) {
+        case 'k': case 'K': num <<= 10; end++; break;
+        case 'm': case 'M': num <<= 20; end++; break;
+        case 'g': case 'G': num <<= 30; end++; break;
+        default: break;
+    }
+
+    if (*end != '\0') return false;
+    value = num;
+    return true;
+}
+
+// A fraction of sources "0.01" or "1%", or a number of them "1000"
+static bool parse_sample(const char* str)
+{
+    char* end = nullptr;
+    if (strpbrk(str, ".eE%") != nullptr) {
+        double rate = strtod(str, &end);
+        if (end == str) return false;
+        if (*end == '%') {
+            rate /= 100;
+            end++;
+        }
+        if (*end != '\0' || !(rate > 0 && rate <= 1)) return false;
+        brie::sampler().set_rate(rate);
+        return true;
+    }
+
+    size_t count = 0;
+    if (!parse_size(str, count) || count == 0) return false;
+    brie::sampler().set_count(count);
+    return true;
+}
+
+int parse_options(int argc, char* argv[])
+{
+    brie::SourceOptions& opts = brie::default_source_options();
+
+    int i = 0;
+    while (i < argc && strncmp(argv[i], "--", 2) == 0) {
+        std::string name = argv[i] + 2;
+        const char* value = nullptr;
+        i++;
+
+        if (name == "stats") {
+            showStats = true;
+            continue;
+        }
+
+        if (name == "dedupe") {
+            dedupe = true;
+            continue;
+        }
+
+        if (name == "follow") {
+            opts.follow = true;
+            continue;
+        }
+
+        // Read gzip and zstd files decompressed, see SourceOptions
+        if (name == "decompress") {
+            opts.decompress = true;
+            continue;
+        }
+
+        size_t eq = name.find('=');
+        if (eq != std::string::npos) {
+            value = argv[i-1] + 2 + eq + 1;
+            name.resize(eq);
+        } else if (i < argc) {
+            value = argv[i];
+            i++;
+        }
+
+        static const char* resultNames[] = { "max-bytes", "record", "where", "sample", "seed" };
+        for (const char* resultName: resultNames) {
+            if (name == resultName && value != nullptr) resultOptions += name + "=" + value + "\n";
+        }
+
+        if (name == "hint" && value != nullptr) {
+            try {
+                brie::parse_hints(value, opts);
+            } catch (const brie::Error& err) {
+                fprintf(stderr, "%s\n", err.what().c_str());
+                return -1;
+            }
+            continue;
+        }
+
+        if (name == "where" && value != nullptr) {
+            try {
+                brie::set_where(std::make_unique<brie::Predicate>(value));
+            } catch (const brie::Error& err) {
+                fprintf(stderr, "%s\n", err.what().c_str());
+                return -1;
+            }
+            continue;
+        }
+
+        if (name == "sample" && value != nullptr) {
+            if (!parse_sample(value)) {
+                fprintf(stderr, "Invalid value of --%s\n", name.c_str());
+                return -1;
+            }
+            continue;
+        }
+
+        if (name == "seed" && value != nullptr) {
+            size_t seed = 0;
+            if (!parse_size(value, seed)) {
+                fprintf(stderr, "Invalid value of --%s\n", name.c_str());
+                return -1;
+            }
+            brie::sampler().set_seed(seed);
+            continue;
+        }
+
+        if (name == "record" && value != nullptr) {
+            recordStruct = value;
+            continue;
+        }
+
+        // Keep record indexes and seek indexes of compressed files in a
+        // cache directory
+        if (name == "index-dir" && value != nullptr) {
+            opts.indexDir = value;
+            continue;
+        }
+
+        if (name == "incremental" && value != nullptr) {
+            incrementalStore = value;
+            continue;
+        }
+
+        if (name == "loader" && value != nullptr) {
+            if (strcmp(value, "uring") == 0) useUring = true;
+            else if (strcmp(value, "threads") == 0) useUring = false;
+            else {
+                fprintf(stderr, "Invalid value of --%s\n", name.c_str());
+                return -1;
+            }
+            continue;
+        }
+
+        size_t* sizeValue = nullptr;
+        if (name == "prefetch") sizeValue = &prefetchDepth;
+        else if (name == "batch") sizeValue = &batchSize;
+        else if (name == "prefetch-bytes") sizeValue = &prefetchBytes;
+        else if (name == "retain") sizeValue = &opts.retention;
+        else if (name == "window") sizeValue = &opts.window;
+        else if (name == "small-file") sizeValue = &opts.smallFile;
+        else if (name == "max-bytes") sizeValue = &opts.limit;
+        else if (name == "odirect") sizeValue = &opts.direct;
+        else if (name == "cache") sizeValue = &opts.cache;
+        else if (name == "chunks") sizeValue = &chunkCount; // Re-runs the prefix per chunk, see run_chunk()
+        else if (name == "fork") sizeValue = &forkCount;
+        else {
+            fprintf(stderr, "Unknown option --%s\n", name.c_str());
+            return -1;
+        }
+
+        if (value == nullptr || !parse_size(value, *sizeValue)) {
+            fprintf(stderr, "Invalid value of --%s\n", name.c_str());
+            return -1;
+        }
+    }
+
+    return i;
 }
 
 
@@ -177,14 +400,53 @@ int finish()
     return ret;
 }
 
+// Find the fields of --where once the prefix has declared the structs
+static int compile_where()
+{
+    brie::Predicate* predicate = brie::where_predicate();
+    if (predicate == nullptr) return 0;
+
+    try {
+        predicate->compile();
+    } catch (const brie::Error& err) {
+        fprintf(stderr, "%s\n", err.what().c_str());
+        return 1;
+    }
+    return 0;
+}
+
+// True if --where rejects the data at the start of the current source,
+// so the body is not run for it. Records further in are tested by the
+// script with where_match().
+static bool filtered_out()
+{
+    brie::Predicate* predicate = brie::where_predicate();
+    if (predicate == nullptr) return false;
+
+    brie::SourcePtr src = brie::current_source();
+    if (!src || predicate->match(*src, src->pos())) return false;
+
+    brie::stats().filtered++;
+    return true;
+}
+
+// Read the script and run the prefix
+static int start_script(const char* path)
+{
+    int ret = read_script(path);
+    if (ret != 0) return ret;
+
+    ret = process_lines(luna, prefix, 1);        
+    if (ret != 0) return ret;
+
+    return compile_where();
+}
+
 int process_script(brie::Luna& luna, const char* path, bool first, bool last)
 {
     int ret = 0;
     if (first) {
-        ret = read_script(path);
-        if (ret != 0) return ret;
-
-        ret = process_lines(luna, prefix, 1);        
+        ret = start_script(path);
         if (ret != 0) return ret;
     }
 
@@ -192,8 +454,10 @@ int process_script(brie::Luna& luna, const char* path, bool first, bool last)
 
     if (!prefix.empty()) lineNum = 2 + prefix.size(); // 1 to start with 1 and +1 to include %%
 
-    ret = process_lines(luna, body, lineNum);
-    if (ret != 0) return ret;
+    if (!filtered_out()) {
+        ret = process_lines(luna, body, lineNum);
+        if (ret != 0) return ret;
+    }
 
     if (scriptToRepl) return 0; // just executed body, don't execute prefix
 
@@ -204,6 +468,30 @@ int process_script(brie::Luna& luna, const char* path, bool first, bool last)
     return 0;
 }
 
+static void on_interrupt(int)
+{
+    brie::stop_following();
+}
+
+// Run the body for every following part of a source that delivers data
+// in parts (a ring buffer) until it ends or is interrupted.
+static int process_parts()
+{
+    brie::SourcePtr src = brie::current_source();
+    if (!src) return 0;
+
+    signal(SIGINT, on_interrupt);
+
+    int ret = 0;
+    while (ret == 0 && src->next()) {
+        brie::set_source(src, luna());
+        if (!filtered_out()) ret = process_lines(luna, body, lineNum);
+    }
+
+    signal(SIGINT, SIG_DFL);
+    return ret;
+}
+
 int process_source(const char* script, const char* source, bool first, bool last)
 {
     try {
@@ -216,6 +504,9 @@ int process_source(const char* script, const char* source, bool first, bool last
         ret = process_script(luna, script, first, last);
         if (ret != 0) return 1;
 
+        ret = process_parts();
+        if (ret != 0) return 1;
+
     } catch (const brie::Error& err) {
         fprintf(stderr, "Failed: %s\n", err.what().c_str());
         return 1;
@@ -224,6 +515,442 @@ int process_source(const char* script, const char* source, bool first, bool last
     return 0;
 }
 
+static int process_source(const char* script, const brie::Prefetcher::Item& item, bool first, bool last)
+{
+    if (!item.error.empty()) {
+        fprintf(stderr, "Failed: %s\n", item.error.c_str());
+        return 1;
+    }
+
+    try {
+        int ret = brie::set_source(item.source, luna());
+        if (ret != 0) {
+            fprintf(stderr, "Failed to open source %s\n", item.cfg.c_str());
+            return 1;
+        }
+
+        ret = process_script(luna, script, first, last);
+        if (ret != 0) return 1;
+
+        ret = process_parts();
+        if (ret != 0) return 1;
+
+    } catch (const brie::Error& err) {
+        fprintf(stderr, "Failed: %s\n", err.what().c_str());
+        return 1;
+    }
+
+    return 0;
+}
+
+// In the follow mode run the body for every batch of data appended to
+// the last source until it is interrupted. The body starts where the
+// previous run stopped, so old data is not read again.
+static int follow_source()
+{
+    if (!brie::default_source_options().follow) return 0;
+
+    brie::SourcePtr src = brie::current_source();
+    if (!src) return 0;
+
+    signal(SIGINT, on_interrupt);
+
+    try {
+        size_t done = src->pos();
+        while (true) {
+            // Wait when all data is read or the body did not advance
+            if (src->pos() >= src->size() || src->pos() == done) {
+                if (!src->grow(src->size() + 1)) break;
+            }
+            done = src->pos();
+
+            brie::set_source(src, luna());
+
+            int ret = process_lines(luna, body, lineNum);
+            if (ret != 0) return 1;
+        }
+    } catch (const brie::Error& err) {
+        fprintf(stderr, "Failed: %s\n", err.what().c_str());
+        return 1;
+    }
+
+    signal(SIGINT, SIG_DFL);
+    return 0;
+}
+
+// Run the body over one range of a source in a Lua state of its own.
+// The prefix runs again in that state so the functions and structs it
+// defines exist there; what it prints is dropped, but its other side
+// effects (files it writes, for one) happen once per chunk as well.
+// BRIE_CHUNK is already set when it runs, so a prefix can skip them
+// with "if not BRIE_CHUNK then ... end".
+static void run_chunk(const std::string& cfg, size_t index, const brie::ChunkRange& range, brie::ChunkResult& result)
+{
+    result.sampler = brie::sampler().part(index);
+    brie::use_sampler(&result.sampler);
+    struct SamplerReset { ~SamplerReset() { brie::use_sampler(nullptr); } } samplerReset;
+
+    brie::Luna worker;
+    worker.init();
+    brie::capture_output(worker(), &result.output);
+    brie::set_chunk_vars(worker(), index, range.offset);
+
+    if (process_lines(worker, prefix, 1) != 0) {
+        result.error = "The prefix failed";
+        return;
+    }
+    result.output.clear();
+
+    // With a sync marker each worker moves both ends of its range to
+    // the next valid marker itself, so neighbours meet at the same one
+    brie::SourcePtr whole = brie::make_source(cfg.c_str());
+    size_t start = range.offset;
+    size_t end = range.offset + range.size;
+    if (brie::has_sync_marker()) {
+        brie::set_source(whole, worker());
+        if (start != 0) start = std::min(brie::find_sync(worker(), start), whole->size());
+        if (end < whole->size()) end = std::min(brie::find_sync(worker(), end), whole->size());
+        end = std::max(start, end);
+    }
+
+    brie::set_source(brie::make_slice(whole, start, end - start), worker());
+    brie::set_chunk_vars(worker(), index, start);
+
+    brie::record_contributions(&result.sums);
+    process_lines(worker, body, prefix.empty() ? 1 : 2 + prefix.size());
+    brie::record_contributions(nullptr);
+}
+
+// With --chunks split a regular file into ranges that start at record
+// boundaries and run the body over them in parallel, each range as a
+// source of its own. The boundaries are multiples of the size of the
+// --record struct, the sync marker declared with sync() that workers
+// look for in parallel, or are found by resync(pos) defined by the
+// script.
+// The output and the aggregates of the ranges are merged in order.
+// The prefix runs in the main state and again in every chunk state,
+// see run_chunk(). Other sources are processed as usual.
+static int process_chunked(const char* script, const char* cfg, bool first)
+{
+    struct stat st;
+    if (stat(cfg, &st) != 0 || !S_ISREG(st.st_mode) || brie::default_source_options().follow) {
+        return process_source(script, cfg, first, false);
+    }
+
+    try {
+        int ret = brie::set_source(cfg, luna());
+        if (ret != 0) {
+            fprintf(stderr, "Failed to open source %s\n", cfg);
+            return 1;
+        }
+
+        if (first) {
+            ret = start_script(script);
+            if (ret != 0) return 1;
+        }
+        if (filtered_out()) return 0;
+
+        brie::AlignFunc align;
+        if (!recordStruct.empty()) {
+            const size_t recordSize = brie::get_sizeof(recordStruct.c_str());
+            align = [recordSize](size_t pos) { return (pos + recordSize - 1) / recordSize * recordSize; };
+        } else if (brie::has_sync_marker()) {
+            align = [](size_t pos) { return pos; };
+        } else {
+            align = [](size_t pos) { return brie::call_resync(luna(), pos); };
+        }
+
+        const std::vector<brie::ChunkRange> ranges = brie::split_chunks(brie::current_source()->size(), chunkCount, align);
+        const std::string path = cfg;
+        const std::vector<brie::ChunkResult> results = brie::run_chunks(ranges,
+            [&path](size_t index, const brie::ChunkRange& range, brie::ChunkResult& result) {
+                run_chunk(path, index, range, result);
+            });
+
+        for (const brie::ChunkResult& result: results) {
+            fwrite(result.output.data(), 1, result.output.size(), stdout);
+            brie::replay_contributions(luna(), result.sums, false);
+            brie::sampler().merge(result.sampler);
+            if (!result.error.empty()) {
+                fprintf(stderr, "Failed: %s\n", result.error.c_str());
+                return 1;
+            }
+        }
+    } catch (const brie::Error& err) {
+        fprintf(stderr, "Failed: %s\n", err.what().c_str());
+        return 1;
+    }
+
+    return 0;
+}
+
+// Hash of the script and of the options that change what the body
+// produces for a source, so stored results are not reused after
+// either changes
+static uint64_t script_hash()
+{
+    uint64_t hash = brie::hash_text("");
+    for (const Lines* lines: { &prefix, &body, &postfix }) {
+        for (const auto& str: *lines) hash = brie::hash_text(str, hash);
+        hash = brie::hash_text("%%\n", hash);
+    }
+    return brie::hash_text(resultOptions, hash);
+}
+
+// Open the first source and run the prefix with it set, as
+// process_script() does for the first source
+static int start_with_source(const char* script, const std::string& cfg)
+{
+    try {
+        if (brie::set_source(cfg.c_str(), luna()) != 0) {
+            fprintf(stderr, "Failed to open source %s\n", cfg.c_str());
+            return 1;
+        }
+    } catch (const brie::Error& err) {
+        fprintf(stderr, "Failed: %s\n", err.what().c_str());
+        return 1;
+    }
+
+    return start_script(script);
+}
+
+// Run the body only for regular files whose results cannot be reused.
+// With --incremental the results of files that did not change since
+// an earlier run are taken from the store; with --dedupe the results
+// of the first copy are reused for files with the same content. The
+// output and the values passed to emit() are replayed, so the postfix
+// sees the same aggregates as after a full run. For a duplicate
+// BRIE_PATH and BRIE_DUP_OF are set and on_duplicate() is called if
+// the script defines it. Sources are opened one by one and are not
+// followed.
+static int process_reusing(const char* script, const brie::Prefetcher::NextFunc& next)
+{
+    static const Lines duplicateHook = { "if on_duplicate then on_duplicate() end" };
+
+    std::string cfg;
+    if (!next(cfg)) return 0;
+
+    int ret = start_with_source(script, cfg);
+    if (ret != 0) return ret;
+
+    std::unique_ptr<brie::ResultStore> store;
+    if (!incrementalStore.empty()) {
+        store = std::make_unique<brie::ResultStore>(incrementalStore, script_hash());
+        store->load();
+    }
+
+    brie::DuplicateFinder duplicates;
+    std::unordered_map<std::string, brie::FileResult> firstCopies;
+    const size_t emitsBefore = brie::emit_count();
+    bool bodyRun = false;
+
+    for (bool more = true; more; more = next(cfg)) {
+        struct stat st;
+        const bool regular = stat(cfg.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+
+        const brie::FileResult* reused = nullptr;
+        std::string dupOf;
+        if (regular && store) {
+            reused = store->find(cfg, st);
+        }
+        if (regular && dedupe && reused == nullptr) {
+            dupOf = duplicates.find(cfg);
+            auto it = firstCopies.find(dupOf);
+            if (it != firstCopies.end()) reused = &it->second;
+        }
+
+        if (reused != nullptr) {
+            try {
+                brie::replay_contributions(luna(), reused->sums);
+            } catch (const brie::Error& err) {
+                fprintf(stderr, "Failed: %s\n", err.what().c_str());
+                return 1;
+            }
+            fwrite(reused->output.data(), 1, reused->output.size(), stdout);
+            brie::stats().replayed++;
+
+            if (!dupOf.empty()) {
+                brie::set_duplicate_vars(luna(), cfg.c_str(), dupOf.c_str());
+                ret = process_lines(luna, duplicateHook, 1);
+                if (ret != 0) return 1;
+                if (store) store->put(cfg, st, *reused);
+            }
+            brie::sampler().end_source();
+            continue;
+        }
+
+        brie::set_duplicate_vars(luna(), cfg.c_str(), nullptr);
+
+        brie::FileResult result;
+        brie::OutputCapture capture;
+        const bool capturing = regular && capture.start();
+        if (capturing) brie::record_contributions(&result.sums);
+
+        ret = chunkCount > 1 ? process_chunked(script, cfg.c_str(), false)
+                             : process_source(script, cfg.c_str(), false, false);
+        bodyRun = true;
+
+        brie::record_contributions(nullptr);
+        if (capturing) capture.finish(result.output);
+        if (ret != 0) return 1;
+        brie::sampler().end_source();
+
+        if (capturing && dedupe) firstCopies[cfg] = result;
+        if (capturing && store) store->put(cfg, st, std::move(result));
+    }
+
+    if (store && !store->save()) {
+        fprintf(stderr, "Failed to save results to %s\n", incrementalStore.c_str());
+    }
+
+    // Only output and emit() sums are replayed; aggregates kept in Lua
+    // globals or tables would be short by the reused sources
+    if (bodyRun && brie::emit_count() == emitsBefore) {
+        fprintf(stderr, "Warning: the body never called emit(), so reused results add nothing to aggregates\n");
+    }
+
+    return 0;
+}
+
+// With --fork run the prefix once and the body in worker processes
+// forked after it, which share what the prefix built copy-on-write.
+// The output and the values passed to emit() come back from the
+// workers and are merged in the order of the sources.
+static int process_forked(const char* script, const brie::Prefetcher::NextFunc& next)
+{
+    std::string firstCfg;
+    if (!next(firstCfg)) return 0;
+
+    int ret = start_with_source(script, firstCfg);
+    if (ret != 0) return ret;
+
+    bool firstPending = true;
+    auto nextSource = [&next, &firstCfg, &firstPending](std::string& cfg) {
+        if (!firstPending) return next(cfg);
+        cfg = firstCfg;
+        firstPending = false;
+        return true;
+    };
+
+    auto task = [script](const std::string& cfg, brie::FileResult& result) {
+        brie::OutputCapture capture;
+        const bool capturing = capture.start();
+        brie::record_contributions(&result.sums);
+
+        int ret = chunkCount > 1 ? process_chunked(script, cfg.c_str(), false)
+                                 : process_source(script, cfg.c_str(), false, false);
+
+        brie::record_contributions(nullptr);
+        brie::flush_indexes();
+        if (capturing) capture.finish(result.output, false);
+        return ret == 0;
+    };
+
+    auto done = [](const std::string&, const brie::FileResult& result) {
+        fwrite(result.output.data(), 1, result.output.size(), stdout);
+        brie::replay_contributions(luna(), result.sums);
+        brie::sampler().end_source();
+    };
+
+    try {
+        brie::WorkerPool pool(forkCount, task);
+        return pool.run(nextSource, done) ? 0 : 1;
+    } catch (const brie::Error& err) {
+        fprintf(stderr, "Failed: %s\n", err.what().c_str());
+        return 1;
+    }
+}
+
+static int process_all(const char* script, const brie::Prefetcher::NextFunc& next)
+{
+    if (!incrementalStore.empty() || dedupe) return process_reusing(script, next);
+    if (forkCount > 0) return process_forked(script, next);
+
+    bool first = true;
+
+    // A batch is opened at once, so keep up to two of them queued
+    if (batchSize > 1 && prefetchDepth < batchSize) {
+        prefetchDepth = 2 * batchSize;
+    }
+
+    if (prefetchDepth == 0 || chunkCount > 1) {
+        std::string cfg;
+        while (next(cfg)) {
+            int ret = chunkCount > 1 ? process_chunked(script, cfg.c_str(), first)
+                                     : process_source(script, cfg.c_str(), first, false);
+            if (ret != 0) return 1;
+            brie::sampler().end_source();
+            first = false;
+        }
+        return first ? 0 : follow_source();
+    }
+
+    brie::Prefetcher prefetcher(next, prefetchDepth, prefetchBytes, batchSize, useUring);
+    brie::Prefetcher::Item item;
+    while (prefetcher.get(item)) {
+        int ret = process_source(script, item, first, false);
+        if (ret != 0) return 1;
+        brie::sampler().end_source();
+        first = false;
+        item = brie::Prefetcher::Item();
+    }
+
+    return first ? 0 : follow_source();
+}
+
+// Execute the script for each source config supplied by "next", or
+// for the sample of them with --sample. The postfix is not executed.
+static int process_sources(const char* script, const brie::Prefetcher::NextFunc& next)
+{
+    brie::Sampler& sampler = brie::sampler();
+    if (!sampler.enabled()) return process_all(script, next);
+
+    if (sampler.count() == 0) {
+        auto sampled = [&next, &sampler](std::string& cfg) {
+            while (next(cfg)) {
+                if (sampler.pick_source(cfg)) return true;
+            }
+            return false;
+        };
+        return process_all(script, sampled);
+    }
+
+    // A sample of a number of sources needs all of them first
+    std::vector<std::string> cfgs;
+    std::string cfg;
+    while (next(cfg)) cfgs.push_back(cfg);
+    cfgs = sampler.pick_sources(cfgs);
+
+    size_t i = 0;
+    auto sampled = [&cfgs, &i](std::string& cfg) {
+        if (i >= cfgs.size()) return false;
+        cfg = cfgs[i++];
+        return true;
+    };
+    return process_all(script, sampled);
+}
+
+// Run the postfix after all sources
+static int finish_sources()
+{
+    int ret = finish();
+    if (brie::sampler().enabled()) brie::sampler().print(stderr);
+    return ret;
+}
+
+static bool read_source_name(std::string& cfg)
+{
+    char buf[MAX_PATH];
+    char* s = fgets(buf, sizeof(buf), stdin);
+    if (s == nullptr) return false;
+
+    int len = strlen(s);
+    if (len > 0) s[len-1] = '\0';
+    cfg = s;
+
+    return true;
+}
+
 int process_multiple_files(int argc, char* argv[])
 {
     if (argc == 1) {
@@ -244,30 +971,23 @@ int process_multiple_files(int argc, char* argv[])
         if (0 == strcmp(argv[1], "-")) {
             //TempLogLevel tll(LL_DEBUG);
 
-            char buf[MAX_PATH];
-            char* s;
-            bool first = true;
-
-            while ((s = fgets(buf, sizeof(buf), stdin))) {
-                int len = strlen(s);
-                if (len > 0) s[len-1] = '\0';
-
-                int ret = process_source(argv[0], s, first, false);
-                if (ret != 0) return 1;
-                first = false;
-            }
+            int ret = process_sources(argv[0], read_source_name);
+            if (ret != 0) return 1;
 
-            return finish();            
+            return finish_sources();
         }
     }
 
     // Get names of sources from the command-line arguments.
-    for (int i=1; i < argc; i++) {
-        bool first = (i == 1);
-        bool last = (i == argc - 1);
-        int ret = process_source(argv[0], argv[i], first, last);
-        if (ret != 0) return 1;
-    }
+    int i = 1;
+    auto next = [&i, argc, argv](std::string& cfg) {
+        if (i >= argc) return false;
+        cfg = argv[i++];
+        return true;
+    };
 
-    return 0;
+    int ret = process_sources(argv[0], next);
+    if (ret != 0) return 1;
+
+    return finish_sources();
 }
@@ -27,7 +27,7 @@ namespace brie {
 
 using DataItemListPtr = std::shared_ptr<DataItemList>;
 using ParserCache = std::unordered_map<std::string, DataItemListPtr>;
-static ParserCache parserCache;
+static thread_local ParserCache parserCache;
 
 void clear_data_item(DataItem& item)
 {
@@ -0,0 +1,171 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "prefetch.h"
+#include "error.h"
+#include "utils/log.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace brie {
+
+struct Prefetcher::State
+{
+    NextFunc next;
+    size_t depth;
+    size_t bytes;
+    size_t batch;
+    bool uring;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<Item> queue;
+    bool done = false;
+    bool stop = false;
+};
+
+Prefetcher::Prefetcher(NextFunc next, size_t depth, size_t bytes, size_t batch, bool uring)
+  : m_state(std::make_shared<State>())
+{
+    m_state->next = next;
+    m_state->depth = depth == 0 ? 1 : depth;
+    m_state->bytes = bytes;
+    m_state->batch = batch;
+    m_state->uring = uring;
+
+    if (batch > 1) {
+        m_thread = std::thread(&Prefetcher::run_batches, m_state);
+    } else {
+        m_thread = std::thread(&Prefetcher::run, m_state);
+    }
+}
+
+Prefetcher::~Prefetcher()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        m_state->stop = true;
+        m_state->queue.clear();
+    }
+    m_state->cond.notify_all();
+
+    // "next" may refer to the frames of the caller, so the thread must
+    // not outlive the prefetcher
+    m_thread.join();
+}
+
+bool Prefetcher::get(Item& item)
+{
+    State& st = *m_state;
+
+    std::unique_lock<std::mutex> lock(st.mutex);
+    st.cond.wait(lock, [&st] { return !st.queue.empty() || st.done; });
+    if (st.queue.empty()) return false;
+
+    item = std::move(st.queue.front());
+    st.queue.pop_front();
+    st.cond.notify_all();
+
+    return true;
+}
+
+void Prefetcher::run(std::shared_ptr<State> state)
+{
+    State& st = *state;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(st.mutex);
+            st.cond.wait(lock, [&st] { return st.queue.size() < st.depth || st.stop; });
+            if (st.stop) break;
+        }
+
+        Item item;
+        if (!st.next(item.cfg)) break;
+
+        try {
+            item.source = make_source(item.cfg.c_str());
+            if (item.source) item.source->prefetch(st.bytes);
+        } catch (const Error& err) {
+            item.error = err.what();
+        }
+
+        LOG_DEBUG << "Prefetched " << item.cfg;
+        if (!push(st, std::move(item))) break;
+    }
+
+    std::lock_guard<std::mutex> lock(st.mutex);
+    st.done = true;
+    st.cond.notify_all();
+}
+
+void Prefetcher::run_batches(std::shared_ptr<State> state)
+{
+    State& st = *state;
+    BatchLoader loader(st.bytes, st.uring);
+
+    std::vector<std::string> cfgs;
+    std::vector<Item> items;
+    bool more = true;
+
+    while (more) {
+        {
+            std::unique_lock<std::mutex> lock(st.mutex);
+            st.cond.wait(lock, [&st] { return st.queue.size() < st.depth || st.stop; });
+            if (st.stop) break;
+        }
+
+        cfgs.clear();
+        std::string cfg;
+        while (cfgs.size() < st.batch && (more = st.next(cfg))) {
+            cfgs.push_back(cfg);
+        }
+        if (cfgs.empty()) break;
+
+        loader.load(cfgs, items);
+        LOG_DEBUG << "Prefetched a batch of " << cfgs.size() << " sources";
+
+        bool stopped = false;
+        for (auto& item: items) {
+            if (!push(st, std::move(item))) {
+                stopped = true;
+                break;
+            }
+        }
+        if (stopped) break;
+    }
+
+    std::lock_guard<std::mutex> lock(st.mutex);
+    st.done = true;
+    st.cond.notify_all();
+}
+
+// Returns false if the prefetcher was destroyed
+bool Prefetcher::push(State& st, Item&& item)
+{
+    std::lock_guard<std::mutex> lock(st.mutex);
+    if (st.stop) return false;
+    st.queue.push_back(std::move(item));
+    st.cond.notify_all();
+    return true;
+}
+
+} // namespace brie
@@ -0,0 +1,66 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "loader.h"
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace brie {
+
+/*****************************************************************
+ *   Opens sources ahead of the one being processed. A background
+ *   thread keeps up to "depth" sources opened, mapped and with
+ *   their first "bytes" requested from storage, so the script does
+ *   not wait for storage latency on every new source.
+ */
+class Prefetcher
+{
+public:
+    // Supplies the next source config; returns false when there are none.
+    using NextFunc = std::function<bool(std::string& cfg)>;
+
+    using Item = PreparedSource;
+
+    // With "batch" above one the configs are collected into batches
+    // opened together by BatchLoader.
+    Prefetcher(NextFunc next, size_t depth, size_t bytes, size_t batch = 0, bool uring = true);
+    ~Prefetcher();
+
+    Prefetcher(const Prefetcher&) = delete;
+    Prefetcher& operator=(const Prefetcher&) = delete;
+
+    // Wait for the next source in order. Returns false when all
+    // sources have been handed out.
+    bool get(Item& item);
+
+private:
+    // Shared with the thread. The destructor stops and joins it, so it
+    // waits for a next() call in progress, e.g. a read from stdin.
+    struct State;
+    static void run(std::shared_ptr<State> state);
+    static void run_batches(std::shared_ptr<State> state);
+    static bool push(State& st, Item&& item);
+
+private:
+    std::shared_ptr<State> m_state;
+    std::thread m_thread;
+};
+
+} // namespace brie
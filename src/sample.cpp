@@ -0,0 +1,246 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sample.h"
+#include "incremental.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace brie {
+
+static Sampler theSampler;
+static thread_local Sampler* threadSampler = nullptr;
+
+Sampler& sampler()
+{
+    return threadSampler != nullptr ? *threadSampler : theSampler;
+}
+
+void use_sampler(Sampler* local)
+{
+    threadSampler = local;
+}
+
+static uint64_t mix(uint64_t x)
+{
+    // splitmix64 finalizer
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+// Uniform number in [0, 1)
+static double to_unit(uint64_t x)
+{
+    return (x >> 11) * (1.0 / (1ull << 53));
+}
+
+/**********************************************************************
+ *   Sources
+ */
+bool Sampler::pick_source(const std::string& cfg)
+{
+    m_sourcesSeen++;
+    if (to_unit(mix(hash_text(cfg) ^ m_seed)) >= m_rate) return false;
+
+    m_sourcesTaken++;
+    return true;
+}
+
+std::vector<std::string> Sampler::pick_sources(const std::vector<std::string>& cfgs)
+{
+    std::vector<std::pair<uint64_t, size_t>> order;
+    order.reserve(cfgs.size());
+    for (size_t i = 0; i < cfgs.size(); i++) {
+        order.emplace_back(mix(hash_text(cfgs[i]) ^ m_seed), i);
+    }
+
+    // The sources with the smallest hashes are a uniform sample
+    const size_t taken = std::min(m_count, cfgs.size());
+    std::nth_element(order.begin(), order.begin() + taken, order.end());
+    order.resize(taken);
+    std::sort(order.begin(), order.end(), [](const auto& a, const auto& b) { return a.second < b.second; });
+
+    std::vector<std::string> result;
+    for (const auto& item: order) result.push_back(cfgs[item.second]);
+
+    m_sourcesSeen += cfgs.size();
+    m_sourcesTaken += taken;
+    return result;
+}
+
+/**********************************************************************
+ *   Records
+ */
+uint64_t Sampler::next_random(const std::string& source)
+{
+    if (source != m_randomSource) {
+        m_randomSource = source;
+        m_random = hash_text(source) ^ m_seed;
+    }
+
+    m_random += 0x9E3779B97F4A7C15ull;
+    return mix(m_random);
+}
+
+void Sampler::start_record()
+{
+    if (m_recordOpen) m_records.close();
+    m_records.count++;
+    m_recordOpen = true;
+}
+
+bool Sampler::pick_record(const std::string& source, double rate)
+{
+    m_recordsSeen++;
+    if (to_unit(next_random(source)) >= rate) return false;
+
+    start_record();
+    return true;
+}
+
+size_t Sampler::skip_records(const std::string& source, double rate, size_t left)
+{
+    size_t skip = 0;
+    if (rate < 1) {
+        // Records before the next sampled one follow the geometric
+        // distribution, so a single random number covers all of them.
+        const double u = to_unit(next_random(source));
+        const double k = rate > 0 ? std::floor(std::log1p(-u) / std::log1p(-rate)) : left;
+        skip = k < left ? (size_t)k : left;
+    }
+
+    if (skip >= left) {
+        m_recordsSeen += left;
+        return left;
+    }
+
+    m_recordsSeen += skip + 1;
+    start_record();
+    return skip;
+}
+
+/**********************************************************************
+ *   Estimates
+ */
+void Sampler::Units::close()
+{
+    for (auto& item: sums) {
+        Sum& s = item.second;
+        s.sum += s.current;
+        s.squares += s.current * s.current;
+        s.current = 0;
+    }
+}
+
+void Sampler::add(const std::string& name, double value)
+{
+    m_sources.sums[name].current += value;
+    m_records.sums[name].current += value;
+}
+
+Sampler Sampler::part(uint64_t salt) const
+{
+    Sampler result;
+    result.m_seed = m_seed ^ mix(salt + 1);
+    result.m_rate = m_rate;
+    result.m_count = m_count;
+    return result;
+}
+
+void Sampler::merge(const Sampler& part)
+{
+    // The part belongs to the open source unit
+    for (const auto& item: part.m_sources.sums) {
+        m_sources.sums[item.first].current += item.second.current;
+    }
+
+    // Its record units are complete ones
+    Units records = part.m_records;
+    if (part.m_recordOpen) records.close();
+
+    m_recordsSeen += part.m_recordsSeen;
+    m_records.count += records.count;
+    for (const auto& item: records.sums) {
+        Sum& s = m_records.sums[item.first];
+        s.sum += item.second.sum;
+        s.squares += item.second.squares;
+    }
+}
+
+void Sampler::end_source()
+{
+    m_sources.count++;
+    m_sources.close();
+
+    if (m_recordOpen) m_records.close();
+    m_recordOpen = false;
+}
+
+double Sampler::source_fraction() const
+{
+    if (m_sourcesSeen == 0 || m_sourcesTaken == 0) return 1;
+    return (double)m_sourcesTaken / m_sourcesSeen;
+}
+
+Estimate Sampler::estimate(const std::string& name) const
+{
+    // Record units when records were sampled, else source units
+    const Units& units = m_recordsSeen != 0 ? m_records : m_sources;
+    const double seen = m_recordsSeen != 0 ? m_recordsSeen : units.count;
+
+    Estimate result;
+    const auto it = units.sums.find(name);
+    if (it == units.sums.end() || units.count == 0) return result;
+
+    const Sum& s = it->second;
+    const double n = units.count;
+    const double population = seen / source_fraction();
+    result.value = s.sum * population / n;
+
+    // Two-stage sampling is treated as sampling of records from all
+    // sources, which understates the bound a little.
+    if (n >= population) return result;
+    if (n < 2) {
+        result.bound = HUGE_VAL;
+        return result;
+    }
+
+    const double variance = std::max(0.0, (s.squares - s.sum * s.sum / n) / (n - 1));
+    result.bound = 1.96 * population * std::sqrt((1 - n / population) * variance / n);
+    return result;
+}
+
+void Sampler::print(FILE* f) const
+{
+    fprintf(f, "Sampled:      %lu of %lu sources", m_sourcesTaken, m_sourcesSeen);
+    if (m_recordsSeen != 0) fprintf(f, ", %lu of %lu records", m_records.count, m_recordsSeen);
+    fprintf(f, "\n");
+
+    std::vector<std::string> names;
+    for (const auto& item: m_sources.sums) names.push_back(item.first);
+    std::sort(names.begin(), names.end());
+
+    for (const std::string& name: names) {
+        const Estimate e = estimate(name);
+        fprintf(f, "  %s ~ %.6g +/- %.3g\n", name.c_str(), e.value, e.bound);
+    }
+}
+
+} // namespace brie
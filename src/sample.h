@@ -0,0 +1,145 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <stdio.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace brie {
+
+/*****************************************************************
+ *   Scaled total of an aggregate and the half-width of its 95%
+ *   confidence interval.
+ */
+struct Estimate
+{
+    double value = 0;
+    double bound = 0;
+};
+
+/*****************************************************************
+ *   Random sampling of sources (--sample) and of records (sample()
+ *   in Lua) with estimates of the totals of emit() aggregates.
+ *
+ *   All choices are derived from the seed: a source is picked by a
+ *   hash of its name, records by a generator seeded with the name of
+ *   their source. The same seed and inputs give the same sample in
+ *   any order of the inputs.
+ *
+ *   Values passed to emit() are summed per sampling unit: a source,
+ *   or a sampled record once sample() is used. A record unit holds
+ *   what is emitted until the next sampled record. The estimates
+ *   scale the sums by the inverse sampling fraction and take the
+ *   error bound from the variance between units.
+ *
+ *   A sampler is used by one thread. Threads that process parts of a
+ *   source use a part() of their own, merged when the parts are.
+ */
+class Sampler
+{
+public:
+    void set_seed(uint64_t seed) { m_seed = seed; }
+
+    // Sample sources with probability "rate"
+    void set_rate(double rate) { m_rate = rate; }
+
+    // Sample "count" sources of all given ones
+    void set_count(size_t count) { m_count = count; }
+
+    bool enabled() const { return m_rate < 1 || m_count != 0; }
+    size_t count() const { return m_count; }
+
+    // True if the source is in the sample; with a rate only.
+    bool pick_source(const std::string& cfg);
+
+    // Sources of the sample of "count" in the order they are given
+    std::vector<std::string> pick_sources(const std::vector<std::string>& cfgs);
+
+    // True if the next record of "source" is in the sample
+    bool pick_record(const std::string& source, double rate);
+
+    // Number of records of "source" to skip before the next sampled
+    // one; at most "left". The records are counted as seen, the
+    // sampled one is counted only if fewer than "left" are skipped.
+    size_t skip_records(const std::string& source, double rate, size_t left);
+
+    // Add to the current units
+    void add(const std::string& name, double value);
+
+    // Sampler for a part of the current source that another thread
+    // processes: the same settings and no state. Its records are drawn
+    // from a generator of their own, seeded with "salt" as well.
+    Sampler part(uint64_t salt) const;
+
+    // Add what a part sampled to the current source
+    void merge(const Sampler& part);
+
+    // End the units of the current source
+    void end_source();
+
+    Estimate estimate(const std::string& name) const;
+
+    // Estimates of all aggregates
+    void print(FILE* f) const;
+
+private:
+    struct Sum
+    {
+        double current = 0; // Of the open unit
+        double sum = 0;
+        double squares = 0;
+    };
+
+    struct Units
+    {
+        size_t count = 0;
+        std::unordered_map<std::string, Sum> sums;
+
+        void close();
+    };
+
+    void start_record();
+    uint64_t next_random(const std::string& source);
+    double source_fraction() const;
+
+private:
+    uint64_t m_seed = 0;
+    double m_rate = 1;
+    size_t m_count = 0;
+
+    size_t m_sourcesSeen = 0;
+    size_t m_sourcesTaken = 0;
+    size_t m_recordsSeen = 0;
+
+    std::string m_randomSource; // Source the generator is seeded for
+    uint64_t m_random = 0;
+
+    Units m_sources;
+    Units m_records;
+    bool m_recordOpen = false;
+};
+
+// Sampler of the calling thread: the global one unless another one is
+// set with use_sampler(), e.g. by a chunk worker. nullptr restores it.
+Sampler& sampler();
+void use_sampler(Sampler* local);
+
+} // namespace brie
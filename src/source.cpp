@@ -17,11 +17,16 @@
 
 #include "source.h"
 #include "source_test.h"
+#include "stats.h"
 #include "error.h"
 #include "utils/log.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <list>
+#include <mutex>
+#include <thread>
 
 #include <stdlib.h>
 #include <sys/mman.h>
@@ -32,6 +37,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <errno.h>
 
 namespace brie {
 
@@ -39,7 +45,100 @@ static const char* TestPrefix = "test:";
 static const size_t TestPrefixLen = 5;
 
 
+SourceOptions& default_source_options()
+{
+    static SourceOptions options;
+    return options;
+}
+
+bool operator==(const SourceOptions& left, const SourceOptions& right)
+{
+    return left.retention == right.retention && left.window == right.window
+        && left.hints == right.hints && left.header == right.header
+        && left.limit == right.limit && left.smallFile == right.smallFile
+        && left.direct == right.direct && left.follow == right.follow
+        && left.cache == right.cache && left.decompress == right.decompress
+        && left.indexDir == right.indexDir;
+}
+
+void parse_hints(const char* str, SourceOptions& opts)
+{
+    std::string hints = str;
+    size_t start = 0;
+    while (start <= hints.length()) {
+        size_t end = hints.find(',', start);
+        if (end == std::string::npos) end = hints.length();
+        const std::string hint = hints.substr(start, end - start);
+        start = end + 1;
+
+        if (hint.empty()) continue;
+        if (hint == "sequential") opts.hints |= HintSequential;
+        else if (hint == "random") opts.hints |= HintRandom;
+        else if (hint == "populate") opts.hints |= HintPopulate;
+        else if (hint == "hugepage") opts.hints |= HintHugePage;
+        else if (hint.compare(0, 7, "header:") == 0) {
+            char* tail = nullptr;
+            opts.header = strtoul(hint.c_str() + 7, &tail, 0);
+            if (*tail != '\0' || opts.header == 0) throwex("Source: invalid header hint");
+            opts.hints |= HintHeader;
+        } else {
+            throwex("Source: unknown hint " + hint);
+        }
+    }
+
+    if ((opts.hints & HintSequential) && (opts.hints & (HintRandom | HintHeader))) {
+        throwex("Source: sequential hint conflicts with random access hints");
+    }
+}
+
 SourcePtr make_source(const char* cfg)
+{
+    return make_source(cfg, default_source_options());
+}
+
+template <class T>
+static SourcePtr create_source(const char* name, const char* cfg, const SourceOptions& opts)
+{
+    SourcePtr result = std::make_shared<T>(name);
+    result->set_options(opts);
+    result->init(cfg);
+    stats().sources++;
+    return result;
+}
+
+// With decompression on, a regular file is opened once here and the fd
+// the magic bytes are read from is handed over to the source.
+static SourcePtr make_sniffed_source(const char* cfg, const struct stat& st, const SourceOptions& opts)
+{
+    int fd = open(cfg, O_RDONLY);
+    if (fd < 0) throwex("Source: failed to open file");
+
+    char head[4];
+    const ssize_t n = pread(fd, head, sizeof(head), 0);
+    if (n > 0 && compressed_format(head, n) != FormatNone) {
+        return make_file_source(cfg, fd, opts);
+    }
+
+    if (opts.direct != 0) {
+        close(fd);
+        return create_source<DirectSource>(cfg, cfg, opts);
+    }
+    if ((size_t)st.st_size < opts.smallFile) {
+        auto result = std::make_shared<SmallFileSource>(cfg);
+        result->set_options(opts);
+        result->read_file(fd);
+        stats().sources++;
+        return result;
+    }
+
+    auto result = std::make_shared<FileSource>(cfg);
+    result->set_options(opts);
+    result->adopt(fd);
+    stats().sources++;
+    return result;
+}
+
+SourcePtr make_source(const char* cfg, const SourceOptions& opts)
 {
     assert(cfg != nullptr);
 
@@ -50,37 +149,158 @@ SourcePtr make_source(const char* cfg)
     // Prefix for source config
     constexpr size_t prefixMallocLen = strlen(PrefixMalloc);
     constexpr size_t prefixSysVShMemLen = strlen(PrefixSysVShMem);
+    constexpr size_t prefixRingLen = strlen(PrefixRing);
+    constexpr size_t prefixPidLen = strlen(PrefixPid);
 
     if (strstr(cfg, PrefixMalloc) == cfg) {
-        SourcePtr result = std::make_shared<MallocSource>(cfg);
-        result->init(cfg + prefixMallocLen);
-        return result;
+        return create_source<MallocSource>(cfg, cfg + prefixMallocLen, opts);
     } else if (strstr(cfg, PrefixSysVShMem) == cfg) {
-        SourcePtr result = std::make_shared<SysVShMemSource>(cfg);
-        result->init(cfg + prefixSysVShMemLen);
-        return result;
+        return create_source<SysVShMemSource>(cfg, cfg + prefixSysVShMemLen, opts);
+    } else if (strstr(cfg, PrefixRing) == cfg) {
+        return create_source<RingSource>(cfg, cfg + prefixRingLen, opts);
+    } else if (strstr(cfg, PrefixPid) == cfg) {
+        return create_source<ProcessSource>(cfg, cfg + prefixPidLen, opts);
     }
 
     struct stat st;
     int ret = stat(cfg, &st);
     if (ret != 0) {
-        SourcePtr result = std::make_shared<PosixShMeSource>(cfg);
-        result->init(cfg);
-        return result;
+        return create_source<PosixShMeSource>(cfg, cfg, opts);
     }
 
     if (S_ISREG(st.st_mode)) {
-        SourcePtr result = std::make_shared<FileSource>(cfg);
-        result->init(cfg);
-        return result;
+        if (opts.follow) {
+            return create_source<FileSource>(cfg, cfg, opts);
+        }
+        if (opts.decompress) {
+            return make_sniffed_source(cfg, st, opts);
+        }
+        if (opts.direct != 0) {
+            return create_source<DirectSource>(cfg, cfg, opts);
+        }
+        if ((size_t)st.st_size < opts.smallFile) {
+            return create_source<SmallFileSource>(cfg, cfg, opts);
+        }
+        return create_source<FileSource>(cfg, cfg, opts);
+    }
+
+    if (S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode) || S_ISSOCK(st.st_mode)) {
+        return create_source<StreamSource>(cfg, cfg, opts);
+    }
+
+    if (S_ISBLK(st.st_mode)) {
+        return create_source<BlockDeviceSource>(cfg, cfg, opts);
     }
 
     return nullptr;
 }
 
+SourcePtr make_file_source(const char* cfg, int fd, const SourceOptions& opts)
+{
+    char head[4];
+    const ssize_t n = opts.decompress ? pread(fd, head, sizeof(head), 0) : 0;
+    if (n > 0 && compressed_format(head, n) != FormatNone) {
+        auto result = std::make_shared<CompressedSource>(cfg);
+        result->set_options(opts);
+        result->adopt(fd);
+        stats().sources++;
+        return result;
+    }
+
+    auto result = std::make_shared<FileSource>(cfg);
+    result->set_options(opts);
+    result->adopt(fd);
+    stats().sources++;
+    return result;
+}
+
+/**********************************************************************
+ *   Recently opened regular files.
+ */
+struct CachedFile
+{
+    std::string cfg;
+    SourceOptions opts;
+    struct stat st;
+    SourcePtr source;
+};
+
+static constexpr size_t MaxCachedFiles = 8;
+static std::list<CachedFile> cachedFiles; // Most recent first
+static std::mutex cachedFilesMutex;
+
+SourcePtr open_source(const char* cfg, const SourceOptions& opts)
+{
+    struct stat st;
+    if (opts.follow || stat(cfg, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return make_source(cfg, opts);
+    }
+
+    std::lock_guard<std::mutex> lock(cachedFilesMutex);
+
+    for (auto iter = cachedFiles.begin(); iter != cachedFiles.end(); ++iter) {
+        if (iter->cfg != cfg || !(iter->opts == opts)) continue;
+
+        // The position of a source that is in use must not change
+        if (iter->source.use_count() > 1) continue;
+
+        const bool same = iter->st.st_ino == st.st_ino && iter->st.st_dev == st.st_dev
+            && iter->st.st_size == st.st_size && iter->st.st_mtim.tv_sec == st.st_mtim.tv_sec
+            && iter->st.st_mtim.tv_nsec == st.st_mtim.tv_nsec;
+        if (!same) {
+            cachedFiles.erase(iter);
+            break;
+        }
+
+        iter->source->set_pos(0);
+        cachedFiles.splice(cachedFiles.begin(), cachedFiles, iter);
+        return iter->source;
+    }
+
+    SourcePtr source = make_source(cfg, opts);
+    if (!source) return source;
+
+    cachedFiles.push_front(CachedFile{ cfg, opts, st, source });
+    if (cachedFiles.size() > MaxCachedFiles) cachedFiles.pop_back();
+
+    return source;
+}
+
+SourcePtr make_slice(SourcePtr parent, size_t offset, size_t len)
+{
+    if (offset > parent->size() || len > parent->size() - offset) {
+        throwex("Slice is outside of the source");
+    }
+
+    if (auto slice = std::dynamic_pointer_cast<SliceSource>(parent)) {
+        return std::make_shared<SliceSource>(slice->parent(), slice->offset() + offset, len);
+    }
+    return std::make_shared<SliceSource>(parent, offset, len);
+}
+
+SourcePtr make_buffer_source(const char* name, BufferPtr buffer, size_t size)
+{
+    auto result = std::make_shared<BufferSource>(name);
+    result->adopt(std::move(buffer), size);
+    return result;
+}
+
+SourcePtr make_small_file_source(const char* cfg, BufferPtr buffer, size_t size, const SourceOptions& opts)
+{
+    if (opts.decompress && compressed_format(buffer->data.get(), size) != FormatNone) {
+        return make_source(cfg, opts);
+    }
+
+    auto result = std::make_shared<SmallFileSource>(cfg);
+    result->set_options(opts);
+    result->adopt(std::move(buffer), size);
+    stats().sources++;
+    return result;
+}
+
 /**********************************************************************
  */
-static size_t type_length(Type type)
+size_t type_length(Type type)
 {
     switch (type) {
         case U8:  return sizeof(uint8_t);
@@ -100,9 +320,8 @@ static size_t type_length(Type type)
 int64_t Source::read_int(Type type)
 {
     size_t len = type_length(type);
-    if (m_pos + len > m_size) throwex("Insufficent data in source");
-
-    const char* data = m_ptr + m_pos;
+    const char* data = this->data(m_pos, len);
+    if (data == nullptr) throwex("Insufficent data in source");
 
     switch (type) {
         case U8:  {
@@ -151,9 +370,8 @@ int64_t Source::read_int(Type type)
 double  Source::read_float(Type type)
 {
     size_t len = type_length(type);
-    if (m_pos + len > m_size) throwex("Insufficent data in source");
-
-    const char* data = m_ptr + m_pos;
+    const char* data = this->data(m_pos, len);
+    if (data == nullptr) throwex("Insufficent data in source");
 
     switch (type) {
         case F32:  {
@@ -180,28 +398,26 @@ std::string Source::read_str(size_t len)
     bool is_null_terminated = false;
 
     size_t alterLen = 0;
+    const char* s = nullptr;
     if (len == 0) {
         is_null_terminated = true;
-    
-        for (size_t pos=m_pos; pos < m_size; pos++, len++) {
-            if (m_ptr[pos] == '\0') break;
-        }
+
+        size_t end = find_byte(m_pos, '\0');
+        if (end == nopos()) throwex("No available data: string is too long");
+        len = end - m_pos;
+        s = data(m_pos, len);
     } else { // if len != 0
+        // One byte past the string must be available as well
+        s = data(m_pos, len + 1);
+        if (s == nullptr) throwex("No available data: string is too long");
+
         // Cover possible \0 padding included in len
-        size_t tempLen = 0;
-        for (size_t pos=m_pos; pos < m_pos + len; pos++, tempLen++) {
-            if (m_ptr[pos] == '\0') {
-                alterLen = tempLen;
-                break;
-            }
-        }
+        const char* zero = static_cast<const char*>(memchr(s, '\0', len));
+        if (zero != nullptr) alterLen = zero - s;
     }
 
-    if (m_pos + len >= m_size) throwex("No available data: string is too long");
-
     if (alterLen == 0) alterLen = len;
-    std::string str(m_ptr + m_pos, alterLen);
-    //std::string str(m_ptr + m_pos, len);
+    std::string str(s, alterLen);
 
     m_pos += len;
     if (is_null_terminated) m_pos += 1;
@@ -217,41 +433,71 @@ std::string Source::read_wstr(size_t len)
     size_t prefixLen = 0;
     size_t alterLen = 0;
 
-    const char* s = m_ptr + m_pos;
     const char FF = 0xFF;
     const char FE = 0xFE;
 
+    const char* s = data(m_pos, 1);
+    if (s == nullptr) throwex("No available data: wstring is too long");
+
     if (*s == FF || *s == FE) {
-        s += 2;
         prefixLen = 2;
     }
 
+    const size_t start = m_pos + prefixLen;
+
     if (len == 0) {
         is_null_terminated = true;
 
-        for (size_t i = m_pos + prefixLen; i < m_size; i += 2, len += 2) {
-            if (m_ptr[i] == '\0') {
-                if (i >= m_size - 1) throwex("Invalid format of wstr: no terminator");
-                if (m_ptr[i+1] == '\0') break;
+        // Scan by chunks of even size to keep characters aligned
+        constexpr size_t ScanChunk = 4096;
+        for (size_t i = start; ; ) {
+            size_t n = ScanChunk;
+            const char* p = fetch(i, n);
+            if (n == 0) break;
+
+            // Keep characters whole; a single byte is the end of data
+            if (n % 2 != 0) {
+                if (n > 1) {
+                    n--;
+                } else if (const char* pair = data(i, 2)) {
+                    p = pair;
+                    n = 2;
+                }
             }
+
+            size_t k = 0;
+            bool found = false;
+            for (; k < n; k += 2) {
+                if (p[k] == '\0') {
+                    if (k + 1 >= n) throwex("Invalid format of wstr: no terminator");
+                    if (p[k+1] == '\0') {
+                        found = true;
+                        break;
+                    }
+                }
+            }
+
+            len += k;
+            i += k;
+            if (found) break;
         }
     } else { // if len != 0
         // Cover possible \0 padding included in len
-        size_t tempLen = 0;
-        for (size_t i = m_pos + prefixLen; i < m_pos + len; i += 2, tempLen += 2) {
-            if (i >= m_size - 1) break;
-
-            if (m_ptr[i] == '\0' && m_ptr[i+1] == 0) {
-                alterLen = tempLen;
+        size_t n = len > prefixLen ? len - prefixLen : 0;
+        const char* p = fetch(start, n);
+        for (size_t k = 0; k + 1 < n; k += 2) {
+            if (p[k] == '\0' && p[k+1] == '\0') {
+                alterLen = k;
                 break;
             }
         }
     }
 
-    if (m_pos + len > m_size) throwex("No available data: wstring is too long");
+    if (data(m_pos, len) == nullptr) throwex("No available data: wstring is too long");
 
-    len -= prefixLen;
+    len = len > prefixLen ? len - prefixLen : 0;
     if (alterLen != 0) len = alterLen;
+    s = data(start, len);
     std::string str(s, len);
 
     m_pos += len + prefixLen;
@@ -285,17 +531,186 @@ size_t Source::find(const char* str, size_t maxOffset)
     if (str == nullptr || *str == '\0') return nopos();
 
     size_t len = strlen(str);
-    if (len > m_size || len > maxOffset) return nopos();
+    if (len > maxOffset) return nopos();
+
+    // A match at "i" requires the byte at i + len to exist
+    constexpr size_t FindChunk = 64 * 1024;
+    const size_t last = maxOffset - len;
+    for (size_t i = m_pos; i < last; ) {
+        const size_t count = std::min(last - i, FindChunk);
+        size_t n = count + len;
+        const char* p = fetch(i, n);
+
+        const size_t limit = n > len ? std::min(count, n - len) : 0;
+        for (size_t k = 0; k < limit; k++) {
+            const char* c = static_cast<const char*>(memchr(p + k, *str, limit - k));
+            if (c == nullptr) break;
+            k = c - p;
+            if (0 == memcmp(c, str, len)) return i + k;
+        }
 
-    for (size_t i = m_pos; i < m_size - len && i < maxOffset - len; i++) {
-        if (m_ptr[i] == *str) {
-            if (0 == memcmp(m_ptr + i, str, len)) return i;
+        if (limit == 0) {
+            if (data_end() < m_size && i + len >= data_end()) throw_limit();
+            break;
         }
+        i += limit;
     }
 
     return nopos();
 }
 
+size_t Source::find_masked(size_t pos, const std::string& pattern, const std::string& mask)
+{
+    const size_t len = pattern.size();
+    if (len == 0 || mask.size() != len) return nopos();
+
+    auto matches = [&pattern, &mask, len](const char* p) {
+        for (size_t i = 0; i < len; i++) {
+            if ((p[i] & mask[i]) != pattern[i]) return false;
+        }
+        return true;
+    };
+
+    // Windows overlap by len - 1 bytes so no match is split
+    constexpr size_t FindChunk = 64 * 1024;
+    const bool exactFirst = mask[0] == '\xFF';
+    while (true) {
+        size_t n = FindChunk + len - 1;
+        const char* p = fetch(pos, n);
+        if (n < len) return nopos();
+
+        const size_t limit = n - len + 1;
+        for (size_t k = 0; k < limit; k++) {
+            if (exactFirst) {
+                const char* c = static_cast<const char*>(memchr(p + k, pattern[0], limit - k));
+                if (c == nullptr) break;
+                k = c - p;
+            }
+            if (matches(p + k)) return pos + k;
+        }
+        pos += limit;
+    }
+}
+
+const char* Source::fetch(size_t pos, size_t& len)
+{
+    const size_t end = data_end();
+    if (end < m_size) {
+        if (pos >= end && pos < m_size && len != 0) throw_limit();
+        if (pos + len > end) len = pos < end ? end - pos : 0;
+    }
+
+    return load(pos, len);
+}
+
+const char* Source::data(size_t pos, size_t len)
+{
+    size_t n = len;
+    const char* p = fetch(pos, n);
+    if (n == len) return p;
+
+    if (data_end() < m_size && pos + len > data_end()) throw_limit();
+
+    // A growing source waits for the rest of the data
+    if (grow(pos + len)) return data(pos, len);
+    return nullptr;
+}
+
+const char* Source::load(size_t pos, size_t& len)
+{
+    if (pos > m_size) {
+        len = 0;
+        return nullptr;
+    }
+
+    len = std::min(len, m_size - pos);
+    return m_ptr + pos;
+}
+
+size_t Source::data_end() const
+{
+    if (m_opts.limit != 0 && m_opts.limit < m_size) return m_opts.limit;
+    return m_size;
+}
+
+void Source::throw_limit() const
+{
+    throwex("Read crosses the limit of " + std::to_string(m_opts.limit) + " bytes");
+}
+
+size_t Source::find_byte(size_t pos, char c)
+{
+    constexpr size_t ScanChunk = 4096;
+    while (true) {
+        size_t n = ScanChunk;
+        const char* p = fetch(pos, n);
+        if (n == 0) {
+            if (grow(pos + 1)) continue;
+            return nopos();
+        }
+
+        const char* found = static_cast<const char*>(memchr(p, c, n));
+        if (found != nullptr) return pos + (found - p);
+
+        pos += n;
+    }
+}
+
+// Load a sequence counter written by another thread or process
+static uint64_t load_counter(const char* ptr, size_t len)
+{
+    if (reinterpret_cast<uintptr_t>(ptr) % len == 0) {
+        switch (len) {
+            case 1: return __atomic_load_n(reinterpret_cast<const uint8_t*>(ptr), __ATOMIC_ACQUIRE);
+            case 2: return __atomic_load_n(reinterpret_cast<const uint16_t*>(ptr), __ATOMIC_ACQUIRE);
+            case 4: return __atomic_load_n(reinterpret_cast<const uint32_t*>(ptr), __ATOMIC_ACQUIRE);
+            case 8: return __atomic_load_n(reinterpret_cast<const uint64_t*>(ptr), __ATOMIC_ACQUIRE);
+        }
+    }
+
+    uint64_t value = 0;
+    memcpy(&value, ptr, len);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return value;
+}
+
+void Source::snapshot(size_t pos, size_t len, char* to, size_t seqPos, Type seqType)
+{
+    // Attempts before giving up and before yielding the CPU between them
+    constexpr unsigned MaxAttempts = 100000;
+    constexpr unsigned SpinAttempts = 100;
+
+    if (seqPos == nopos()) {
+        const char* p = data(pos, len);
+        if (p == nullptr) throwex("Insufficent data in source");
+        memcpy(to, p, len);
+        return;
+    }
+
+    const size_t seqLen = type_length(seqType);
+    for (unsigned attempt = 0; attempt < MaxAttempts; attempt++) {
+        // Pointers may change between calls of data(), so each is taken anew
+        const char* seq = data(seqPos, seqLen);
+        if (seq == nullptr) throwex("Insufficent data in source");
+        const uint64_t before = load_counter(seq, seqLen);
+
+        // An odd counter means the writer is in the middle of an update
+        if (before % 2 == 0) {
+            const char* p = data(pos, len);
+            if (p == nullptr) throwex("Insufficent data in source");
+            memcpy(to, p, len);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+            seq = data(seqPos, seqLen);
+            if (load_counter(seq, seqLen) == before) return;
+        }
+
+        if (attempt >= SpinAttempts) std::this_thread::yield();
+    }
+
+    throwex("No consistent snapshot: the data keeps changing");
+}
+
 /**********************************************************************
  */
 MallocSource::~MallocSource()
@@ -311,7 +726,7 @@ void MallocSource::init(const char* cfg)
 /**********************************************************************
  */
 MmapBase::MmapBase(const char* name)
-  : Source(name), m_fd(-1)
+  : Source(name), m_fd(-1), m_mapOffset(0), m_mapLen(0)
 {
 
 }
@@ -319,7 +734,7 @@ MmapBase::MmapBase(const char* name)
 MmapBase::~MmapBase()
 {
     if (m_ptr != nullptr && m_ptr != MAP_FAILED) {
-        munmap((void*)m_ptr, m_size);
+        munmap((void*)m_ptr, m_mapLen);
     }
 
     if (m_fd != -1) {
@@ -338,12 +753,146 @@ void MmapBase::map_fd()
     }
 
     m_size = sb.st_size;
-    m_ptr = (const char*)mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
-    if (m_ptr == MAP_FAILED) {
+
+    if (m_opts.hints & HintSequential) {
+        posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    } else if (m_opts.hints & (HintRandom | HintHeader)) {
+        posix_fadvise(m_fd, 0, 0, POSIX_FADV_RANDOM);
+    }
+
+    if (m_opts.hints & HintHeader) {
+        posix_fadvise(m_fd, 0, m_opts.header, POSIX_FADV_WILLNEED);
+    }
+
+    // Only the data before the limit is going to be read
+    if (data_end() < m_size) {
+        posix_fadvise(m_fd, 0, data_end(), POSIX_FADV_WILLNEED);
+    }
+
+    size_t mapLen = data_end();
+    if (m_opts.window != 0 && m_opts.window < mapLen) {
+        mapLen = m_opts.window;
+    }
+
+    // An empty file that is followed is mapped when it grows
+    if (mapLen == 0 && m_opts.follow) return;
+
+    try {
+        map(0, mapLen);
+    } catch (const Error&) {
         close(m_fd);
         m_fd = -1;
+        throw;
+    }
+}
+
+void MmapBase::map(size_t offset, size_t len)
+{
+    int flags = MAP_PRIVATE;
+    if (m_opts.hints & HintPopulate) flags |= MAP_POPULATE;
+
+    m_ptr = (const char*)mmap(NULL, len, PROT_READ, flags, m_fd, offset);
+    if (m_ptr == MAP_FAILED) {
+        m_ptr = nullptr;
+        m_mapLen = 0;
         throwex("Source: failed map");
     }
+
+    m_mapOffset = offset;
+    m_mapLen = len;
+    stats().bytesMapped += len;
+
+    advise();
+}
+
+void MmapBase::advise()
+{
+    void* addr = (void*)m_ptr;
+
+    if (m_opts.hints & HintSequential) {
+        madvise(addr, m_mapLen, MADV_SEQUENTIAL);
+    } else if (m_opts.hints & (HintRandom | HintHeader)) {
+        madvise(addr, m_mapLen, MADV_RANDOM);
+    }
+
+    if ((m_opts.hints & HintHeader) && m_mapOffset < m_opts.header) {
+        madvise(addr, std::min(m_mapLen, m_opts.header - m_mapOffset), MADV_WILLNEED);
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (m_opts.hints & HintHugePage) {
+        madvise(addr, m_mapLen, MADV_HUGEPAGE);
+    }
+#endif
+}
+
+// Map a window that covers "len" bytes at "pos". Pages of the previous
+// window are released, so the page cache and RSS stay bounded by
+// the window size.
+void MmapBase::remap(size_t pos, size_t len)
+{
+    static const size_t pageSize = sysconf(_SC_PAGESIZE);
+
+    // Going backward, keep some data behind the cursor as well
+    size_t start = pos;
+    if (pos < m_mapOffset) start -= std::min(pos, m_opts.window / 2);
+
+    // At the end of data that ends on a page boundary map its last page,
+    // an empty mapping fails
+    if (start >= data_end()) {
+        if (data_end() == 0) throwex("Insufficent data in source");
+        start = data_end() - 1;
+    }
+    start -= start % pageSize;
+
+    size_t mapLen = std::max(m_opts.window, pos + len - start);
+    mapLen = std::min(mapLen, data_end() - start);
+
+    // The part of the file left behind is not needed in the page cache
+    const size_t oldStart = m_mapOffset;
+    const size_t oldEnd = m_mapOffset + m_mapLen;
+    munmap((void*)m_ptr, m_mapLen);
+    if (start > oldStart) {
+        posix_fadvise(m_fd, oldStart, std::min(start, oldEnd) - oldStart, POSIX_FADV_DONTNEED);
+    } else if (start + mapLen < oldEnd) {
+        const size_t from = std::max(start + mapLen, oldStart);
+        posix_fadvise(m_fd, from, oldEnd - from, POSIX_FADV_DONTNEED);
+    }
+
+    map(start, mapLen);
+}
+
+const char* MmapBase::load(size_t pos, size_t& len)
+{
+    if (pos > m_size) {
+        len = 0;
+        return nullptr;
+    }
+
+    len = std::min(len, m_size - pos);
+    if (pos < m_mapOffset || pos + len > m_mapOffset + m_mapLen) {
+        remap(pos, len);
+    }
+
+    return m_ptr + (pos - m_mapOffset);
+}
+
+void MmapBase::prefetch(size_t len)
+{
+    if (m_mapOffset != 0) return;
+    len = std::min(len, m_mapLen);
+
+    readahead(m_fd, 0, len);
+    madvise((void*)m_ptr, len, MADV_WILLNEED);
+}
+
+void MmapBase::set_pos(size_t value)
+{
+    Source::set_pos(value);
+
+    if (value < m_mapOffset || value >= m_mapOffset + m_mapLen) {
+        if (value < data_end()) remap(value, 0);
+    }
 }
 
 /**********************************************************************
@@ -356,6 +905,80 @@ void FileSource::init(const char* cfg)
     map_fd();
 }
 
+void FileSource::adopt(int fd)
+{
+    m_fd = fd;
+    map_fd();
+}
+
+
+/**********************************************************************
+ */
+void SmallFileSource::init(const char* cfg)
+{
+    int fd = open(cfg, O_RDONLY);
+    if (fd < 0) throwex("Source: failed to open file");
+
+    read_file(fd);
+}
+
+void SmallFileSource::read_file(int fd)
+{
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        close(fd);
+        throwex("Source: failed stat file");
+    }
+
+    m_size = sb.st_size;
+    const size_t want = data_end();
+
+    m_buffer = acquire_buffer(want);
+    size_t len = 0;
+    while (len < want) {
+        ssize_t n = pread(fd, m_buffer->data.get() + len, want - len, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            close(fd);
+            throwex("Source: failed to read file");
+        }
+        if (n == 0) break;
+        len += n;
+    }
+    close(fd);
+
+    // The file was truncated after stat
+    if (len < want) m_size = len;
+
+    m_ptr = m_buffer->data.get();
+    stats().bytesRead += len;
+}
+
+void BufferSource::adopt(BufferPtr buffer, size_t size)
+{
+    m_buffer = std::move(buffer);
+    m_size = size;
+    m_ptr = m_buffer->data.get();
+}
+
+/**********************************************************************
+ */
+SliceSource::SliceSource(SourcePtr parent, size_t offset, size_t len)
+    : Source(parent->name().c_str()), m_parent(std::move(parent)), m_offset(offset)
+{
+    m_size = len;
+}
+
+const char* SliceSource::load(size_t pos, size_t& len)
+{
+    if (pos >= m_size) {
+        len = 0;
+        return nullptr;
+    }
+
+    len = std::min(len, m_size - pos);
+    return m_parent->fetch(m_offset + pos, len);
+}
 
 /**********************************************************************
  */
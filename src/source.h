@@ -17,8 +17,16 @@
 
 #pragma once
 #include "briebase.tab.h"
+#include "arena.h"
 #include <cstddef>
 #include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 namespace brie {
 
@@ -29,6 +37,82 @@ constexpr const char* PrefixMalloc = "malloc:";
 // memory segment.
 constexpr const char* PrefixSysVShMem = "sysvshmem:";
 
+// Prefix for the config string for the memory of another process.
+constexpr const char* PrefixPid = "pid:";
+
+// Prefix for the config string for the consumer of a ring buffer in
+// shared memory.
+constexpr const char* PrefixRing = "ring:";
+
+/*****************************************************************
+ *   Access pattern hints for mapped sources.
+ */
+enum Hint
+{
+    HintSequential = 1 << 0, // Sequential scan with aggressive readahead
+    HintRandom     = 1 << 1, // Random access without readahead
+    HintHeader     = 1 << 2, // Only the first "header" bytes are read
+    HintPopulate   = 1 << 3, // Prefault the whole mapping
+    HintHugePage   = 1 << 4, // Back the mapping with huge pages
+};
+
+/*****************************************************************
+ *   Options that control how a source is opened and read.
+ */
+struct SourceOptions
+{
+    // How many bytes behind the current position a stream source keeps
+    // for moving backward with set_pos().
+    size_t retention = 1024 * 1024;
+
+    // Size of the window that is mapped around the current position.
+    // Zero maps the whole file.
+    size_t window = 0;
+
+    // Combination of Hint values and the header size for HintHeader.
+    unsigned hints = 0;
+    size_t header = 0;
+
+    // Only this many bytes from the start are mapped or read; the size
+    // still reports the whole data. Zero means no limit.
+    size_t limit = 0;
+
+    // Regular files smaller than this are read into a pooled buffer
+    // instead of being mapped. Zero maps all files.
+    size_t smallFile = 64 * 1024;
+
+    // Regular files are read with O_DIRECT in blocks of this size,
+    // bypassing the page cache. Zero maps files as usual.
+    size_t direct = 0;
+
+    // Regular files are followed as they grow: reads past the end wait
+    // for more data instead of failing.
+    bool follow = false;
+
+    // Size of the page cache of sources that are read in pages, such
+    // as the memory of another process.
+    size_t cache = 256 * 1024;
+
+    // Regular files that start with gzip or zstd magic are read
+    // decompressed (--decompress). Off by default, so scripts see the
+    // raw bytes of compressed containers and no file is sniffed.
+    bool decompress = false;
+
+    // Directory for the seek indexes of compressed files and the
+    // record indexes of index() (--index-dir). Empty keeps the seek
+    // indexes in $XDG_CACHE_HOME/brie (~/.cache/brie) and the record
+    // indexes next to the inputs.
+    std::string indexDir;
+};
+
+bool operator==(const SourceOptions& left, const SourceOptions& right);
+
+// Options used by make_source() when they are not given explicitly.
+SourceOptions& default_source_options();
+
+// Parse comma separated hints, e.g. "sequential,populate" or "header:4096".
+void parse_hints(const char* str, SourceOptions& opts);
+
 //=======================================================================
 class Source
 {
@@ -37,6 +121,24 @@ public:
     virtual ~Source() {}
 
     virtual void init(const char* cfg) = 0;
+    void set_options(const SourceOptions& opts) { m_opts = opts; }
+
+    // Ask storage for the first "len" bytes ahead of reading them.
+    virtual void prefetch(size_t /*len*/) {}
+
+    // Wait until the data grows to at least "end" bytes. Returns false
+    // if the source does not grow or following was stopped.
+    virtual bool grow(size_t /*end*/) { return false; }
+
+    // False while size() counts only the data received so far, e.g.
+    // of a pipe that has not ended yet.
+    virtual bool sized() const { return true; }
+
+    // Replace the data with the next part for sources that deliver data
+    // in parts, e.g. records of a ring buffer. Waits for the part to
+    // arrive; returns false if there are no parts or following was
+    // stopped.
+    virtual bool next() { return false; }
 
     const char* ptr() const { return m_ptr; }
     size_t size() const { return m_size; }
@@ -49,18 +151,59 @@ public:
     std::string read_wstr(size_t len = 0);
 
     void set_size(size_t value) { m_size = value; }
-    void set_pos(size_t value);
+    virtual void set_pos(size_t value);
     void set_test_pos(const char* str);
     void set_name(const char* str) { m_name = str; }
 
     static size_t nopos() { return UINT64_MAX; }
     size_t find(const char* str, size_t maxOffset);
 
+    // First position at or after "pos" where the bytes ANDed with
+    // "mask" equal "pattern", or nopos(). "pattern" must be masked
+    // already and "mask" must have the same length.
+    size_t find_masked(size_t pos, const std::string& pattern, const std::string& mask);
+
+    // Copy "len" bytes at "pos" to "to". If "seqPos" is not nopos() it
+    // is the position of a sequence counter of "seqType" that a writer
+    // updates with the seqlock protocol: the copy is repeated until the
+    // counter is even and not changed by the copy. Throws if no
+    // consistent copy is made after a bounded number of attempts.
+    void snapshot(size_t pos, size_t len, char* to, size_t seqPos = nopos(), Type seqType = U32);
+
+    // Decompress "len" bytes of zlib or gzip data at "pos", or of raw
+    // deflate data if "raw" is set, into a new source over a pooled
+    // buffer. Throws on invalid data or more than "maxSize" bytes of
+    // output.
+    std::shared_ptr<Source> inflate(size_t pos, size_t len, bool raw = false, size_t maxSize = 1ull << 30);
+
+protected:
+    friend class SliceSource;
+
+    // Make up to "len" bytes starting at "pos" accessible and return
+    // a pointer to them. On return "len" holds the number of accessible
+    // bytes; zero means the end of data. The pointer stays valid until
+    // the next call. Throws when "pos" is at the read limit.
+    const char* fetch(size_t pos, size_t& len);
+
+    // Pointer to exactly "len" bytes at "pos" or nullptr. Throws when
+    // the bytes cross the read limit.
+    const char* data(size_t pos, size_t len);
+
+    // Implementation of fetch() for a particular kind of source.
+    virtual const char* load(size_t pos, size_t& len);
+
+    // End of the data that can be read: the size or the read limit.
+    size_t data_end() const;
+
+    size_t find_byte(size_t pos, char c);
+    void throw_limit() const;
+
 protected:
     const char* m_ptr;
     size_t m_size;
     size_t m_pos;
     std::string m_name;
+    SourceOptions m_opts;
 };
 
 using SourcePtr = std::shared_ptr<Source>;
@@ -81,19 +224,66 @@ public:
     MmapBase(const char* name);
     virtual ~MmapBase();
 
+    virtual void set_pos(size_t value) override;
+    virtual void prefetch(size_t len) override;
+
 protected:
     int m_fd;
+    size_t m_mapOffset; // Offset of m_ptr in the file
+    size_t m_mapLen;    // Length of the mapping at m_ptr
 
 protected:
     void map_fd();
+    void map(size_t offset, size_t len);
+    void advise();
+    void remap(size_t pos, size_t len);
+    void extend(size_t size);
+    virtual const char* load(size_t pos, size_t& len) override;
 };
 
 //=======================================================================
 class FileSource : public MmapBase
 {
 public:
-    FileSource(const char* name) : MmapBase(name) {}
+    FileSource(const char* name);
+    virtual ~FileSource();
     virtual void init(const char* cfg) override;
+    virtual bool grow(size_t end) override;
+
+    // Map a file that is already open; the source owns "fd".
+    void adopt(int fd);
+
+private:
+    struct Watcher;
+    std::unique_ptr<Watcher> m_watcher;
+};
+
+//=======================================================================
+// Source over data copied into a pooled buffer.
+class BufferSource : public Source
+{
+public:
+    BufferSource(const char* name) : Source(name) {}
+    virtual void init(const char* /*cfg*/) override {}
+
+    // Use a buffer that already holds the data.
+    void adopt(BufferPtr buffer, size_t size);
+
+protected:
+    BufferPtr m_buffer;
+};
+
+//=======================================================================
+// Small file read with a single pread() into a pooled buffer. It avoids
+// mmap/munmap costs that dominate for files of a few kilobytes.
+class SmallFileSource : public BufferSource
+{
+public:
+    SmallFileSource(const char* name) : BufferSource(name) {}
+    virtual void init(const char* cfg) override;
+
+    // Read the whole file from "fd" and close it
+    void read_file(int fd);
 };
 
 //=======================================================================
@@ -115,9 +305,343 @@ private:
     int m_shmid;
 };
 
+//=======================================================================
+// Source reading a non-seekable descriptor (pipe, FIFO, terminal).
+// Data is kept in a sliding window: set_pos() can go back at most
+// "retention" bytes and skipping forward discards the input. The
+// window grows past a few times the retention only for a single read
+// that needs it.
+// size() reports the number of bytes received so far and is final
+// only once sized() is true; grow() waits for more input.
+class StreamSource : public Source
+{
+public:
+    StreamSource(const char* name);
+    virtual ~StreamSource();
+    virtual void init(const char* cfg) override;
+    virtual void set_pos(size_t value) override;
+    virtual bool grow(size_t end) override;
+    virtual bool sized() const override { return m_eof; }
+
+protected:
+    virtual const char* load(size_t pos, size_t& len) override;
+
+private:
+    struct Reader;
+
+    bool pull(std::vector<char>& chunk);
+    void drop(size_t from);
+    void append(const char* data, size_t len, size_t keep, size_t need);
+
+private:
+    int m_fd;
+    std::vector<char> m_window;
+    std::vector<char> m_chunk;
+    size_t m_base;   // Stream offset of m_window[0]
+    size_t m_filled; // Valid bytes in m_window
+    bool m_eof;
+    std::unique_ptr<Reader> m_reader;
+};
+
+//=======================================================================
+// Regular file read with O_DIRECT so a large scan does not evict the
+// page cache. Blocks are read ahead by a background thread into two
+// aligned buffers and copied into a window around the current
+// position. File systems without O_DIRECT support are read normally
+// and the consumed blocks are dropped from the cache.
+class DirectSource : public Source
+{
+public:
+    // Alignment of O_DIRECT buffers, offsets and lengths
+    static constexpr size_t Align = 4096;
+
+    DirectSource(const char* name);
+    virtual ~DirectSource();
+    virtual void init(const char* cfg) override;
+
+    bool is_direct() const { return m_direct; }
+
+protected:
+    virtual const char* load(size_t pos, size_t& len) override;
+
+private:
+    struct Reader;
+
+    void restart(size_t offset);
+
+private:
+    int m_fd;
+    bool m_direct;   // The file was opened with O_DIRECT
+    size_t m_block;
+    std::vector<char> m_window;
+    size_t m_base;   // File offset of m_window[0]
+    size_t m_filled; // Valid bytes in m_window
+    bool m_eof;
+    std::unique_ptr<Reader> m_reader;
+};
+
+//=======================================================================
+// Source read in fixed size pages through a small LRU cache. A read
+// loads all missing pages it covers and a few pages ahead with one
+// call of read_pages(), one iovec per page. Data crossing a page
+// boundary is copied into a scratch buffer.
+class CachedSource : public Source
+{
+public:
+    CachedSource(const char* name);
+    virtual ~CachedSource();
+
+protected:
+    // Set the page size and how many pages after a missing one are
+    // loaded with it. The cache size comes from the options.
+    void init_cache(size_t pageSize, size_t readahead);
+
+    // Read data at "offset" into the pages of "iov". Returns the number
+    // of bytes read, which may be short at the end of readable data.
+    virtual size_t read_pages(size_t offset, const iovec* iov, size_t count) = 0;
+
+    virtual const char* load(size_t pos, size_t& len) override;
+
+private:
+    struct Page
+    {
+        size_t index = SIZE_MAX; // Page number in the source
+        size_t valid = 0;        // Bytes read into the page
+        uint64_t used = 0;       // Time of the last use for LRU
+        char* data = nullptr;
+    };
+
+    void add_pages(size_t count);
+    Page* find_page(size_t index);
+    void load_pages(size_t first, size_t last);
+    Page& evict(size_t first, size_t last);
+
+private:
+    size_t m_pageSize;
+    size_t m_readahead;
+    std::vector<Page> m_pages;
+    std::unordered_map<size_t, size_t> m_index; // Page number to slot
+    uint64_t m_clock;
+    std::vector<char> m_scratch;
+};
+
+//=======================================================================
+// Memory of another process read with process_vm_readv(). The config
+// is "pid:<pid>" to address the whole memory by virtual addresses,
+// "pid:<pid>:<addr>:<len>" for a region, or "pid:<pid>:<name>" for the
+// mappings of a file or a special region like [heap] or [stack]. In the
+// last two cases position 0 is the start of the region. Reads outside
+// of the mappings listed in /proc/<pid>/maps fail.
+class ProcessSource : public CachedSource
+{
+public:
+    ProcessSource(const char* name);
+    virtual void init(const char* cfg) override;
+
+protected:
+    virtual size_t read_pages(size_t offset, const iovec* iov, size_t count) override;
+
+private:
+    struct Mapping
+    {
+        size_t start;
+        size_t end;
+        std::string path;
+    };
+
+    void read_maps();
+    size_t mapped_end(size_t addr) const;
+
+private:
+    pid_t m_pid;
+    size_t m_base; // Address of position 0
+    std::vector<Mapping> m_maps;
+};
+
+//=======================================================================
+// Block device or partition read in aligned pages through the page
+// cache of CachedSource, so devices of any size are never mapped and
+// random set_pos() is cheap. The size comes from BLKGETSIZE64 and the
+// readahead from the device settings (BLKRAGET) unless the hints ask
+// for random or sequential access. Disk images in regular files are
+// read the same way.
+class BlockDeviceSource : public CachedSource
+{
+public:
+    BlockDeviceSource(const char* name);
+    virtual ~BlockDeviceSource();
+    virtual void init(const char* cfg) override;
+
+    size_t sector_size() const { return m_sectorSize; }
+
+protected:
+    virtual size_t read_pages(size_t offset, const iovec* iov, size_t count) override;
+
+private:
+    int m_fd;
+    size_t m_sectorSize;
+};
+
+//=======================================================================
+// Consumer of a ring buffer that a producer fills in shared memory.
+// The config is "ring:<segment>,<layout>" where the segment is a SysV
+// shared memory id, a file or a Posix shared memory name, and the
+// layout is a comma separated list of:
+//   tail=OFF      offset of the producer write counter (required)
+//   head=OFF      offset of the read counter to start from; without it
+//                 only records written after attaching are read
+//   data=OFF      offset of the ring data (required)
+//   capacity=N    size of the ring data; the rest of the segment by default
+//   record=N      size of fixed size records, or
+//   prefix=N      size of the length prefix of variable size records
+//   counter=N     size of the counters: 4 or 8 (default)
+// Counters are byte offsets that only grow; a position in the ring is
+// the counter modulo the capacity, which must be a power of two with
+// 4 byte counters. Length prefixes are in the native byte order.
+// Records may wrap around the end of the ring. The source holds one
+// record at a time and next() waits for the following one.
+class RingSource : public Source
+{
+public:
+    RingSource(const char* name);
+    virtual ~RingSource();
+    virtual void init(const char* cfg) override;
+    virtual bool next() override;
+
+    // Bytes lost because the producer overwrote unread records
+    size_t lost() const { return m_lost; }
+
+private:
+    uint64_t counter(size_t offset) const;
+    uint64_t distance(uint64_t tail) const;
+    void copy(uint64_t from, size_t len, char* to) const;
+    void attach(const std::string& segment);
+
+private:
+    const char* m_base;    // Start of the segment
+    size_t m_segSize;
+    int m_shmid;           // SysV segment or -1
+    size_t m_headOffset;
+    size_t m_tailOffset;
+    size_t m_dataOffset;
+    size_t m_capacity;
+    size_t m_record;
+    size_t m_prefix;
+    size_t m_counter;
+    uint64_t m_cursor;     // Counter value of the next record
+    size_t m_lost;
+    std::vector<char> m_buffer;
+};
+
+//=======================================================================
+// Regular file compressed with gzip or zstd, decompressed as it is
+// read when SourceOptions::decompress is set. The first open
+// decompresses the whole file once to learn its size and records a
+// seek point every few megabytes of output. With an index directory
+// the points are saved there and later opens load them if the file
+// has not changed. set_pos() restarts decompression at the
+// nearest point instead of the start. A gzip point holds the 32K of
+// history the inflater needs; zstd can restart only at frame starts.
+// A window of decompressed data around the position is kept; ptr() is
+// null.
+class CompressedSource : public Source
+{
+public:
+    CompressedSource(const char* name);
+    virtual ~CompressedSource();
+    virtual void init(const char* cfg) override;
+
+    // Decompress a file that is already open; the source owns "fd".
+    void adopt(int fd);
+
+    size_t seek_points() const;
+
+    // The seek points were loaded from the index directory
+    bool index_loaded() const { return m_indexLoaded; }
+
+    struct SeekPoint;
+    struct Decoder;
+
+protected:
+    virtual const char* load(size_t pos, size_t& len) override;
+
+private:
+    std::string index_path(bool create) const;
+    bool load_index(const struct stat& st);
+    void save_index(const struct stat& st) const;
+    void restart(const SeekPoint& point);
+
+private:
+    int m_fd;
+    const unsigned char* m_data; // Mapping of the compressed file
+    size_t m_dataSize;
+    int m_format;
+    std::unique_ptr<Decoder> m_decoder;
+    std::vector<SeekPoint> m_points;
+    bool m_indexLoaded;
+    std::vector<char> m_window;
+    size_t m_base;   // Offset of m_window[0] in decompressed data
+    size_t m_filled; // Valid bytes in m_window
+};
+
+// Compression formats detected by compressed_format()
+enum { FormatNone, FormatGzip, FormatZstd };
+
+// Format of compressed data that starts with "len" bytes of "head"
+int compressed_format(const char* head, size_t len);
+
+//=======================================================================
+// Part of another source with its own position and bounds. Positions
+// are relative to the start of the slice and reads cannot go past its
+// end. Data is read from the parent in place, without copying, so any
+// number of slices can walk one mapping at once. ptr() is null.
+class SliceSource : public Source
+{
+public:
+    SliceSource(SourcePtr parent, size_t offset, size_t len);
+    virtual void init(const char* /*cfg*/) override {}
+
+    const SourcePtr& parent() const { return m_parent; }
+
+    // Offset of the slice in the parent source
+    size_t offset() const { return m_offset; }
+
+protected:
+    virtual const char* load(size_t pos, size_t& len) override;
+
+private:
+    SourcePtr m_parent;
+    size_t m_offset;
+};
+
+// Size of a value of a numeric type
+size_t type_length(Type type);
+
 /*****************************************************************
  *   Create a source object based on the "cfg" string content.
  */
 SourcePtr make_source(const char* cfg);
+SourcePtr make_source(const char* cfg, const SourceOptions& opts);
+
+// Make grow() and next() of all sources return false, e.g. on SIGINT. It is
+// safe to call from a signal handler.
+void stop_following(bool stop = true);
+bool following_stopped();
+
+// Same as make_source(), but a regular file opened recently with the
+// same options is reused if it has not changed and no one holds it.
+// Files opened often by a script are not mapped again every time.
+SourcePtr open_source(const char* cfg, const SourceOptions& opts);
+
+// Slice of "len" bytes at "offset" of "parent". A slice of a slice
+// refers to the original source.
+SourcePtr make_slice(SourcePtr parent, size_t offset, size_t len);
+
+// Source over "size" bytes of data in "buffer"
+SourcePtr make_buffer_source(const char* name, BufferPtr buffer, size_t size);
+
+// Sources for files opened and read by the batch loader
+SourcePtr make_file_source(const char* cfg, int fd, const SourceOptions& opts);
+SourcePtr make_small_file_source(const char* cfg, BufferPtr buffer, size_t size, const SourceOptions& opts);
 
 } // namespace brie
@@ -0,0 +1,120 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "source.h"
+#include "error.h"
+#include "stats.h"
+#include "utils/log.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace brie {
+
+// Page of the cache; a multiple of any common sector size
+static constexpr size_t DevicePage = 64 * 1024;
+
+// Readahead for sequential access and when the device reports none
+static constexpr size_t MaxDeviceReadahead = 1024 * 1024;
+static constexpr size_t DefaultDeviceReadahead = 128 * 1024;
+
+/**********************************************************************
+ */
+BlockDeviceSource::BlockDeviceSource(const char* name)
+  : CachedSource(name), m_fd(-1), m_sectorSize(512)
+{
+
+}
+
+BlockDeviceSource::~BlockDeviceSource()
+{
+    if (m_fd != -1) close(m_fd);
+}
+
+void BlockDeviceSource::init(const char* cfg)
+{
+    // The source has its own cache, so the kernel one is bypassed if possible
+    m_fd = open(cfg, O_RDONLY | O_DIRECT);
+    if (m_fd < 0 && errno == EINVAL) m_fd = open(cfg, O_RDONLY);
+    if (m_fd < 0) throwex(std::string("Source: failed to open device ") + cfg);
+
+    struct stat sb;
+    if (fstat(m_fd, &sb) < 0) throwex("Source: failed stat device");
+
+    size_t readahead = DefaultDeviceReadahead;
+    if (S_ISBLK(sb.st_mode)) {
+        uint64_t size = 0;
+        if (ioctl(m_fd, BLKGETSIZE64, &size) < 0) throwex("Source: failed to get device size");
+        m_size = size;
+
+        int sector = 0;
+        if (ioctl(m_fd, BLKSSZGET, &sector) == 0 && sector > 0) m_sectorSize = sector;
+
+        // Readahead of the device in 512 byte sectors
+        long ra = 0;
+        if (ioctl(m_fd, BLKRAGET, &ra) == 0 && ra > 0) readahead = ra * 512;
+    } else {
+        m_size = sb.st_size;
+    }
+
+    if (m_opts.hints & (HintRandom | HintHeader)) {
+        readahead = 0;
+    } else if (m_opts.hints & HintSequential) {
+        readahead = MaxDeviceReadahead;
+    }
+
+    const size_t page = std::max(DevicePage, m_sectorSize);
+    init_cache(page, std::min(readahead, MaxDeviceReadahead));
+
+    LOG_DEBUG << "Device " << cfg << ": size " << m_size << ", sector " << m_sectorSize
+              << ", readahead " << readahead;
+}
+
+size_t BlockDeviceSource::read_pages(size_t offset, const iovec* iov, size_t count)
+{
+    size_t total = 0;
+    while (count > 0) {
+        ssize_t n = preadv(m_fd, iov, count, offset + total);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) throwex(std::string("Source: failed to read device: ") + strerror(errno));
+        if (n == 0) break;
+
+        total += n;
+        stats().bytesRead += n;
+
+        // Continue a short read from the page where it stopped
+        size_t done = n;
+        while (count > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (done != 0) break; // Partial page at the end of the device
+    }
+
+    return total;
+}
+
+} // namespace brie
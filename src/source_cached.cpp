@@ -0,0 +1,179 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "source.h"
+#include "error.h"
+#include "utils/log.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <stdlib.h>
+
+namespace brie {
+
+/**********************************************************************
+ */
+CachedSource::CachedSource(const char* name)
+  : Source(name), m_pageSize(4096), m_readahead(0), m_clock(0)
+{
+
+}
+
+CachedSource::~CachedSource()
+{
+    for (Page& page: m_pages) free(page.data);
+}
+
+void CachedSource::init_cache(size_t pageSize, size_t readahead)
+{
+    m_pageSize = pageSize;
+    m_readahead = readahead;
+
+    add_pages(std::max<size_t>(m_opts.cache / pageSize, 4));
+}
+
+void CachedSource::add_pages(size_t count)
+{
+    m_pages.reserve(m_pages.size() + count);
+
+    // Pages are aligned for sources that read with O_DIRECT
+    for (size_t i = 0; i < count; i++) {
+        void* ptr = nullptr;
+        if (posix_memalign(&ptr, std::max<size_t>(m_pageSize, 4096), m_pageSize) != 0) {
+            throwex("Source: failed to allocate the page cache");
+        }
+
+        Page page;
+        page.data = static_cast<char*>(ptr);
+        m_pages.push_back(page);
+    }
+}
+
+CachedSource::Page* CachedSource::find_page(size_t index)
+{
+    const auto iter = m_index.find(index);
+    if (iter == m_index.end()) return nullptr;
+
+    Page& page = m_pages[iter->second];
+    page.used = ++m_clock;
+    return &page;
+}
+
+// Take the least recently used page that is not in [first, last]
+CachedSource::Page& CachedSource::evict(size_t first, size_t last)
+{
+    Page* victim = nullptr;
+    for (Page& page: m_pages) {
+        if (page.index != SIZE_MAX && page.index >= first && page.index <= last) continue;
+        if (victim == nullptr || page.used < victim->used) victim = &page;
+    }
+
+    if (victim->index != SIZE_MAX) m_index.erase(victim->index);
+    victim->index = SIZE_MAX;
+    victim->valid = 0;
+    return *victim;
+}
+
+// Load the missing pages in [first, last]; each run of consecutive
+// missing pages is read with one call.
+void CachedSource::load_pages(size_t first, size_t last)
+{
+    // A read larger than the cache grows it
+    if (last - first + 1 > m_pages.size()) {
+        add_pages(last - first + 1 - m_pages.size());
+    }
+
+    std::vector<iovec> iov;
+    std::vector<Page*> run;
+
+    auto flush = [&]() {
+        if (run.empty()) return;
+
+        size_t n = read_pages(run.front()->index * m_pageSize, iov.data(), iov.size());
+        for (Page* page: run) {
+            page->valid = std::min(n, m_pageSize);
+            n -= page->valid;
+            m_index[page->index] = page - m_pages.data();
+        }
+
+        iov.clear();
+        run.clear();
+    };
+
+    for (size_t index = first; index <= last; index++) {
+        if (find_page(index) != nullptr) {
+            flush();
+            continue;
+        }
+
+        Page& page = evict(first, last);
+        page.index = index;
+        page.used = ++m_clock;
+        iov.push_back({ page.data, m_pageSize });
+        run.push_back(&page);
+    }
+
+    flush();
+}
+
+const char* CachedSource::load(size_t pos, size_t& len)
+{
+    if (pos >= m_size) {
+        len = 0;
+        return nullptr;
+    }
+
+    len = std::min(len, m_size - pos);
+    if (len == 0) return nullptr;
+
+    const size_t first = pos / m_pageSize;
+    const size_t last = (pos + len - 1) / m_pageSize;
+    const size_t lastPage = (m_size - 1) / m_pageSize;
+
+    // Pages ahead are loaded only together with a missing page
+    if (find_page(last) == nullptr || find_page(first) == nullptr) {
+        const size_t ahead = std::min(m_readahead / m_pageSize, m_pages.size() / 2);
+        load_pages(first, std::min(lastPage, std::max(last, first + ahead)));
+    }
+
+    const size_t offset = pos - first * m_pageSize;
+    Page* page = find_page(first);
+    if (first == last) {
+        len = std::min(len, page->valid > offset ? page->valid - offset : 0);
+        return page->data + offset;
+    }
+
+    // Data crossing pages is assembled in the scratch buffer
+    if (m_scratch.size() < len) m_scratch.resize(len);
+
+    size_t copied = 0;
+    for (size_t index = first; index <= last && copied < len; index++) {
+        page = find_page(index);
+        const size_t from = index == first ? offset : 0;
+        const size_t n = std::min(len - copied, page->valid > from ? page->valid - from : 0);
+
+        memcpy(m_scratch.data() + copied, page->data + from, n);
+        copied += n;
+        if (from + n < m_pageSize) break; // Short page
+    }
+
+    len = copied;
+    return m_scratch.data();
+}
+
+} // namespace brie
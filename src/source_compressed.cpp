@@ -0,0 +1,571 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "source.h"
+#include "index.h"
+#include "error.h"
+#include "stats.h"
+#include "utils/log.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef BRIE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace brie {
+
+static constexpr size_t IndexSpan = 4 * 1024 * 1024; // Output between seek points
+static constexpr size_t HistorySize = 32 * 1024;    // Window of deflate
+static constexpr size_t Chunk = 256 * 1024;          // Output decoded at once
+static const char IndexMagic[8] = { 'B', 'R', 'I', 'E', 'I', 'D', 'X', '1' };
+static const char* IndexSuffix = ".brix";
+
+struct CompressedSource::SeekPoint
+{
+    uint64_t out = 0;          // Offset in the decompressed data
+    uint64_t in = 0;           // Offset in the file
+    uint32_t bits = 0;         // gzip: bits of the byte before "in" to decode
+    std::vector<char> history; // gzip: output before "out"; empty at a member start
+};
+
+// Decompressor that can start at a seek point
+struct CompressedSource::Decoder
+{
+    virtual ~Decoder() {}
+
+    // Decompress all data, add seek points after the first one and
+    // return the size of the decompressed data.
+    virtual uint64_t scan(std::vector<SeekPoint>& points) = 0;
+
+    virtual void start(const SeekPoint& point) = 0;
+
+    // Decompress up to "len" bytes; zero at the end of data.
+    virtual size_t decode(char* out, size_t len) = 0;
+};
+
+int compressed_format(const char* head, size_t len)
+{
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(head);
+    if (len >= 2 && p[0] == 0x1f && p[1] == 0x8b) return FormatGzip;
+    if (len >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd) return FormatZstd;
+    return FormatNone;
+}
+
+/**********************************************************************
+ *   gzip, including files of several members. Seek points are at the
+ *   ends of deflate blocks and restart inflate in raw mode with the
+ *   saved history as the dictionary.
+ */
+class GzipDecoder : public CompressedSource::Decoder
+{
+public:
+    GzipDecoder(const unsigned char* data, size_t size) : m_data(data), m_size(size), m_raw(false), m_end(false)
+    {
+        memset(&m_strm, 0, sizeof(m_strm));
+        if (inflateInit2(&m_strm, GzipBits) != Z_OK) throwex("Source: failed to initialize zlib");
+        m_strm.next_in = const_cast<unsigned char*>(m_data);
+    }
+
+    virtual ~GzipDecoder() { inflateEnd(&m_strm); }
+
+    virtual uint64_t scan(std::vector<CompressedSource::SeekPoint>& points) override
+    {
+        start(points.front());
+
+        std::vector<char> window(HistorySize);
+        uint64_t out = 0;
+        while (true) {
+            if (m_strm.avail_out == 0) {
+                m_strm.next_out = reinterpret_cast<unsigned char*>(window.data());
+                m_strm.avail_out = HistorySize;
+            }
+            const unsigned before = m_strm.avail_out;
+            const int ret = step(Z_BLOCK);
+            out += before - m_strm.avail_out;
+
+            if (ret == Z_STREAM_END) {
+                if (!next_member()) break;
+                continue;
+            }
+
+            // End of a deflate block that is not the last one
+            const bool boundary = (m_strm.data_type & 128) && !(m_strm.data_type & 64);
+            if (!boundary || out - points.back().out < IndexSpan) continue;
+
+            CompressedSource::SeekPoint point;
+            point.out = out;
+            point.in = m_strm.next_in - m_data;
+            point.bits = m_strm.data_type & 7;
+            point.history.resize(HistorySize);
+
+            // The window is circular: the oldest output follows the free space
+            const size_t left = m_strm.avail_out;
+            memcpy(point.history.data(), window.data() + HistorySize - left, left);
+            memcpy(point.history.data() + left, window.data(), HistorySize - left);
+            points.push_back(std::move(point));
+        }
+
+        return out;
+    }
+
+    virtual void start(const CompressedSource::SeekPoint& point) override
+    {
+        m_end = false;
+        m_raw = !point.history.empty();
+        inflateReset2(&m_strm, m_raw ? -MAX_WBITS : GzipBits);
+        m_strm.next_in = const_cast<unsigned char*>(m_data + point.in);
+        m_strm.avail_in = 0;
+        m_strm.avail_out = 0;
+
+        if (!m_raw) return;
+
+        if (point.bits != 0) {
+            inflatePrime(&m_strm, point.bits, m_data[point.in - 1] >> (8 - point.bits));
+        }
+        inflateSetDictionary(&m_strm, reinterpret_cast<const unsigned char*>(point.history.data()), HistorySize);
+    }
+
+    virtual size_t decode(char* out, size_t len) override
+    {
+        if (m_end) return 0;
+
+        m_strm.next_out = reinterpret_cast<unsigned char*>(out);
+        m_strm.avail_out = len;
+        while (m_strm.avail_out > 0) {
+            if (step(Z_NO_FLUSH) == Z_STREAM_END && !next_member()) {
+                m_end = true;
+                break;
+            }
+        }
+
+        return len - m_strm.avail_out;
+    }
+
+private:
+    static constexpr int GzipBits = MAX_WBITS + 16;
+
+    // One call of inflate() with more input if it needs it
+    int step(int flush)
+    {
+        if (m_strm.avail_in == 0) {
+            const size_t in = m_strm.next_in - m_data;
+            m_strm.avail_in = std::min<size_t>(m_size - in, UINT_MAX);
+        }
+
+        const int ret = inflate(&m_strm, flush);
+        if (ret == Z_OK || ret == Z_STREAM_END) return ret;
+        if (ret == Z_BUF_ERROR && m_strm.avail_in == 0) throwex("Source: gzip data is truncated");
+        if (ret == Z_BUF_ERROR) return ret;
+        throwex("Source: invalid gzip data");
+        return ret;
+    }
+
+    // Continue with the next gzip member, if there is one
+    bool next_member()
+    {
+        size_t in = m_strm.next_in - m_data;
+
+        // Raw inflate stops before the trailer of the member
+        if (m_raw) in += 8;
+
+        if (in + 2 > m_size || m_data[in] != 0x1f || m_data[in + 1] != 0x8b) return false;
+
+        m_raw = false;
+        inflateReset2(&m_strm, GzipBits);
+        m_strm.next_in = const_cast<unsigned char*>(m_data + in);
+        m_strm.avail_in = 0;
+        return true;
+    }
+
+private:
+    const unsigned char* m_data;
+    size_t m_size;
+    z_stream m_strm;
+    bool m_raw; // Inflating a deflate stream without the gzip wrapper
+    bool m_end;
+};
+
+#ifdef BRIE_ZSTD
+/**********************************************************************
+ *   zstd. Seek points are at frame starts.
+ */
+class ZstdDecoder : public CompressedSource::Decoder
+{
+public:
+    ZstdDecoder(const unsigned char* data, size_t size) : m_ctx(ZSTD_createDCtx()), m_in{ data, size, 0 }, m_last(0)
+    {
+        if (m_ctx == nullptr) throwex("Source: failed to initialize zstd");
+    }
+
+    virtual ~ZstdDecoder() { ZSTD_freeDCtx(m_ctx); }
+
+    virtual uint64_t scan(std::vector<CompressedSource::SeekPoint>& points) override
+    {
+        start(points.front());
+
+        std::vector<char> buffer(Chunk);
+        uint64_t out = 0;
+        while (true) {
+            const size_t n = decode(buffer.data(), buffer.size());
+            if (n == 0) break;
+            out += n;
+
+            // A frame ended exactly at the end of the output
+            if (m_last == 0 && m_in.pos < m_in.size && out - points.back().out >= IndexSpan) {
+                CompressedSource::SeekPoint point;
+                point.out = out;
+                point.in = m_in.pos;
+                points.push_back(std::move(point));
+            }
+        }
+
+        return out;
+    }
+
+    virtual void start(const CompressedSource::SeekPoint& point) override
+    {
+        ZSTD_DCtx_reset(m_ctx, ZSTD_reset_session_only);
+        m_in.pos = point.in;
+        m_last = 0;
+    }
+
+    virtual size_t decode(char* out, size_t len) override
+    {
+        ZSTD_outBuffer output = { out, len, 0 };
+        while (output.pos < output.size) {
+            const size_t before = output.pos;
+            const size_t inBefore = m_in.pos;
+            if (m_in.pos == m_in.size && m_last == 0) break;
+
+            m_last = ZSTD_decompressStream(m_ctx, &output, &m_in);
+            if (ZSTD_isError(m_last)) throwex(std::string("Source: invalid zstd data: ") + ZSTD_getErrorName(m_last));
+
+            // A frame ended: stop so that scan() sees the boundary
+            if (m_last == 0 && output.pos > 0) break;
+
+            if (output.pos == before && m_in.pos == inBefore) throwex("Source: zstd data is truncated");
+        }
+
+        return output.pos;
+    }
+
+private:
+    ZSTD_DCtx* m_ctx;
+    ZSTD_inBuffer m_in;
+    size_t m_last; // Result of the last ZSTD_decompressStream()
+};
+#endif
+
+/**********************************************************************
+ */
+CompressedSource::CompressedSource(const char* name)
+    : Source(name)
+    , m_fd(-1)
+    , m_data(nullptr)
+    , m_dataSize(0)
+    , m_format(FormatNone)
+    , m_indexLoaded(false)
+    , m_base(0)
+    , m_filled(0)
+{
+}
+
+CompressedSource::~CompressedSource()
+{
+    m_decoder.reset();
+    if (m_data != nullptr) munmap(const_cast<unsigned char*>(m_data), m_dataSize);
+    if (m_fd >= 0) close(m_fd);
+}
+
+void CompressedSource::init(const char* cfg)
+{
+    int fd = open(cfg, O_RDONLY);
+    if (fd < 0) throwex("Source: failed to open file");
+
+    adopt(fd);
+}
+
+void CompressedSource::adopt(int fd)
+{
+    m_fd = fd;
+
+    struct stat st;
+    if (fstat(m_fd, &st) != 0) throwex("Source: failed to get file size");
+    m_dataSize = st.st_size;
+
+    void* ptr = mmap(nullptr, m_dataSize, PROT_READ, MAP_PRIVATE, m_fd, 0);
+    if (ptr == MAP_FAILED) throwex("Source: failed to map compressed file");
+    m_data = static_cast<const unsigned char*>(ptr);
+    stats().bytesMapped += m_dataSize;
+
+    m_format = compressed_format(reinterpret_cast<const char*>(m_data), m_dataSize);
+    if (m_format == FormatGzip) {
+        m_decoder = std::make_unique<GzipDecoder>(m_data, m_dataSize);
+    } else if (m_format == FormatZstd) {
+#ifdef BRIE_ZSTD
+        m_decoder = std::make_unique<ZstdDecoder>(m_data, m_dataSize);
+#else
+        throwex("Source: zstd support is not built in");
+#endif
+    } else {
+        throwex("Source: unknown compression format");
+    }
+
+    m_indexLoaded = load_index(st);
+    if (!m_indexLoaded) {
+        m_points.assign(1, SeekPoint());
+        m_size = m_decoder->scan(m_points);
+        save_index(st);
+    }
+
+    restart(m_points.front());
+}
+
+size_t CompressedSource::seek_points() const
+{
+    return m_points.size();
+}
+
+void CompressedSource::restart(const SeekPoint& point)
+{
+    m_decoder->start(point);
+    m_base = point.out;
+    m_filled = 0;
+}
+
+const char* CompressedSource::load(size_t pos, size_t& len)
+{
+    if (pos >= m_size) {
+        len = 0;
+        return nullptr;
+    }
+
+    len = std::min(len, m_size - pos);
+    const size_t end = pos + len;
+    if (pos >= m_base && end <= m_base + m_filled) return m_window.data() + (pos - m_base);
+
+    // Restart at the nearest seek point unless the data is not far ahead
+    auto next = std::upper_bound(m_points.begin(), m_points.end(), pos,
+                                 [](size_t value, const SeekPoint& point) { return value < point.out; });
+    const SeekPoint& point = *(next - 1);
+    if (pos < m_base || point.out > m_base + m_filled) restart(point);
+
+    while (m_base + m_filled < end) {
+        // Keep some data before "pos" for short steps back
+        const size_t keep = pos > m_opts.retention ? pos - m_opts.retention : 0;
+        if (keep > m_base) {
+            const size_t drop = std::min(keep - m_base, m_filled);
+            memmove(m_window.data(), m_window.data() + drop, m_filled - drop);
+            m_filled -= drop;
+            m_base += drop;
+        }
+
+        if (m_window.size() < m_filled + Chunk) m_window.resize(m_filled + Chunk);
+        const size_t n = m_decoder->decode(m_window.data() + m_filled, Chunk);
+        if (n == 0) throwex("Source: compressed data ends early");
+        m_filled += n;
+        stats().bytesRead += n;
+    }
+
+    return m_window.data() + (pos - m_base);
+}
+
+/**********************************************************************
+ */
+std::shared_ptr<Source> Source::inflate(size_t pos, size_t len, bool raw, size_t maxSize)
+{
+    constexpr size_t InputChunk = 64 * 1024;
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, raw ? -MAX_WBITS : MAX_WBITS + 32) != Z_OK) throwex("Source: failed to initialize zlib");
+    std::unique_ptr<z_stream, int (*)(z_streamp)> guard(&strm, inflateEnd);
+
+    // Compressed data usually grows a few times
+    BufferPtr buffer = acquire_buffer(std::min(std::max<size_t>(len * 4, 4096), maxSize));
+    size_t out = 0;
+    size_t in = pos;
+    const size_t end = pos + len;
+    int ret = Z_OK;
+    while (ret != Z_STREAM_END) {
+        if (strm.avail_in == 0) {
+            if (in == end) throwex("Source: compressed data is truncated");
+            size_t n = std::min(InputChunk, end - in);
+            const char* p = fetch(in, n);
+            if (n == 0) throwex("Insufficent data in source");
+            strm.next_in = reinterpret_cast<unsigned char*>(const_cast<char*>(p));
+            strm.avail_in = n;
+            in += n;
+        }
+
+        if (out == buffer->size) {
+            if (out >= maxSize) throwex("Source: inflated data is too big");
+            buffer->resize(std::min(out * 2, maxSize));
+        }
+        strm.next_out = reinterpret_cast<unsigned char*>(buffer->data.get() + out);
+        strm.avail_out = std::min<size_t>(buffer->size - out, UINT_MAX);
+
+        ret = ::inflate(&strm, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) throwex("Source: invalid compressed data");
+        out = reinterpret_cast<char*>(strm.next_out) - buffer->data.get();
+    }
+
+    return make_buffer_source(m_name.c_str(), std::move(buffer), out);
+}
+
+/**********************************************************************
+ *   Sidecar with the seek points: a header, then for each point its
+ *   offsets, bits and history.
+ */
+struct IndexHeader
+{
+    char magic[8];
+    uint32_t format;
+    uint32_t span;
+    uint64_t fileSize;
+    uint64_t inode;
+    uint64_t mtimeSec;
+    uint64_t mtimeNsec;
+    uint64_t size;
+    uint64_t count;
+};
+
+static IndexHeader make_index_header(const struct stat& st, int format)
+{
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IndexMagic, sizeof(IndexMagic));
+    header.format = format;
+    header.span = IndexSpan;
+    header.fileSize = st.st_size;
+    header.inode = st.st_ino;
+    header.mtimeSec = st.st_mtim.tv_sec;
+    header.mtimeNsec = st.st_mtim.tv_nsec;
+    return header;
+}
+
+// Cache for seek indexes without --index-dir: $XDG_CACHE_HOME/brie or
+// ~/.cache/brie, created when "create" is set. Empty if there is no
+// home directory.
+static std::string cache_dir(bool create)
+{
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    std::string parent;
+    if (xdg != nullptr && xdg[0] == '/') parent = xdg;
+    else if (home != nullptr && home[0] != 0) parent = std::string(home) + "/.cache";
+    else return std::string();
+
+    const std::string dir = parent + "/brie";
+    if (create) {
+        mkdir(parent.c_str(), 0700);
+        mkdir(dir.c_str(), 0700);
+    }
+    return dir;
+}
+
+// The index of /data/a.gz lives at <indexDir>/%data%a.gz.brix, so
+// inputs from read-only or shared directories are never written to.
+// Without an index directory it goes to the user's cache, so only
+// the first open of a file decompresses all of it.
+std::string CompressedSource::index_path(bool create) const
+{
+    const std::string dir = m_opts.indexDir.empty() ? cache_dir(create) : m_opts.indexDir;
+    if (dir.empty()) return std::string();
+    return sidecar_path(m_name, IndexSuffix, dir);
+}
+
+bool CompressedSource::load_index(const struct stat& st)
+{
+    const std::string path = index_path(false);
+    if (path.empty()) return false;
+
+    FILE* f = fopen(path.c_str(), "rb");
+    if (f == nullptr) return false;
+
+    IndexHeader expected = make_index_header(st, m_format);
+    IndexHeader header;
+    bool valid = fread(&header, sizeof(header), 1, f) == 1;
+    valid = valid && memcmp(&header, &expected, offsetof(IndexHeader, size)) == 0 && header.count > 0;
+
+    std::vector<SeekPoint> points(valid ? header.count : 0);
+    for (SeekPoint& point: points) {
+        uint32_t historyLen = 0;
+        valid = fread(&point.out, sizeof(point.out), 1, f) == 1 && fread(&point.in, sizeof(point.in), 1, f) == 1
+            && fread(&point.bits, sizeof(point.bits), 1, f) == 1 && fread(&historyLen, sizeof(historyLen), 1, f) == 1
+            && (historyLen == 0 || historyLen == HistorySize) && point.in <= m_dataSize;
+        if (!valid) break;
+
+        point.history.resize(historyLen);
+        if (historyLen != 0 && fread(point.history.data(), historyLen, 1, f) != 1) {
+            valid = false;
+            break;
+        }
+    }
+    fclose(f);
+
+    if (!valid) {
+        LOG_DEBUG << "Ignore invalid index " << path;
+        return false;
+    }
+
+    m_points = std::move(points);
+    m_size = header.size;
+    return true;
+}
+
+void CompressedSource::save_index(const struct stat& st) const
+{
+    const std::string path = index_path(true);
+    if (path.empty()) return;
+
+    const std::string tmpPath = path + "." + std::to_string(getpid());
+    FILE* f = fopen(tmpPath.c_str(), "wb");
+    if (f == nullptr) {
+        LOG_DEBUG << "Failed to create index " << path;
+        return;
+    }
+
+    IndexHeader header = make_index_header(st, m_format);
+    header.size = m_size;
+    header.count = m_points.size();
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+    for (const SeekPoint& point: m_points) {
+        const uint32_t historyLen = point.history.size();
+        ok = ok && fwrite(&point.out, sizeof(point.out), 1, f) == 1 && fwrite(&point.in, sizeof(point.in), 1, f) == 1
+            && fwrite(&point.bits, sizeof(point.bits), 1, f) == 1 && fwrite(&historyLen, sizeof(historyLen), 1, f) == 1
+            && (historyLen == 0 || fwrite(point.history.data(), historyLen, 1, f) == 1);
+    }
+
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+        LOG_DEBUG << "Failed to write index " << path;
+        unlink(tmpPath.c_str());
+    }
+}
+
+} // namespace brie
@@ -0,0 +1,274 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "source.h"
+#include "error.h"
+#include "stats.h"
+#include "utils/log.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace brie {
+
+/**********************************************************************
+ *   Background reader. Two aligned blocks circulate between the reader
+ *   thread and the source: one is read from the file while the other
+ *   one is copied into the window.
+ */
+struct DirectSource::Reader
+{
+    static constexpr size_t BlockCount = 2;
+
+    struct Block
+    {
+        char* data = nullptr;
+        size_t offset = 0;
+        size_t len = 0;
+    };
+
+    Reader(int fd, bool direct, size_t block, size_t offset, size_t end);
+    ~Reader();
+
+    bool take(Block& block);
+    void give(Block& block);
+    void run();
+
+    int fd;
+    bool direct;
+    size_t blockSize;
+    size_t offset;  // Offset of the next block to read
+    size_t end;     // Reading stops at this offset
+    std::vector<char*> memory;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<Block> ready;
+    std::vector<char*> spare;
+    bool eof = false;
+    int error = 0;
+    bool stop = false;
+    std::thread thread;
+};
+
+DirectSource::Reader::Reader(int fd_, bool direct_, size_t block, size_t offset_, size_t end_)
+  : fd(fd_), direct(direct_), blockSize(block), offset(offset_), end(end_)
+{
+    for (size_t i = 0; i < BlockCount; i++) {
+        void* ptr = nullptr;
+        if (posix_memalign(&ptr, Align, blockSize) != 0) {
+            for (char* p: memory) free(p);
+            throwex("Source: failed to allocate direct read buffer");
+        }
+        memory.push_back(static_cast<char*>(ptr));
+        spare.push_back(memory.back());
+    }
+
+    thread = std::thread(&Reader::run, this);
+}
+
+DirectSource::Reader::~Reader()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cond.notify_all();
+    thread.join();
+
+    for (char* p: memory) free(p);
+}
+
+// Wait for the next block. Returns false at the end of data.
+bool DirectSource::Reader::take(Block& block)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this] { return !ready.empty() || eof; });
+    if (ready.empty()) {
+        if (error != 0) throwex(std::string("Source: direct read failed: ") + strerror(error));
+        return false;
+    }
+
+    block = ready.front();
+    ready.pop_front();
+    return true;
+}
+
+// Return the buffer of a consumed block for reading the next one
+void DirectSource::Reader::give(Block& block)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    spare.push_back(block.data);
+    block = Block();
+    cond.notify_all();
+}
+
+void DirectSource::Reader::run()
+{
+    while (true) {
+        Block block;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this] { return !spare.empty() || stop; });
+            if (stop) return;
+            block.data = spare.back();
+            spare.pop_back();
+        }
+
+        block.offset = offset;
+        ssize_t n = 0;
+        if (offset < end) {
+            do {
+                n = pread(fd, block.data, blockSize, offset);
+            } while (n < 0 && errno == EINTR);
+        }
+
+        if (n > 0) {
+            block.len = n;
+            offset += n;
+            stats().bytesDirect += n;
+
+            // Without O_DIRECT the block is dropped from the cache right away
+            if (!direct) posix_fadvise(fd, block.offset, n, POSIX_FADV_DONTNEED);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (n <= 0) {
+            if (n < 0) error = errno;
+            spare.push_back(block.data);
+            eof = true;
+            cond.notify_all();
+            return;
+        }
+
+        ready.push_back(block);
+        cond.notify_all();
+
+        // A short block is the end of the file
+        if ((size_t)n < blockSize) {
+            eof = true;
+            return;
+        }
+    }
+}
+
+/**********************************************************************
+ */
+DirectSource::DirectSource(const char* name)
+  : Source(name), m_fd(-1), m_direct(false), m_block(0), m_base(0), m_filled(0), m_eof(false)
+{
+
+}
+
+DirectSource::~DirectSource()
+{
+    m_reader.reset();
+
+    if (m_fd != -1) {
+        close(m_fd);
+    }
+}
+
+void DirectSource::init(const char* cfg)
+{
+    m_fd = open(cfg, O_RDONLY | O_DIRECT);
+    m_direct = m_fd >= 0;
+    if (m_fd < 0 && errno == EINVAL) {
+        LOG_DEBUG << "O_DIRECT is not supported for " << cfg;
+        m_fd = open(cfg, O_RDONLY);
+    }
+    if (m_fd < 0) throwex("Source: failed to open file");
+
+    struct stat sb;
+    if (fstat(m_fd, &sb) < 0) throwex("Source: failed stat file");
+    m_size = sb.st_size;
+
+    m_block = (m_opts.direct + Align - 1) / Align * Align;
+    m_window.resize(2 * m_block);
+
+    if (!m_direct) posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    restart(0);
+}
+
+// Start reading blocks from the aligned "offset" with an empty window
+void DirectSource::restart(size_t offset)
+{
+    m_reader.reset();
+
+    m_base = offset;
+    m_filled = 0;
+    m_eof = false;
+    m_reader = std::make_unique<Reader>(m_fd, m_direct, m_block, offset, data_end());
+}
+
+const char* DirectSource::load(size_t pos, size_t& len)
+{
+    if (pos > m_size) {
+        len = 0;
+        return nullptr;
+    }
+
+    // Going backward or far forward starts reading at the new position
+    if (pos < m_base || pos > m_base + m_filled + m_block) {
+        restart(pos / Align * Align);
+    }
+
+    Reader::Block block;
+    while (!m_eof && m_base + m_filled < pos + len) {
+        // Drop the data before the block of the requested position
+        const size_t from = pos / Align * Align;
+        if (from > m_base) {
+            const size_t drop = std::min(from - m_base, m_filled);
+            memmove(m_window.data(), m_window.data() + drop, m_filled - drop);
+            m_filled -= drop;
+            m_base += drop;
+        }
+
+        if (!m_reader->take(block)) {
+            m_eof = true;
+            break;
+        }
+
+        if (m_filled + block.len > m_window.size()) {
+            m_window.resize(std::max(m_window.size() * 2, m_filled + block.len));
+        }
+        memcpy(m_window.data() + m_filled, block.data, block.len);
+        m_filled += block.len;
+        m_reader->give(block);
+    }
+
+    const size_t end = m_base + m_filled;
+    if (pos > end) {
+        len = 0;
+        return nullptr;
+    }
+
+    len = std::min(len, end - pos);
+    return m_window.data() + (pos - m_base);
+}
+
+} // namespace brie
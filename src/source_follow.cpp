@@ -0,0 +1,165 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "source.h"
+#include "error.h"
+#include "stats.h"
+#include "utils/log.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace brie {
+
+static std::atomic<bool> followStopped{false};
+
+void stop_following(bool stop)
+{
+    followStopped = stop;
+}
+
+bool following_stopped()
+{
+    return followStopped;
+}
+
+/**********************************************************************
+ *   Waits for changes of a followed file. Uses inotify and falls back
+ *   to polling with a growing interval when inotify is not available.
+ */
+struct FileSource::Watcher
+{
+    // Upper bound of a single wait, so stop_following() is noticed
+    static constexpr int MaxWaitMs = 100;
+    static constexpr unsigned MinPollUs = 1000;
+
+    Watcher(const std::string& path);
+    ~Watcher();
+
+    void wait();
+    void reset() { pollUs = MinPollUs; }
+
+    int fd = -1;
+    unsigned pollUs = MinPollUs;
+};
+
+FileSource::Watcher::Watcher(const std::string& path)
+{
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) return;
+
+    if (inotify_add_watch(fd, path.c_str(), IN_MODIFY | IN_ATTRIB) < 0) {
+        LOG_DEBUG << "inotify is not available for " << path << ": " << strerror(errno);
+        close(fd);
+        fd = -1;
+    }
+}
+
+FileSource::Watcher::~Watcher()
+{
+    if (fd != -1) close(fd);
+}
+
+void FileSource::Watcher::wait()
+{
+    if (fd < 0) {
+        usleep(pollUs);
+        pollUs = std::min<unsigned>(pollUs * 2, MaxWaitMs * 1000);
+        return;
+    }
+
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, MaxWaitMs) <= 0) return;
+
+    // Only the wakeup matters, the events are dropped
+    char buf[4096];
+    while (read(fd, buf, sizeof(buf)) > 0) {}
+}
+
+/**********************************************************************
+ *   The watcher is complete only here, so FileSource is created and
+ *   destroyed in this file.
+ */
+FileSource::FileSource(const char* name)
+  : MmapBase(name)
+{
+
+}
+
+FileSource::~FileSource()
+{
+}
+
+bool FileSource::grow(size_t end)
+{
+    if (!m_opts.follow) return false;
+    if (m_opts.limit != 0 && end > m_opts.limit) return false;
+
+    if (!m_watcher) m_watcher = std::make_unique<Watcher>(m_name);
+
+    while (!followStopped) {
+        struct stat sb;
+        if (fstat(m_fd, &sb) < 0) throwex("Source: failed stat file");
+
+        const size_t size = sb.st_size;
+        if (size < m_size) throwex("Source: followed file was truncated");
+
+        if (size > m_size) {
+            extend(size);
+            m_watcher->reset();
+            if (size >= end) return true;
+        }
+
+        m_watcher->wait();
+    }
+
+    return false;
+}
+
+// Take the new size of the file. A whole file mapping is extended in
+// place when possible; a window is moved by load() as usual.
+void MmapBase::extend(size_t size)
+{
+    m_size = size;
+
+    size_t mapLen = data_end();
+    if (m_ptr == nullptr) {
+        if (m_opts.window != 0) mapLen = std::min(mapLen, m_opts.window);
+        if (mapLen != 0) map(0, mapLen);
+        return;
+    }
+
+    if (m_opts.window != 0 || mapLen <= m_mapLen) return;
+
+    void* ptr = mremap((void*)m_ptr, m_mapLen, mapLen, MREMAP_MAYMOVE);
+    if (ptr == MAP_FAILED) throwex("Source: failed to extend the mapping");
+
+    stats().bytesMapped += mapLen - m_mapLen;
+    m_ptr = static_cast<const char*>(ptr);
+    m_mapLen = mapLen;
+    advise();
+}
+
+} // namespace brie
@@ -0,0 +1,143 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "source.h"
+#include "error.h"
+#include "stats.h"
+#include "utils/log.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+namespace brie {
+
+// Pages read together with a missing one
+static constexpr size_t ProcessReadahead = 16 * 1024;
+
+/**********************************************************************
+ */
+ProcessSource::ProcessSource(const char* name)
+  : CachedSource(name), m_pid(0), m_base(0)
+{
+
+}
+
+void ProcessSource::read_maps()
+{
+    const std::string path = "/proc/" + std::to_string(m_pid) + "/maps";
+    FILE* f = fopen(path.c_str(), "r");
+    if (f == nullptr) throwex("Source: failed to read the mappings of process " + std::to_string(m_pid));
+
+    char line[4096];
+    while (fgets(line, sizeof(line), f) != nullptr) {
+        Mapping m;
+        char perms[8];
+        int name = 0;
+        if (sscanf(line, "%lx-%lx %7s %*s %*s %*s %n", &m.start, &m.end, perms, &name) < 3) continue;
+
+        // Mappings without read access fail process_vm_readv() anyway
+        if (perms[0] != 'r') continue;
+
+        if (name > 0) {
+            m.path = line + name;
+            while (!m.path.empty() && (m.path.back() == '\n' || m.path.back() == ' ')) m.path.pop_back();
+        }
+        m_maps.push_back(m);
+    }
+
+    fclose(f);
+    if (m_maps.empty()) throwex("Source: no readable mappings in process " + std::to_string(m_pid));
+}
+
+// End of the readable memory starting at "addr" or "addr" if it is not mapped
+size_t ProcessSource::mapped_end(size_t addr) const
+{
+    size_t end = addr;
+    for (const Mapping& m: m_maps) {
+        if (m.start <= end && end < m.end) end = m.end;
+    }
+    return end;
+}
+
+void ProcessSource::init(const char* cfg)
+{
+    char* end = nullptr;
+    const long pid = strtol(cfg, &end, 10);
+    if (end == cfg || pid <= 0 || (*end != '\0' && *end != ':')) throwex("Source: invalid pid config");
+    m_pid = pid;
+
+    read_maps();
+
+    if (*end == '\0') {
+        // Positions are the virtual addresses
+        m_base = 0;
+        m_size = m_maps.back().end;
+    } else {
+        const char* region = end + 1;
+        size_t addr = 0;
+        size_t len = 0;
+        if (sscanf(region, "%li:%li", &addr, &len) == 2) {
+            m_base = addr;
+            m_size = len;
+        } else {
+            // All mappings of a file or a special region, e.g. [heap]
+            const size_t nameLen = strlen(region);
+            for (const Mapping& m: m_maps) {
+                const bool match = m.path.size() >= nameLen
+                    && m.path.compare(m.path.size() - nameLen, nameLen, region) == 0;
+                if (!match) continue;
+
+                if (m_size == 0) m_base = m.start;
+                m_size = m.end - m_base;
+            }
+            if (m_size == 0) throwex(std::string("Source: mapping is not found: ") + region);
+        }
+    }
+
+    init_cache(4096, ProcessReadahead);
+}
+
+size_t ProcessSource::read_pages(size_t offset, const iovec* iov, size_t count)
+{
+    const size_t addr = m_base + offset;
+
+    // Readahead stops at the end of the mapped memory
+    size_t want = 0;
+    for (size_t i = 0; i < count; i++) want += iov[i].iov_len;
+    want = std::min(want, mapped_end(addr) - addr);
+    if (want == 0) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "Source: address 0x%lx is not mapped", addr);
+        throwex(msg);
+    }
+
+    iovec remote = { (void*)addr, want };
+    ssize_t n = process_vm_readv(m_pid, iov, count, &remote, 1, 0);
+    if (n < 0) {
+        throwex(std::string("Source: failed to read process memory: ") + strerror(errno));
+    }
+
+    stats().bytesRead += n;
+    return n;
+}
+
+} // namespace brie
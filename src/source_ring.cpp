@@ -0,0 +1,259 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "source.h"
+#include "error.h"
+#include "utils/log.h"
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace brie {
+
+// Polling of an empty ring: spin first for the lowest latency, then
+// yield the CPU and finally sleep with a growing interval.
+static constexpr unsigned SpinCount = 1000;
+static constexpr unsigned YieldCount = 100;
+static constexpr unsigned MaxSleepUs = 1000;
+
+static void backoff(unsigned& round, unsigned& sleepUs)
+{
+    round++;
+    if (round < SpinCount) return;
+
+    if (round < SpinCount + YieldCount) {
+        std::this_thread::yield();
+        return;
+    }
+
+    usleep(sleepUs);
+    sleepUs = std::min(sleepUs * 2, MaxSleepUs);
+}
+
+static bool parse_layout_value(const std::string& item, const char* key, size_t& value)
+{
+    const size_t keyLen = strlen(key);
+    if (item.compare(0, keyLen, key) != 0 || item.size() <= keyLen || item[keyLen] != '=') {
+        return false;
+    }
+
+    char* end = nullptr;
+    value = strtoull(item.c_str() + keyLen + 1, &end, 0);
+    if (*end != '\0') throwex("Source: invalid ring layout value " + item);
+    return true;
+}
+
+/**********************************************************************
+ */
+RingSource::RingSource(const char* name)
+  : Source(name), m_base(nullptr), m_segSize(0), m_shmid(-1),
+    m_headOffset(SIZE_MAX), m_tailOffset(SIZE_MAX), m_dataOffset(SIZE_MAX),
+    m_capacity(0), m_record(0), m_prefix(0), m_counter(8), m_cursor(0), m_lost(0)
+{
+
+}
+
+RingSource::~RingSource()
+{
+    if (m_base == nullptr) return;
+
+    if (m_shmid != -1) {
+        shmdt(m_base);
+    } else {
+        munmap((void*)m_base, m_segSize);
+    }
+}
+
+void RingSource::attach(const std::string& segment)
+{
+    const bool sysv = !segment.empty() && segment.find_first_not_of("0123456789") == std::string::npos;
+    if (sysv) {
+        m_shmid = atoi(segment.c_str());
+
+        shmid_ds ds;
+        if (shmctl(m_shmid, IPC_STAT, &ds) < 0) throwex("Source: invalid sysvshmem id");
+        m_segSize = ds.shm_segsz;
+
+        void* ptr = shmat(m_shmid, nullptr, SHM_RDONLY);
+        if (ptr == (void*)-1) throwex("Source: failed to attach sysvshmem");
+        m_base = static_cast<const char*>(ptr);
+        return;
+    }
+
+    int fd = open(segment.c_str(), O_RDONLY);
+    if (fd < 0) fd = shm_open(segment.c_str(), O_RDONLY, 0);
+    if (fd < 0) throwex("Source: failed to open ring segment " + segment);
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || sb.st_size == 0) {
+        close(fd);
+        throwex("Source: invalid ring segment " + segment);
+    }
+    m_segSize = sb.st_size;
+
+    // The segment is shared to see the producer updates
+    void* ptr = mmap(nullptr, m_segSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) throwex("Source: failed map");
+    m_base = static_cast<const char*>(ptr);
+}
+
+void RingSource::init(const char* cfg)
+{
+    std::vector<std::string> items;
+    const char* s = cfg;
+    while (true) {
+        const char* comma = strchr(s, ',');
+        items.emplace_back(s, comma ? comma - s : strlen(s));
+        if (comma == nullptr) break;
+        s = comma + 1;
+    }
+
+    for (size_t i = 1; i < items.size(); i++) {
+        const std::string& item = items[i];
+        if (parse_layout_value(item, "head", m_headOffset)) continue;
+        if (parse_layout_value(item, "tail", m_tailOffset)) continue;
+        if (parse_layout_value(item, "data", m_dataOffset)) continue;
+        if (parse_layout_value(item, "capacity", m_capacity)) continue;
+        if (parse_layout_value(item, "record", m_record)) continue;
+        if (parse_layout_value(item, "prefix", m_prefix)) continue;
+        if (parse_layout_value(item, "counter", m_counter)) continue;
+        throwex("Source: unknown ring layout item " + item);
+    }
+
+    if (m_tailOffset == SIZE_MAX || m_dataOffset == SIZE_MAX) {
+        throwex("Source: ring layout requires tail and data offsets");
+    }
+    if ((m_record == 0) == (m_prefix == 0)) {
+        throwex("Source: ring layout requires either record or prefix size");
+    }
+    if (m_prefix != 0 && m_prefix != 1 && m_prefix != 2 && m_prefix != 4 && m_prefix != 8) {
+        throwex("Source: invalid ring length prefix size");
+    }
+    if (m_counter != 4 && m_counter != 8) throwex("Source: invalid ring counter size");
+
+    attach(items[0]);
+
+    if (m_capacity == 0 && m_dataOffset < m_segSize) m_capacity = m_segSize - m_dataOffset;
+    if (m_capacity == 0 || m_dataOffset + m_capacity > m_segSize
+        || m_tailOffset + m_counter > m_segSize
+        || (m_headOffset != SIZE_MAX && m_headOffset + m_counter > m_segSize)) {
+        throwex("Source: ring layout does not fit the segment");
+    }
+
+    // A 4 byte counter wraps at 2^32, which keeps "counter % capacity"
+    // continuous only if the capacity divides it
+    if (m_counter == 4 && (m_capacity & (m_capacity - 1)) != 0) {
+        throwex("Source: ring capacity must be a power of two with 4 byte counters");
+    }
+
+    m_cursor = counter(m_headOffset != SIZE_MAX ? m_headOffset : m_tailOffset);
+    m_ptr = nullptr;
+    m_size = 0;
+}
+
+uint64_t RingSource::counter(size_t offset) const
+{
+    if (m_counter == 4) {
+        return __atomic_load_n(reinterpret_cast<const uint32_t*>(m_base + offset), __ATOMIC_ACQUIRE);
+    }
+    return __atomic_load_n(reinterpret_cast<const uint64_t*>(m_base + offset), __ATOMIC_ACQUIRE);
+}
+
+// Bytes between the cursor and the counter value "tail"
+uint64_t RingSource::distance(uint64_t tail) const
+{
+    if (m_counter == 4) return static_cast<uint32_t>(tail - m_cursor);
+    return tail - m_cursor;
+}
+
+// Copy "len" bytes starting at the counter value "from" across the
+// end of the ring.
+void RingSource::copy(uint64_t from, size_t len, char* to) const
+{
+    const char* data = m_base + m_dataOffset;
+    const size_t offset = from % m_capacity;
+    const size_t first = std::min(len, m_capacity - offset);
+
+    memcpy(to, data + offset, first);
+    if (first < len) memcpy(to + first, data, len - first);
+}
+
+bool RingSource::next()
+{
+    unsigned round = 0;
+    unsigned sleepUs = 1;
+
+    while (!following_stopped()) {
+        const uint64_t tail = counter(m_tailOffset);
+
+        // The producer has overwritten records that were not read yet
+        if (distance(tail) > m_capacity) {
+            LOG_ERROR << "Ring overrun in " << m_name << ": " << distance(tail) << " bytes skipped";
+            m_lost += distance(tail);
+            m_cursor = tail;
+        }
+
+        const size_t avail = distance(tail);
+        size_t len = m_record;
+        size_t header = 0;
+
+        if (m_prefix != 0 && avail >= m_prefix) {
+            uint64_t value = 0;
+            copy(m_cursor, m_prefix, reinterpret_cast<char*>(&value));
+            len = value;
+            header = m_prefix;
+
+            if (header + len > m_capacity) {
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (distance(counter(m_tailOffset)) > m_capacity) continue;
+                throwex("Source: invalid ring record length");
+            }
+        }
+
+        if ((header != 0 || m_prefix == 0) && avail >= header + len) {
+            if (m_buffer.size() < len) m_buffer.resize(len);
+            copy(m_cursor + header, len, m_buffer.data());
+
+            // The record is valid if the producer did not reach it while
+            // copying. The fence keeps the plain reads of the copy from
+            // moving after the load of the tail.
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (distance(counter(m_tailOffset)) > m_capacity) continue;
+
+            m_cursor += header + len;
+            if (m_counter == 4) m_cursor &= UINT32_MAX;
+            m_ptr = m_buffer.data();
+            m_size = len;
+            m_pos = 0;
+            return true;
+        }
+
+        backoff(round, sleepUs);
+    }
+
+    return false;
+}
+
+} // namespace brie
@@ -0,0 +1,296 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "source.h"
+#include "error.h"
+#include "utils/log.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+namespace brie {
+
+/**********************************************************************
+ *   Background reader. Two chunk buffers circulate between the reader
+ *   thread and the source: one is filled from the descriptor while
+ *   the other one is consumed.
+ */
+struct StreamSource::Reader
+{
+    static constexpr size_t ChunkSize = 64 * 1024;
+    static constexpr size_t ChunkCount = 2;
+
+    Reader(int fd);
+    ~Reader();
+
+    bool take(std::vector<char>& chunk);
+    void run();
+
+    int fd;
+    int wake[2] = { -1, -1 };
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<std::vector<char>> ready;
+    std::vector<std::vector<char>> spare;
+    bool eof = false;
+    bool stop = false;
+    std::thread thread;
+};
+
+StreamSource::Reader::Reader(int fd_)
+  : fd(fd_)
+{
+    if (pipe(wake) != 0) throwex("Source: failed to create stream reader");
+
+    for (size_t i = 0; i < ChunkCount; i++) {
+        spare.emplace_back();
+        spare.back().reserve(ChunkSize);
+    }
+
+    thread = std::thread(&Reader::run, this);
+}
+
+StreamSource::Reader::~Reader()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cond.notify_all();
+
+    char c = 0;
+    ssize_t n = write(wake[1], &c, 1);
+    (void)n;
+
+    thread.join();
+    close(wake[0]);
+    close(wake[1]);
+}
+
+// Return storage of the previous chunk and wait for the next one.
+// Returns false at the end of data.
+bool StreamSource::Reader::take(std::vector<char>& chunk)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    if (chunk.capacity() != 0) {
+        chunk.clear();
+        spare.push_back(std::move(chunk));
+        chunk = std::vector<char>();
+        cond.notify_all();
+    }
+
+    cond.wait(lock, [this] { return !ready.empty() || eof; });
+    if (ready.empty()) return false;
+
+    chunk = std::move(ready.front());
+    ready.pop_front();
+    return true;
+}
+
+void StreamSource::Reader::run()
+{
+    while (true) {
+        std::vector<char> chunk;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this] { return !spare.empty() || stop; });
+            if (stop) return;
+            chunk = std::move(spare.back());
+            spare.pop_back();
+        }
+
+        struct pollfd fds[2] = { { fd, POLLIN, 0 }, { wake[0], POLLIN, 0 } };
+        int ret = poll(fds, 2, -1);
+        if (ret < 0 && errno == EINTR) {
+            std::lock_guard<std::mutex> lock(mutex);
+            spare.push_back(std::move(chunk));
+            continue;
+        }
+        if (ret > 0 && (fds[1].revents & POLLIN)) return;
+
+        chunk.resize(ChunkSize);
+        ssize_t n = ret < 0 ? -1 : ::read(fd, chunk.data(), chunk.size());
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+            chunk.clear();
+            std::lock_guard<std::mutex> lock(mutex);
+            spare.push_back(std::move(chunk));
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (n <= 0) {
+            if (n < 0) {
+                LOG_ERROR << "Stream read failed: " << strerror(errno);
+            }
+            eof = true;
+            cond.notify_all();
+            return;
+        }
+
+        chunk.resize(n);
+        ready.push_back(std::move(chunk));
+        cond.notify_all();
+    }
+}
+
+/**********************************************************************
+ */
+StreamSource::StreamSource(const char* name)
+  : Source(name), m_fd(-1), m_base(0), m_filled(0), m_eof(false)
+{
+
+}
+
+StreamSource::~StreamSource()
+{
+    m_reader.reset();
+
+    if (m_fd != -1) {
+        close(m_fd);
+    }
+}
+
+void StreamSource::init(const char* cfg)
+{
+    m_fd = open(cfg, O_RDONLY);
+    if (m_fd < 0) throwex("Source: failed to open stream");
+
+    m_window.resize(2 * Reader::ChunkSize);
+    m_reader = std::make_unique<Reader>(m_fd);
+}
+
+bool StreamSource::pull(std::vector<char>& chunk)
+{
+    if (m_eof) return false;
+    if (!m_reader->take(chunk)) m_eof = true;
+    return !m_eof;
+}
+
+// Drop the data before the stream offset "from"
+void StreamSource::drop(size_t from)
+{
+    if (from <= m_base) return;
+
+    const size_t count = std::min(from - m_base, m_filled);
+    memmove(m_window.data(), m_window.data() + count, m_filled - count);
+    m_filled -= count;
+    m_base += count;
+}
+
+void StreamSource::append(const char* data, size_t len, size_t keep, size_t need)
+{
+    if (m_filled + len > m_window.size()) {
+        const size_t retention = m_opts.retention;
+
+        // Drop data that is older than the retention allows
+        drop(keep > retention ? keep - retention : 0);
+
+        // Reads far ahead of the position, e.g. by find(), would keep
+        // everything in between: past the limit only the retention
+        // before the data being loaded is kept, but never the data at
+        // "keep", which the next read at the position needs
+        const size_t limit = 4 * std::max(retention, Reader::ChunkSize);
+        if (m_filled + len > limit) drop(std::min(keep, need > retention ? need - retention : 0));
+
+        // Keep at least half of the window free to make moves rare, but
+        // grow past the limit only for the data being loaded
+        if (m_filled + len > m_window.size() / 2) {
+            const size_t wanted = std::max(m_window.size(), m_filled + len) * 2;
+            m_window.resize(std::max(std::min(wanted, limit), m_filled + len));
+        }
+    }
+
+    memcpy(m_window.data() + m_filled, data, len);
+    m_filled += len;
+    m_size = m_base + m_filled;
+}
+
+const char* StreamSource::load(size_t pos, size_t& len)
+{
+    if (pos < m_base) throwex("Position is behind the stream retention window");
+
+    const size_t keep = std::min(pos, m_pos);
+    while (pos > m_base + m_filled || m_base + m_filled - pos < len) {
+        if (!pull(m_chunk)) break;
+        append(m_chunk.data(), m_chunk.size(), keep, pos);
+    }
+
+    const size_t end = m_base + m_filled;
+    if (pos > end) {
+        len = 0;
+        return nullptr;
+    }
+
+    len = std::min(len, end - pos);
+    return m_window.data() + (pos - m_base);
+}
+
+bool StreamSource::grow(size_t end)
+{
+    while (m_base + m_filled < end) {
+        if (!pull(m_chunk)) return false;
+        append(m_chunk.data(), m_chunk.size(), m_pos, m_pos);
+    }
+    return true;
+}
+
+void StreamSource::set_pos(size_t value)
+{
+    if (value < m_base) throwex("Position is behind the stream retention window");
+
+    if (value <= m_base + m_filled) {
+        m_pos = value;
+        return;
+    }
+
+    // Skip forward without buffering the skipped input. The window is
+    // replaced only once the stream reaches "value", so a position past
+    // the end fails with the current position still readable.
+    size_t end = m_base + m_filled;
+    while (pull(m_chunk)) {
+        if (end + m_chunk.size() <= value) {
+            end += m_chunk.size();
+            continue;
+        }
+
+        const size_t skip = value - end;
+        m_filled = 0;
+        m_base = value;
+        append(m_chunk.data() + skip, m_chunk.size() - skip, value, value);
+        m_pos = value;
+        return;
+    }
+
+    if (value != end) throwex("Position outside of data space");
+
+    m_filled = 0;
+    m_base = end;
+    m_size = end;
+    m_pos = value;
+}
+
+} // namespace brie
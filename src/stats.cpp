@@ -0,0 +1,98 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stats.h"
+
+#include <cstring>
+
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <time.h>
+
+namespace brie {
+
+static struct rusage startUsage;
+static struct timespec startTime;
+static long startCached;
+
+// Size of the page cache in KB or -1 if it is not known
+static long page_cache_kb()
+{
+    FILE* f = fopen("/proc/meminfo", "r");
+    if (f == nullptr) return -1;
+
+    long value = -1;
+    char line[256];
+    while (fgets(line, sizeof(line), f) != nullptr) {
+        if (strncmp(line, "Cached:", 7) == 0) {
+            value = strtol(line + 7, nullptr, 10);
+            break;
+        }
+    }
+
+    fclose(f);
+    return value;
+}
+
+static double mb_per_sec(size_t bytes, double elapsed)
+{
+    return elapsed > 0 ? bytes / elapsed / (1024 * 1024) : 0;
+}
+
+Stats& stats()
+{
+    static Stats counters;
+    return counters;
+}
+
+void start_stats()
+{
+    getrusage(RUSAGE_SELF, &startUsage);
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    startCached = page_cache_kb();
+}
+
+void print_stats(FILE* f)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - startTime.tv_sec) + (now.tv_nsec - startTime.tv_nsec) / 1e9;
+
+    const Stats& s = stats();
+    fprintf(f, "Sources:      %lu\n", s.sources.load());
+    if (s.replayed != 0) fprintf(f, "Replayed:     %lu\n", s.replayed.load());
+    if (s.filtered != 0) fprintf(f, "Filtered:     %lu\n", s.filtered.load());
+    fprintf(f, "Bytes mapped: %lu (%.1f MB/s)\n", s.bytesMapped.load(), mb_per_sec(s.bytesMapped, elapsed));
+    fprintf(f, "Bytes read:   %lu (%.1f MB/s)\n", s.bytesRead.load(), mb_per_sec(s.bytesRead, elapsed));
+    fprintf(f, "Bytes direct: %lu (%.1f MB/s)\n", s.bytesDirect.load(), mb_per_sec(s.bytesDirect, elapsed));
+
+    // The page cache is shared with the whole system, so the change is
+    // only an estimate of the impact of the run.
+    long cached = page_cache_kb();
+    if (cached >= 0 && startCached >= 0) {
+        fprintf(f, "Page cache:   %+ld KB\n", cached - startCached);
+    }
+    fprintf(f, "Major faults: %ld\n", usage.ru_majflt - startUsage.ru_majflt);
+    fprintf(f, "Minor faults: %ld\n", usage.ru_minflt - startUsage.ru_minflt);
+    fprintf(f, "Elapsed:      %.3f s\n", elapsed);
+}
+
+} // namespace brie
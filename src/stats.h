@@ -0,0 +1,46 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <stdio.h>
+
+namespace brie {
+
+/*****************************************************************
+ *   Counters reported with --stats.
+ */
+struct Stats
+{
+    std::atomic<size_t> sources{0};      // Sources opened
+    std::atomic<size_t> bytesMapped{0};  // Bytes mapped by mmap sources
+    std::atomic<size_t> bytesRead{0};    // Bytes read into buffers
+    std::atomic<size_t> bytesDirect{0};  // Bytes read bypassing the page cache
+    std::atomic<size_t> replayed{0};     // Sources whose stored results were reused
+    std::atomic<size_t> filtered{0};     // Sources and parts skipped by --where
+};
+
+Stats& stats();
+
+// Remember resource usage at the start of the run
+void start_stats();
+
+// Print counters and resource usage since start_stats()
+void print_stats(FILE* f);
+
+} // namespace brie
@@ -16,16 +16,20 @@
  */
 
 #include "structs.h"
+#include "source.h"
 #include "error.h"
 #include "utils/log.h"
 
 namespace brie {
 
-static StructDictPtr structs;
+// Per thread like the Lua state that declares them
+static thread_local StructDictPtr structs;
+static thread_local std::unordered_map<std::string, Seqlock> seqlocks;
 
 void init_structs()
 {
     structs = std::make_unique<StructDict>();
+    seqlocks.clear();
 }
 
 const StructPtr get_struct(const std::string& name)
@@ -42,6 +46,7 @@ void add_struct(const char* name, StructPtr sp)
 
     StructDict& dict = *structs;
     dict[name] = sp;
+    seqlocks.erase(name);
 }
 
 void check_in_width(const std::string& name, const FieldList& fields)
@@ -117,5 +122,78 @@ void show_decl(const char* name)
     printf("\n");
 }
 
+// Size of a field or 0 if the size depends on the data
+static size_t field_size(const DataItem& item)
+{
+    size_t size = 0;
+    switch (item.type) {
+        case U8:
+        case U16:
+        case U32:
+        case I16:
+        case I32:
+        case I64:
+        case F32:
+        case F64:
+            size = type_length(item.type);
+            break;
+
+        case STRING:
+        case VOID:
+            size = item.size;
+            break;
+
+        case WSTRING: // May start with a byte order mark
+        case FUNC:
+            return 0;
+
+        default:
+            size = get_sizeof(item.typeName.c_str());
+            break;
+    }
+
+    return size * item.count;
+}
+
+size_t get_sizeof(const char* name)
+{
+    const StructPtr sp = get_struct(name);
+
+    size_t total = 0;
+    for (const Field& f: *sp) {
+        const size_t size = field_size(f);
+        if (size == 0) throwex(std::string("Struct has no fixed size: ") + name);
+        total += size;
+    }
+
+    return total;
+}
+
+void set_seqlock(const std::string& name, const std::string& field)
+{
+    const StructPtr sp = get_struct(name);
+    get_sizeof(name.c_str());
+
+    size_t offset = 0;
+    for (const Field& f: *sp) {
+        if (f.name == field) {
+            if (!f.typeName.empty() || f.count != 1 || f.type == F32 || f.type == F64
+                || f.type == STRING || f.type == WSTRING || f.type == VOID) {
+                throwex("Sequence counter must be an integer field");
+            }
+            seqlocks[name] = Seqlock{ offset, f.type };
+            return;
+        }
+        offset += field_size(f);
+    }
+
+    throwex("Sequence counter field is not found");
+}
+
+const Seqlock* get_seqlock(const std::string& name)
+{
+    const auto iter = seqlocks.find(name);
+    return iter == seqlocks.end() ? nullptr : &iter->second;
+}
 
 } // namespace brie
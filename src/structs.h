@@ -51,6 +51,16 @@ using StructPtr = std::shared_ptr<FieldList>;
 using StructDict = std::unordered_map<std::string, StructPtr>;
 using StructDictPtr = std::unique_ptr<StructDict>;
 
+/*****************************************************************
+ *   Sequence counter of a struct that a writer updates with the
+ *   seqlock protocol.
+ */
+struct Seqlock
+{
+    size_t offset;  // Offset of the counter in the struct
+    Type type;
+};
+
 void init_structs();
 void add_struct(const char* name, StructPtr sp);
 const StructPtr get_struct(const std::string& name);
@@ -62,4 +72,9 @@ void print_field(const Field& f);
 void show_decl(const char* name);
 size_t get_sizeof(const char* name);
 
+// Mark the "field" of the struct as its sequence counter. The struct
+// must have a fixed size.
+void set_seqlock(const std::string& name, const std::string& field);
+const Seqlock* get_seqlock(const std::string& name);
+
 } // namespace brie
@@ -22,6 +22,10 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <thread>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "utils/log.h"
 #include "gtest/gtest.h"
 
@@ -89,7 +93,8 @@ static void run_script(const char* testIndex,
                        const char** script, size_t scriptSize,
                        const char** output, size_t outputSize,
                        const char** err, size_t errSize,
-                       const char* inputList = "")
+                       const char* inputList = "",
+                       const char* options = "")
 {
     const std::string scriptPathStr = std::string("/tmp/utest_console_script_") + testIndex;
     const std::string stdoutPathStr = std::string("/tmp/utest_console_stdout_") + testIndex;
@@ -108,8 +113,8 @@ static void run_script(const char* testIndex,
     prepare_file(expectedErr, err, errSize);
 
     char commandLine[256];
-    snprintf(commandLine, sizeof(commandLine), "./brie %s %s >%s 2>%s", 
-        scriptPath, inputList, stdoutPath, stderrPath);
+    snprintf(commandLine, sizeof(commandLine), "./brie %s %s %s >%s 2>%s", 
+        options, scriptPath, inputList, stdoutPath, stderrPath);
 
     int n = system(commandLine);
     (void)n;
@@ -486,3 +491,337 @@ TEST(CONSOLE, Struct5)
                expectedOutput, sizeof(expectedOutput)/sizeof(*expectedOutput),
                expectedErrOutput, sizeof(expectedErrOutput)/sizeof(*expectedErrOutput));
 }
+
+TEST(CONSOLE, Seqlock)
+{
+    const char* script[] = {
+        "open('test:malloc')",
+        "decl('one', 'u32:seq u32:val', {seqlock='seq'})",
+        "setpos('test:u32array')",
+        "q = read('one')",
+        "println('%d %d %d', q.seq, q.val, BRIE_POS)",
+        "atomic_snapshot(BRIE_POS, 8)",
+        "println('%d %d %d', BRIE_POS, BRIE_SIZE, read('u32'))",
+        "restore()",
+        "println('%d', read('u32'))",
+    };
+
+    const char* expectedOutput[] = {
+        "1000 1001 55",
+        "0 8 1002",
+        "1002",
+    };
+
+    const char* expectedErrOutput[] = {
+    };
+
+    run_script("D",
+               script, sizeof(script)/sizeof(*script),
+               expectedOutput, sizeof(expectedOutput)/sizeof(*expectedOutput),
+               expectedErrOutput, sizeof(expectedErrOutput)/sizeof(*expectedErrOutput));
+}
+
+TEST(CONSOLE, Handles)
+{
+    const char* script[] = {
+        "a = open('test:malloc')",
+        "b = open('test:file')",
+        "a:setpos('test:u32array')",
+        "b:setpos('test:u32array')",
+        "b:read('u32 u32')",
+        "println('%d %d %d', a:read('u32'), b:read('u32'), b:pos())",
+        "use(a)",
+        "println('%d %d', read('u32'), BRIE_POS)",
+        "println('%s %d', b:path(), b:size() == BRIE_SIZE and 1 or 0)",
+        "use(b)",
+        "println('%d', b:path() == BRIE_PATH and 1 or 0)",
+        "b:close()",
+        "println('%s', pcall(b.pos, b) and 'open' or 'closed')",
+    };
+
+    const char* expectedOutput[] = {
+        "1000 1002 59",
+        "1001 55",
+        "/tmp/brie.test 1",
+        "1",
+        "closed",
+    };
+
+    const char* expectedErrOutput[] = {
+    };
+
+    run_script("E",
+               script, sizeof(script)/sizeof(*script),
+               expectedOutput, sizeof(expectedOutput)/sizeof(*expectedOutput),
+               expectedErrOutput, sizeof(expectedErrOutput)/sizeof(*expectedErrOutput));
+}
+
+TEST(CONSOLE, Slice)
+{
+    const char* script[] = {
+        "open('test:malloc')",
+        "setpos('test:u32array')",
+        "s = slice(BRIE_POS + 8, 8)",
+        "t = s:slice(4, 4)",
+        "println('%d %d %d', s:read('u32'), t:read('u32'), s:read('u32'))",
+        "println('%d %d', BRIE_POS, s:size())",
+        "println('%s', pcall(s.read, s, 'u32') and 'read' or 'end')",
+    };
+
+    const char* expectedOutput[] = {
+        "1002 1003 1003",
+        "47 8",
+        "end",
+    };
+
+    const char* expectedErrOutput[] = {
+    };
+
+    run_script("F",
+               script, sizeof(script)/sizeof(*script),
+               expectedOutput, sizeof(expectedOutput)/sizeof(*expectedOutput),
+               expectedErrOutput, sizeof(expectedErrOutput)/sizeof(*expectedErrOutput));
+}
+
+TEST(CONSOLE, Inflate)
+{
+    // zlib stream of the bytes 41 42 43 00
+    const char* script[] = {
+        "f = io.open('/tmp/inflate_console.bin', 'wb')",
+        "f:write('\\120\\156\\115\\116\\114\\102\\0\\0\\2\\84\\0\\199')",
+        "f:close()",
+        "open('/tmp/inflate_console.bin')",
+        "z = inflate(0, BRIE_SIZE)",
+        "println('%s %d', z:read('str'), z:size())",
+    };
+
+    const char* expectedOutput[] = {
+        "ABC 4",
+    };
+
+    const char* expectedErrOutput[] = {
+    };
+
+    run_script("G",
+               script, sizeof(script)/sizeof(*script),
+               expectedOutput, sizeof(expectedOutput)/sizeof(*expectedOutput),
+               expectedErrOutput, sizeof(expectedErrOutput)/sizeof(*expectedErrOutput));
+}
+
+TEST(CONSOLE, Index)
+{
+    const char* script[] = {
+        "f = io.open('/tmp/index_console.bin', 'wb')",
+        "f:write('\\3abc\\1d\\2ef\\0')",
+        "f:close()",
+        "os.remove('/tmp/index_console.bin.recs.bidx')",
+        "open('/tmp/index_console.bin')",
+        "println('%s', tostring(index_count('recs')))",
+        "while BRIE_POS < BRIE_SIZE - 1 do n = read('u8'); index('recs', n); read('str#' .. n) end",
+        "println('%d %s', index_count('recs'), tostring(seek_index('recs', 1)))",
+        "println('%s %s', read('str#1'), tostring(seek_index('recs', 9)))",
+        "for off, key in index_entries('recs') do println('%d %d', off, key) end",
+    };
+
+    const char* expectedOutput[] = {
+        "nil",
+        "3 true",
+        "d false",
+        "1 3",
+        "5 1",
+        "7 2",
+    };
+
+    const char* expectedErrOutput[] = {
+    };
+
+    run_script("H",
+               script, sizeof(script)/sizeof(*script),
+               expectedOutput, sizeof(expectedOutput)/sizeof(*expectedOutput),
+               expectedErrOutput, sizeof(expectedErrOutput)/sizeof(*expectedErrOutput));
+}
+
+TEST(CONSOLE, WhereMatch)
+{
+    const char* script[] = {
+        "decl('rec', 'u32:x')",
+        "f = io.open('/tmp/where_console.bin', 'wb')",
+        "f:write(string.pack('<I4I4I4I4', 5, 1, 7, 0))",
+        "f:close()",
+        "%%",
+        "open('/tmp/where_console.bin')",
+        "while BRIE_POS < BRIE_SIZE do if where_match() then println('%d', BRIE_POS) end; read('u32') end",
+        "println('%s %s', tostring(where_match(4)), tostring(where_match(16)))",
+    };
+
+    const char* expectedOutput[] = {
+        "0",
+        "8",
+        "false false",
+    };
+
+    const char* expectedErrOutput[] = {
+    };
+
+    run_script("I",
+               script, sizeof(script)/sizeof(*script),
+               expectedOutput, sizeof(expectedOutput)/sizeof(*expectedOutput),
+               expectedErrOutput, sizeof(expectedErrOutput)/sizeof(*expectedErrOutput),
+               "", "--where 'rec.x > 4'");
+}
+
+TEST(CONSOLE, ChunkPrefix)
+{
+    const char* dataPath = "/tmp/chunk_console.bin";
+    const char* logPath = "/tmp/chunk_console.log";
+    const char* data[] = { "0123456789abcde" };
+    prepare_file(dataPath, data, 1);
+    unlink(logPath);
+
+    // The prefix runs in every chunk state, BRIE_CHUNK tells them apart
+    const char* script[] = {
+        "decl('rec', 'u32:x')",
+        "if not BRIE_CHUNK then f = io.open('/tmp/chunk_console.log', 'a'); f:write('p'); f:close() end",
+        "%%",
+        "println('%d %d %d', BRIE_CHUNK, BRIE_OFFSET, BRIE_SIZE)",
+        "io.write(io.type(io.write('w')), '\\n')",
+        "%%",
+        "f = io.open('/tmp/chunk_console.log'); println('%s', f:read('a')); f:close()",
+    };
+
+    const char* expectedOutput[] = {
+        "0 0 8",
+        "wfile",
+        "1 8 8",
+        "wfile",
+        "p",
+    };
+
+    const char* expectedErrOutput[] = {
+    };
+
+    run_script("J",
+               script, sizeof(script)/sizeof(*script),
+               expectedOutput, sizeof(expectedOutput)/sizeof(*expectedOutput),
+               expectedErrOutput, sizeof(expectedErrOutput)/sizeof(*expectedErrOutput),
+               dataPath, "--chunks 2 --record rec");
+
+    unlink(dataPath);
+    unlink(logPath);
+}
+
+TEST(CONSOLE, StreamSize)
+{
+    const char* path = "/tmp/stream_console.fifo";
+    unlink(path);
+    ASSERT_EQ(0, mkfifo(path, S_IRUSR | S_IWUSR));
+
+    // The data arrives in parts, BRIE_SIZE follows it to the end
+    std::thread writer([path] {
+        int fd = open(path, O_WRONLY);
+        for (uint32_t i = 0; i < 50000; i++) {
+            size_t n = write(fd, &i, sizeof(i));
+            (void)n;
+            if (i % 10000 == 0) usleep(10000);
+        }
+        close(fd);
+    });
+
+    const char* script[] = {
+        "n = 0",
+        "while BRIE_POS < BRIE_SIZE do last = read('u32'); n = n + 1 end",
+        "println('%d %d %d', n, last, BRIE_SIZE)",
+    };
+
+    const char* expectedOutput[] = {
+        "50000 49999 200000",
+    };
+
+    const char* expectedErrOutput[] = {
+    };
+
+    run_script("K",
+               script, sizeof(script)/sizeof(*script),
+               expectedOutput, sizeof(expectedOutput)/sizeof(*expectedOutput),
+               expectedErrOutput, sizeof(expectedErrOutput)/sizeof(*expectedErrOutput),
+               path);
+
+    writer.join();
+    unlink(path);
+}
+
+TEST(CONSOLE, IndexOwner)
+{
+    // Switching sources keeps the indexes being built; a slice has
+    // indexes of its own
+    const char* script[] = {
+        "f = io.open('/tmp/index_owner.bin', 'wb'); f:write('abcdefgh'); f:close()",
+        "os.remove('/tmp/index_owner.bin.recs.bidx')",
+        "os.remove('/tmp/index_owner.bin.recs@4.bidx')",
+        "a = open('/tmp/index_owner.bin')",
+        "b = open('test:malloc')",
+        "use(a); index('recs', 1); read('u8')",
+        "use(b)",
+        "use(a); index('recs', 2)",
+        "s = slice(4, 4)",
+        "use(s); read('u8'); index('recs', 7)",
+        "use(a)",
+        "println('%d %s', index_count('recs'), tostring(seek_index('recs', 2)))",
+        "use(s)",
+        "println('%d %s %d', index_count('recs'), tostring(seek_index('recs', 7)), BRIE_POS)",
+        "f = io.open('/tmp/index_owner.bin.recs@4.bidx'); println('%s', f and 'saved' or 'missing')",
+        "if f then f:close() end",
+    };
+
+    const char* expectedOutput[] = {
+        "2 true",
+        "1 true 1",
+        "saved",
+    };
+
+    const char* expectedErrOutput[] = {
+    };
+
+    run_script("L",
+               script, sizeof(script)/sizeof(*script),
+               expectedOutput, sizeof(expectedOutput)/sizeof(*expectedOutput),
+               expectedErrOutput, sizeof(expectedErrOutput)/sizeof(*expectedErrOutput));
+
+    unlink("/tmp/index_owner.bin");
+    unlink("/tmp/index_owner.bin.recs.bidx");
+    unlink("/tmp/index_owner.bin.recs@4.bidx");
+}
+
+TEST(CONSOLE, PrefixFirstSource)
+{
+    const char* dataPath = "/tmp/prefix_console.bin";
+    const char* data[] = { "abc" };
+    prepare_file(dataPath, data, 1);
+
+    // The prefix sees the first source in every mode
+    const char* script[] = {
+        "println('%s %d', BRIE_PATH, BRIE_SIZE)",
+        "%%",
+        "println('%d', read('u8'))",
+        "emit('sources', 1)",
+    };
+
+    const char* expectedOutput[] = {
+        "/tmp/prefix_console.bin 4",
+        "97",
+    };
+
+    const char* expectedErrOutput[] = {
+    };
+
+    for (const char* options: { "", "--dedupe", "--fork 2" }) {
+        SCOPED_TRACE(options);
+        run_script("M",
+                   script, sizeof(script)/sizeof(*script),
+                   expectedOutput, sizeof(expectedOutput)/sizeof(*expectedOutput),
+                   expectedErrOutput, sizeof(expectedErrOutput)/sizeof(*expectedErrOutput),
+                   dataPath, options);
+    }
+
+    unlink(dataPath);
+}
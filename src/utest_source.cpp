@@ -20,8 +20,25 @@
  */
 
 #include "source_test.h"
+#include "prefetch.h"
+#include "loader.h"
+#include "index.h"
+#include "incremental.h"
+#include "dedupe.h"
+#include "where.h"
+#include "sample.h"
+#include "chunks.h"
+#include "fork.h"
+#include "structs.h"
+#include "parser.h"
+#include "error.h"
 #include "utils/log.h"
 #include "gtest/gtest.h"
+#include <atomic>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <zlib.h>
 
 using namespace brie;
 
@@ -122,5 +139,1361 @@ TEST(SOURCE, SysVShMem)
     ASSERT_EQ(0, memcmp(src->ptr(), fst.ptr(), Size));
 }
 
+TEST(SOURCE, Stream)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    const size_t Count = 200000;
+    const char* path = "/tmp/stream_utest.fifo";
+    unlink(path);
+    ASSERT_EQ(0, mkfifo(path, S_IRUSR | S_IWUSR));
+
+    std::thread writer([path] {
+        int fd = open(path, O_WRONLY);
+        for (uint32_t i = 0; i < Count; i++) {
+            size_t n = write(fd, &i, sizeof(i));
+            (void)n;
+        }
+        close(fd);
+    });
+
+    SourceOptions opts;
+    opts.retention = 4096;
+    SourcePtr src = make_source(path, opts);
+    ASSERT_TRUE(src);
+
+    for (uint32_t i = 0; i < 1000; i++) {
+        ASSERT_EQ(i, src->read_int(U32));
+    }
+
+    // Backward within the retention
+    src->set_pos(500 * 4);
+    ASSERT_EQ(500, src->read_int(U32));
+
+    // Forward skip far beyond the buffered data
+    src->set_pos(150000 * 4);
+    ASSERT_EQ(150000, src->read_int(U32));
+
+    // Backward beyond the retention
+    bool failed = false;
+    try {
+        src->set_pos(1000 * 4);
+    } catch (const Error&) {
+        failed = true;
+    }
+    ASSERT_TRUE(failed);
+
+    src->set_pos((Count - 1) * 4);
+    ASSERT_EQ(Count - 1, src->read_int(U32));
+
+    failed = false;
+    try {
+        src->read_int(U32);
+    } catch (const Error&) {
+        failed = true;
+    }
+    ASSERT_TRUE(failed);
+    ASSERT_EQ(Count * 4, src->size());
+    ASSERT_TRUE(src->sized());
+
+    writer.join();
+
+    // Searching far ahead of the position keeps the data from the
+    // position on, but not the retention before it
+    std::thread writer2([path] {
+        int fd = open(path, O_WRONLY);
+        for (uint32_t i = 0; i < Count; i++) {
+            size_t n = write(fd, &i, sizeof(i));
+            (void)n;
+        }
+        close(fd);
+    });
+
+    src = make_source(path, opts);
+    ASSERT_FALSE(src->sized());
+    ASSERT_TRUE(src->grow(4));
+    for (uint32_t i = 0; i < 2000; i++) {
+        ASSERT_EQ(i, src->read_int(U32));
+    }
+
+    const uint32_t needle = 190000;
+    const std::string str((const char*)&needle, sizeof(needle));
+    ASSERT_EQ(needle * 4, src->find(str.c_str(), Count * 4));
+    ASSERT_EQ(2000, src->read_int(U32));
+    ASSERT_THROW(src->set_pos(8), Error);
+    src->set_pos(needle * 4);
+    ASSERT_EQ(needle, src->read_int(U32));
+    ASSERT_FALSE(src->grow(Count * 4 + 1));
+
+    writer2.join();
+
+    // A position past the end fails without losing the current one
+    std::thread writer3([path] {
+        int fd = open(path, O_WRONLY);
+        for (uint32_t i = 0; i < Count; i++) {
+            size_t n = write(fd, &i, sizeof(i));
+            (void)n;
+        }
+        close(fd);
+    });
+
+    src = make_source(path, opts);
+    ASSERT_EQ(0, src->read_int(U32));
+    ASSERT_THROW(src->set_pos(Count * 4 + 4), Error);
+    ASSERT_EQ(4u, src->pos());
+    ASSERT_EQ(1, src->read_int(U32));
+
+    writer3.join();
+    unlink(path);
+}
+
+TEST(SOURCE, FileWindow)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    const uint32_t Count = 256 * 1024;
+    const char* path = "/tmp/file_window_utest.bin";
+    FileSourceTest fst;
+    const std::string cfg = fst.make(path);
+
+    for (uint32_t i = 0; i < Count; i++) {
+        size_t ret = write(fst.fd(), &i, sizeof(i));
+        ASSERT_EQ(sizeof(i), ret);
+    }
+
+    SourceOptions opts;
+    opts.window = 64 * 1024;
+    SourcePtr src = make_source(cfg.c_str(), opts);
+
+    ASSERT_EQ(Count * 4, src->size());
+    for (uint32_t i = 0; i < Count; i++) {
+        ASSERT_EQ(i, src->read_int(U32));
+    }
+
+    // Read crossing the window boundary
+    src->set_pos(opts.window - 2);
+    ASSERT_EQ(0x40000000, src->read_int(U32));
+
+    src->set_pos(1000 * 4);
+    ASSERT_EQ(1000, src->read_int(U32));
+
+    uint32_t needle = 200000;
+    std::string str((const char*)&needle, sizeof(needle));
+    ASSERT_EQ(needle * 4, src->find(str.c_str(), Count * 4));
+
+    // The data ends on a page boundary: reading at the end is short of
+    // data rather than an empty mapping
+    src->set_pos(0);
+    src->set_pos(Count * 4);
+    try {
+        src->read_int(U8);
+        FAIL();
+    } catch (const Error& err) {
+        ASSERT_EQ(std::string::npos, err.what().find("map")) << err.what();
+    }
+    src->set_pos(Count * 4 - 4);
+    ASSERT_EQ(Count - 1, src->read_int(U32));
+}
+
+TEST(SOURCE, Hints)
+{
+    SourceOptions opts;
+    parse_hints("sequential,populate,hugepage", opts);
+    ASSERT_EQ(HintSequential | HintPopulate | HintHugePage, opts.hints);
+
+    SourceOptions header;
+    parse_hints("header:4096", header);
+    ASSERT_EQ(HintHeader, header.hints);
+    ASSERT_EQ(4096, header.header);
+
+    SourceOptions invalid;
+    ASSERT_THROW(parse_hints("sideways", invalid), Error);
+    ASSERT_THROW(parse_hints("header:", invalid), Error);
+    ASSERT_THROW(parse_hints("sequential,random", invalid), Error);
+
+    const size_t Size = 1024 * 1024;
+    const char* path = "/tmp/file_hints_utest.bin";
+    FileSourceTest fst;
+    const std::string cfg = fst.make(path);
+
+    std::string data(Size, 'x');
+    size_t ret = write(fst.fd(), data.c_str(), Size);
+    ASSERT_EQ(Size, ret);
+
+    SourcePtr src = make_source(cfg.c_str(), opts);
+    ASSERT_EQ(Size, src->size());
+    ASSERT_EQ(0, memcmp(src->ptr(), data.c_str(), Size));
+
+    src = make_source(cfg.c_str(), header);
+    ASSERT_EQ(Size, src->size());
+    ASSERT_EQ(0, memcmp(src->ptr(), data.c_str(), Size));
+}
+
+TEST(SOURCE, SmallFile)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    const size_t Size = 1000;
+    const char* path = "/tmp/small_file_utest.bin";
+    FileSourceTest fst;
+    const std::string cfg = fst.make(path);
+
+    std::string data(Size, 'y');
+    size_t ret = write(fst.fd(), data.c_str(), Size);
+    ASSERT_EQ(Size, ret);
+
+    SourcePtr src = make_source(cfg.c_str());
+    ASSERT_NE(nullptr, dynamic_cast<SmallFileSource*>(src.get()));
+    ASSERT_EQ(Size, src->size());
+    ASSERT_EQ(0, memcmp(src->ptr(), data.c_str(), Size));
+
+    // The buffer is reused by the next small file
+    const char* ptr = src->ptr();
+    src.reset();
+    src = make_source(cfg.c_str());
+    ASSERT_EQ(ptr, src->ptr());
+
+    SourceOptions opts;
+    opts.smallFile = 0;
+    src = make_source(cfg.c_str(), opts);
+    ASSERT_NE(nullptr, dynamic_cast<FileSource*>(src.get()));
+    ASSERT_EQ(0, memcmp(src->ptr(), data.c_str(), Size));
+}
+
+TEST(SOURCE, Limit)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    const uint32_t Count = 64 * 1024;
+    const char* path = "/tmp/file_limit_utest.bin";
+    FileSourceTest fst;
+    const std::string cfg = fst.make(path);
+
+    for (uint32_t i = 0; i < Count; i++) {
+        size_t ret = write(fst.fd(), &i, sizeof(i));
+        ASSERT_EQ(sizeof(i), ret);
+    }
+
+    SourceOptions small;
+    small.limit = 4096;
+    small.smallFile = Count * 8;
+    SourceOptions mapped = small;
+    mapped.smallFile = 0;
+
+    for (const SourceOptions& opts: { small, mapped }) {
+        SourcePtr src = make_source(cfg.c_str(), opts);
+        ASSERT_EQ(Count * 4, src->size());
+
+        src->set_pos(4092);
+        ASSERT_EQ(1023, src->read_int(U32));
+        ASSERT_THROW(src->read_int(U32), Error);
+
+        src->set_pos(4094);
+        ASSERT_THROW(src->read_int(U32), Error);
+
+        src->set_pos(0);
+        ASSERT_THROW(src->find("none", Count * 4), Error);
+        ASSERT_EQ(Source::nopos(), src->find("none", 4096));
+    }
+}
+
+TEST(SOURCE, Prefetch)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    const size_t Count = 10;
+    std::vector<std::unique_ptr<FileSourceTest>> files;
+    std::vector<std::string> cfgs;
+
+    for (size_t i = 0; i < Count; i++) {
+        files.push_back(std::make_unique<FileSourceTest>());
+        std::string path = "/tmp/prefetch_utest_" + std::to_string(i) + ".bin";
+        cfgs.push_back(files.back()->make(path.c_str()));
+
+        std::string data(100000 + i, 'a' + i);
+        size_t ret = write(files.back()->fd(), data.c_str(), data.length());
+        ASSERT_EQ(data.length(), ret);
+    }
+    cfgs.push_back("/prefetch_utest_missing");
+
+    size_t next = 0;
+    Prefetcher prefetcher([&](std::string& cfg) {
+        if (next >= cfgs.size()) return false;
+        cfg = cfgs[next++];
+        return true;
+    }, 3, 4096);
+
+    Prefetcher::Item item;
+    for (size_t i = 0; i < Count; i++) {
+        ASSERT_TRUE(prefetcher.get(item));
+        ASSERT_EQ(cfgs[i], item.cfg);
+        ASSERT_TRUE(item.source);
+        ASSERT_EQ(100000 + i, item.source->size());
+        ASSERT_EQ('a' + (int)i, item.source->read_int(U8));
+    }
+
+    ASSERT_TRUE(prefetcher.get(item));
+    ASSERT_FALSE(item.source);
+    ASSERT_FALSE(item.error.empty());
+
+    ASSERT_FALSE(prefetcher.get(item));
+
+    // Destroyed early, the prefetcher waits for its thread to stop
+    // calling "next", whose state goes away with the caller
+    std::atomic<size_t> calls{0};
+    {
+        Prefetcher early([&calls, &cfgs](std::string& cfg) {
+            usleep(1000);
+            cfg = cfgs[calls++ % 2];
+            return true;
+        }, 2, 0);
+        ASSERT_TRUE(early.get(item));
+    }
+    const size_t made = calls;
+    usleep(10000);
+    ASSERT_EQ(made, calls);
+}
+
+TEST(SOURCE, BatchLoader)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    const size_t Count = 20;
+    std::vector<std::unique_ptr<FileSourceTest>> files;
+    std::vector<std::string> cfgs;
+
+    // Even files are small and read whole, odd ones are mapped
+    for (size_t i = 0; i < Count; i++) {
+        files.push_back(std::make_unique<FileSourceTest>());
+        std::string path = "/tmp/loader_utest_" + std::to_string(i) + ".bin";
+        cfgs.push_back(files.back()->make(path.c_str()));
+
+        std::string data((i % 2 ? 100000 : 1000) + i, 'a' + i);
+        size_t ret = write(files.back()->fd(), data.c_str(), data.length());
+        ASSERT_EQ(data.length(), ret);
+    }
+    cfgs.push_back("/loader_utest_missing");
+
+    for (bool uring: { true, false }) {
+        BatchLoader loader(4096, uring);
+        ASSERT_TRUE(uring || !loader.uses_uring());
+
+        std::vector<PreparedSource> items;
+        loader.load(cfgs, items);
+        ASSERT_EQ(cfgs.size(), items.size());
+
+        for (size_t i = 0; i < Count; i++) {
+            ASSERT_EQ(cfgs[i], items[i].cfg);
+            ASSERT_TRUE(items[i].source);
+            if (i % 2) {
+                ASSERT_NE(nullptr, dynamic_cast<FileSource*>(items[i].source.get()));
+            } else {
+                ASSERT_NE(nullptr, dynamic_cast<SmallFileSource*>(items[i].source.get()));
+            }
+            ASSERT_EQ((i % 2 ? 100000 : 1000) + i, items[i].source->size());
+            ASSERT_EQ('a' + (int)i, items[i].source->read_int(U8));
+            items[i].source->set_pos(items[i].source->size() - 1);
+            ASSERT_EQ('a' + (int)i, items[i].source->read_int(U8));
+        }
+
+        ASSERT_FALSE(items[Count].source);
+        ASSERT_FALSE(items[Count].error.empty());
+    }
+
+    // Batches through the prefetcher keep the order
+    size_t next = 0;
+    Prefetcher prefetcher([&](std::string& cfg) {
+        if (next >= cfgs.size()) return false;
+        cfg = cfgs[next++];
+        return true;
+    }, 8, 4096, 4);
+
+    Prefetcher::Item item;
+    for (size_t i = 0; i <= Count; i++) {
+        ASSERT_TRUE(prefetcher.get(item));
+        ASSERT_EQ(cfgs[i], item.cfg);
+    }
+    ASSERT_FALSE(prefetcher.get(item));
+}
+
+TEST(SOURCE, Direct)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    const uint32_t Count = 10000;
+    const char* path = "/tmp/direct_utest.bin";
+    FileSourceTest fst;
+    const std::string cfg = fst.make(path);
+
+    for (uint32_t i = 0; i < Count; i++) {
+        size_t ret = write(fst.fd(), &i, sizeof(i));
+        ASSERT_EQ(sizeof(i), ret);
+    }
+
+    SourceOptions opts;
+    opts.direct = 1000; // Rounded up to one aligned block
+    SourcePtr src = make_source(cfg.c_str(), opts);
+    ASSERT_NE(nullptr, dynamic_cast<DirectSource*>(src.get()));
+    ASSERT_EQ(Count * 4, src->size());
+
+    // Sequential reads cross the block boundaries
+    src->set_pos(2);
+    for (uint32_t i = 0; i < Count - 1; i++) {
+        uint32_t expected = (i >> 16) | ((i + 1) << 16);
+        ASSERT_EQ(expected, src->read_int(U32));
+    }
+
+    // Backward and far forward
+    src->set_pos(40);
+    ASSERT_EQ(10, src->read_int(U32));
+    src->set_pos(9000 * 4);
+    ASSERT_EQ(9000, src->read_int(U32));
+    src->set_pos(Count * 4);
+    ASSERT_THROW(src->read_int(U32), Error);
+
+    // The limit applies as for mapped files
+    opts.limit = 4096;
+    src = make_source(cfg.c_str(), opts);
+    src->set_pos(4092);
+    ASSERT_EQ(1023, src->read_int(U32));
+    ASSERT_THROW(src->read_int(U32), Error);
+}
+
+TEST(SOURCE, Follow)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    const char* path = "/tmp/follow_utest.bin";
+    FileSourceTest fst;
+    const std::string cfg = fst.make(path);
+
+    SourceOptions opts;
+    opts.follow = true;
+    SourcePtr src = make_source(cfg.c_str(), opts);
+    ASSERT_NE(nullptr, dynamic_cast<FileSource*>(src.get()));
+    ASSERT_EQ(0, src->size());
+
+    // The reader waits for records appended by the writer
+    const uint32_t Count = 3000;
+    std::thread writer([&fst] {
+        for (uint32_t i = 0; i < Count; i++) {
+            size_t n = write(fst.fd(), &i, sizeof(i));
+            (void)n;
+            if (i % 1000 == 0) usleep(10000);
+        }
+    });
+
+    for (uint32_t i = 0; i < Count; i++) {
+        ASSERT_EQ(i, src->read_int(U32));
+    }
+    writer.join();
+    ASSERT_EQ(Count * 4, src->size());
+
+    // Stopped following reports the end of data
+    stop_following();
+    ASSERT_FALSE(src->grow(src->size() + 1));
+    ASSERT_THROW(src->read_int(U32), Error);
+    stop_following(false);
+}
+
+TEST(SOURCE, Ring)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    // Header: tail counter at 0, ring data of 256 bytes at 64
+    const size_t DataOffset = 64;
+    const size_t Capacity = 256;
+    ShmSourceTest sst;
+    const std::string segment = sst.make("/ring_utest", DataOffset + Capacity);
+    char* base = sst.ptr();
+    memset(base, 0, sst.size());
+    uint64_t* tail = (uint64_t*)base;
+
+    const std::string cfg = std::string(PrefixRing) + segment + ",tail=0,data=64,prefix=2";
+    SourcePtr src = make_source(cfg.c_str());
+    ASSERT_NE(nullptr, dynamic_cast<RingSource*>(src.get()));
+
+    // Records of growing length wrap around the end of the ring
+    const uint16_t Count = 100;
+    std::atomic<uint64_t> consumed{0};
+    std::thread producer([=, &consumed] {
+        uint64_t pos = 0;
+        for (uint16_t i = 1; i <= Count; i++) {
+            const uint16_t len = i % 30 + 1;
+            while (pos + 2 + len - consumed > Capacity) usleep(100);
+
+            char record[64];
+            memcpy(record, &len, 2);
+            memset(record + 2, (char)i, len);
+            for (size_t k = 0; k < 2u + len; k++) {
+                base[DataOffset + (pos + k) % Capacity] = record[k];
+            }
+            pos += 2 + len;
+            __atomic_store_n(tail, pos, __ATOMIC_RELEASE);
+            usleep(100);
+        }
+    });
+
+    for (uint16_t i = 1; i <= Count; i++) {
+        ASSERT_TRUE(src->next());
+        ASSERT_EQ(i % 30 + 1u, src->size());
+        ASSERT_EQ(i, src->read_int(U8));
+        src->set_pos(src->size() - 1);
+        ASSERT_EQ(i, src->read_int(U8));
+        consumed += 2 + src->size();
+    }
+    producer.join();
+    ASSERT_EQ(0, ((RingSource*)src.get())->lost());
+
+    stop_following();
+    ASSERT_FALSE(src->next());
+    stop_following(false);
+
+    ASSERT_THROW(make_source((std::string(PrefixRing) + segment + ",tail=0").c_str()), Error);
+
+    // A 4 byte counter wraps at 2^32, which only a power of two divides
+    ASSERT_THROW(make_source((cfg + ",counter=4,capacity=200").c_str()), Error);
+    ASSERT_NO_THROW(make_source((cfg + ",counter=4,capacity=128").c_str()));
+    ASSERT_NO_THROW(make_source((cfg + ",capacity=200").c_str()));
+}
+
+TEST(SOURCE, Snapshot)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    // Writer keeps both values equal to the half of the even counter
+    struct Shared { uint32_t seq; uint32_t pad; uint64_t a; uint64_t b; };
+    Shared shared = { 0, 0, 0, 0 };
+
+    char cfg[64];
+    snprintf(cfg, sizeof(cfg), "%s%p %lu", PrefixMalloc, (void*)&shared, sizeof(shared));
+    SourcePtr src = make_source(cfg);
+
+    std::atomic<bool> done{false};
+    std::thread writer([&] {
+        for (uint64_t i = 1; !done; i++) {
+            __atomic_store_n(&shared.seq, 2 * i - 1, __ATOMIC_RELEASE);
+            __atomic_store_n(&shared.a, i, __ATOMIC_RELAXED);
+            __atomic_store_n(&shared.b, i, __ATOMIC_RELAXED);
+            __atomic_store_n(&shared.seq, 2 * i, __ATOMIC_RELEASE);
+        }
+    });
+
+    for (int i = 0; i < 10000; i++) {
+        Shared copy;
+        src->snapshot(0, sizeof(copy), (char*)&copy, 0, U32);
+        ASSERT_EQ(copy.a, copy.b);
+        ASSERT_EQ(copy.seq, 2 * copy.a);
+    }
+
+    done = true;
+    writer.join();
+
+    // Without a counter it is a plain copy
+    Shared copy;
+    src->snapshot(0, sizeof(copy), (char*)&copy);
+    ASSERT_EQ(0, memcmp(&copy, &shared, sizeof(copy)));
+
+    // A counter that stays odd never gives a snapshot
+    shared.seq = 1;
+    ASSERT_THROW(src->snapshot(0, sizeof(copy), (char*)&copy, 0, U32), Error);
+}
+
+TEST(SOURCE, Process)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    // Memory of this process is read as memory of another one
+    const uint32_t Count = 10000;
+    std::vector<uint32_t> data(Count);
+    for (uint32_t i = 0; i < Count; i++) data[i] = i;
+
+    char cfg[128];
+    snprintf(cfg, sizeof(cfg), "%s%d:%p:%lu", PrefixPid, getpid(), (void*)data.data(), (size_t)Count * 4);
+
+    SourceOptions opts;
+    opts.cache = 4 * 4096;
+    SourcePtr src = make_source(cfg, opts);
+    ASSERT_NE(nullptr, dynamic_cast<ProcessSource*>(src.get()));
+    ASSERT_EQ(Count * 4, src->size());
+
+    // Unaligned reads cross the page boundaries, more pages than cached
+    src->set_pos(2);
+    for (uint32_t i = 0; i < Count - 1; i++) {
+        uint32_t expected = (i >> 16) | ((i + 1) << 16);
+        ASSERT_EQ(expected, src->read_int(U32));
+    }
+    src->set_pos(8);
+    ASSERT_EQ(2, src->read_int(U32));
+
+    // Positions are addresses without a region
+    snprintf(cfg, sizeof(cfg), "%s%d", PrefixPid, getpid());
+    src = make_source(cfg, opts);
+    src->set_pos((size_t)&data[777]);
+    ASSERT_EQ(777, src->read_int(U32));
+
+    src->set_pos(0);
+    ASSERT_THROW(src->read_int(U32), Error);
+
+    // Mappings are found by name
+    snprintf(cfg, sizeof(cfg), "%s%d:[stack]", PrefixPid, getpid());
+    src = make_source(cfg, opts);
+    ASSERT_NE(0, src->size());
+}
+
+TEST(SOURCE, BlockDevice)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    // A disk image in a regular file is read like a device
+    const uint32_t Count = 100000;
+    const char* path = "/tmp/blockdev_utest.img";
+    FileSourceTest fst;
+    const std::string cfg = fst.make(path);
+
+    std::vector<uint32_t> data(Count);
+    for (uint32_t i = 0; i < Count; i++) data[i] = i;
+    size_t ret = write(fst.fd(), data.data(), Count * 4);
+    ASSERT_EQ(Count * 4, ret);
+
+    BlockDeviceSource src(cfg.c_str());
+    src.set_options(SourceOptions());
+    src.init(cfg.c_str());
+    ASSERT_EQ(Count * 4, src.size());
+
+    // Random positions across the pages of the cache
+    for (uint32_t i = 0; i < 1000; i++) {
+        const uint32_t k = (i * 7919) % Count;
+        src.set_pos(k * 4);
+        ASSERT_EQ(k, src.read_int(U32));
+    }
+
+    // Reads crossing page boundaries
+    src.set_pos(64 * 1024 - 2);
+    ASSERT_EQ(((64 * 1024 / 4 - 1) >> 16) | ((64 * 1024 / 4) << 16), src.read_int(U32));
+
+    src.set_pos(Count * 4 - 4);
+    ASSERT_EQ(Count - 1, src.read_int(U32));
+    ASSERT_THROW(src.read_int(U32), Error);
+}
+
+TEST(SOURCE, OpenSource)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    const size_t Size = 4096;
+    const char* path = "/tmp/open_source_utest.bin";
+    FileSourceTest fst;
+    const std::string cfg = fst.make(path);
+
+    std::string data(Size, 'o');
+    size_t ret = write(fst.fd(), data.c_str(), Size);
+    ASSERT_EQ(Size, ret);
+
+    SourceOptions opts;
+    SourcePtr src = open_source(cfg.c_str(), opts);
+    ASSERT_NE(nullptr, src);
+    src->set_pos(100);
+
+    // A source in use is not shared
+    SourcePtr other = open_source(cfg.c_str(), opts);
+    ASSERT_NE(src, other);
+    ASSERT_EQ(0u, other->pos());
+
+    // A released source is reused from the start
+    Source* raw = src.get();
+    src.reset();
+    src = open_source(cfg.c_str(), opts);
+    ASSERT_EQ(raw, src.get());
+    ASSERT_EQ(0u, src->pos());
+
+    // Other options or a changed file give a new source
+    src.reset();
+    opts.smallFile = 0;
+    src = open_source(cfg.c_str(), opts);
+    ASSERT_NE(nullptr, dynamic_cast<FileSource*>(src.get()));
+
+    src.reset();
+    ret = write(fst.fd(), data.c_str(), Size);
+    ASSERT_EQ(Size, ret);
+    src = open_source(cfg.c_str(), opts);
+    ASSERT_EQ(2 * Size, src->size());
+}
+
+TEST(SOURCE, Slice)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    const size_t Size = 256;
+    MallocSourceTest mst;
+    const std::string cfg = mst.make(Size);
+    for (size_t i = 0; i < Size; i++) {
+        mst.ptr()[i] = i;
+    }
+
+    SourcePtr src = make_source(cfg.c_str());
+    SourcePtr first = make_slice(src, 16, 8);
+    SourcePtr second = make_slice(src, 16, 8);
+    ASSERT_EQ(8u, first->size());
+
+    // Each slice has its own position relative to its start
+    ASSERT_EQ(16, first->read_int(U8));
+    ASSERT_EQ(16, second->read_int(U8));
+    ASSERT_EQ(17, first->read_int(U8));
+    ASSERT_EQ(0u, src->pos());
+
+    // Reads stop at the end of the slice
+    first->set_pos(6);
+    ASSERT_EQ(0x1716, first->read_int(U16));
+    first->set_pos(7);
+    ASSERT_THROW(first->read_int(U16), Error);
+    ASSERT_THROW(first->set_pos(9), Error);
+
+    // A slice of a slice refers to the original source
+    SourcePtr inner = make_slice(first, 4, 2);
+    auto slice = std::dynamic_pointer_cast<SliceSource>(inner);
+    ASSERT_NE(nullptr, slice);
+    ASSERT_EQ(src, slice->parent());
+    ASSERT_EQ(20u, slice->offset());
+    ASSERT_EQ(20, inner->read_int(U8));
+
+    ASSERT_THROW(make_slice(src, 250, 7), Error);
+}
+
+TEST(SOURCE, Compressed)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    // Two gzip members with 6 MB of data each
+    const size_t Size = 12 * 1024 * 1024;
+    std::vector<char> data(Size);
+    uint32_t x = 1;
+    for (size_t i = 0; i < Size; i++) {
+        x = x * 1103515245 + 12345;
+        data[i] = 'a' + (x >> 16) % 16;
+    }
+
+    const char* path = "/tmp/compressed_utest.bin.gz";
+    const char* indexDir = "/tmp/compressed_utest.idx";
+    const std::string indexPath = std::string(indexDir) + "/%tmp%compressed_utest.bin.gz.brix";
+    const char* cacheHome = "/tmp/compressed_utest.cache";
+    const std::string cachePath = std::string(cacheHome) + "/brie/%tmp%compressed_utest.bin.gz.brix";
+    mkdir(indexDir, 0700);
+    unlink(indexPath.c_str());
+    unlink(cachePath.c_str());
+
+    const char* oldCache = getenv("XDG_CACHE_HOME");
+    const std::string savedCache = oldCache != nullptr ? oldCache : "";
+    setenv("XDG_CACHE_HOME", cacheHome, 1);
+    for (int member = 0; member < 2; member++) {
+        gzFile gz = gzopen(path, member == 0 ? "wb" : "ab");
+        ASSERT_NE(nullptr, gz);
+        ASSERT_EQ(int(Size / 2), gzwrite(gz, data.data() + member * Size / 2, Size / 2));
+        gzclose(gz);
+    }
+
+    // Compressed files are read raw unless asked otherwise
+    SourcePtr src = make_source(path);
+    ASSERT_EQ(nullptr, std::dynamic_pointer_cast<CompressedSource>(src));
+    ASSERT_EQ(0x1f, src->read_int(U8));
+
+    SourceOptions opts;
+    opts.decompress = true;
+    src = make_source(path, opts);
+    auto cs = std::dynamic_pointer_cast<CompressedSource>(src);
+    ASSERT_NE(nullptr, cs);
+    ASSERT_FALSE(cs->index_loaded());
+    ASSERT_LT(1u, cs->seek_points());
+    ASSERT_EQ(Size, src->size());
+
+    const size_t positions[] = { 10, Size - 5, 5 * 1024 * 1024 + 3, Size / 2 - 2, 100 };
+    auto check = [&](SourcePtr s) {
+        for (size_t pos: positions) {
+            s->set_pos(pos);
+            ASSERT_EQ(std::string(&data[pos], 4), s->read_str(4)) << "pos=" << pos;
+        }
+        s->set_pos(Size - 1);
+        ASSERT_THROW(s->read_int(U16), Error);
+    };
+    check(src);
+
+    // Without an index directory the seek points go to the cache and
+    // the next open does not decompress the file again
+    struct stat st;
+    ASSERT_NE(0, stat((std::string(path) + ".brix").c_str(), &st));
+    ASSERT_NE(0, stat(indexPath.c_str(), &st));
+    ASSERT_EQ(0, stat(cachePath.c_str(), &st));
+    src = make_source(path, opts);
+    ASSERT_TRUE(std::dynamic_pointer_cast<CompressedSource>(src)->index_loaded());
+    check(src);
+
+    // The second open uses the seek points saved by the first one
+    opts.indexDir = indexDir;
+    src = make_source(path, opts);
+    ASSERT_FALSE(std::dynamic_pointer_cast<CompressedSource>(src)->index_loaded());
+    ASSERT_EQ(0, stat(indexPath.c_str(), &st));
+    src = make_source(path, opts);
+    cs = std::dynamic_pointer_cast<CompressedSource>(src);
+    ASSERT_TRUE(cs->index_loaded());
+    ASSERT_EQ(Size, src->size());
+    check(src);
+
+    unlink(path);
+    unlink(indexPath.c_str());
+    rmdir(indexDir);
+    unlink(cachePath.c_str());
+    rmdir((std::string(cacheHome) + "/brie").c_str());
+    rmdir(cacheHome);
+    if (oldCache != nullptr) setenv("XDG_CACHE_HOME", savedCache.c_str(), 1);
+    else unsetenv("XDG_CACHE_HOME");
+}
+
+TEST(SOURCE, Inflate)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    // Compressible data grows much more than the initial guess
+    std::string data;
+    for (int i = 0; data.size() < 100000; i++) {
+        data += "record " + std::to_string(i % 50) + ";";
+    }
+
+    std::vector<unsigned char> packed(compressBound(data.size()));
+    uLongf packedLen = packed.size();
+    ASSERT_EQ(Z_OK, compress2(packed.data(), &packedLen, (const Bytef*)data.data(), data.size(), 9));
+
+    const size_t Offset = 10;
+    MallocSourceTest mst;
+    const std::string cfg = mst.make(Offset + packedLen);
+    memcpy(mst.ptr() + Offset, packed.data(), packedLen);
+
+    SourcePtr src = make_source(cfg.c_str());
+    SourcePtr inflated = src->inflate(Offset, packedLen);
+    ASSERT_EQ(data.size(), inflated->size());
+    ASSERT_EQ(0, memcmp(data.data(), inflated->ptr(), data.size()));
+    ASSERT_EQ("record 0", inflated->read_str(8));
+
+    ASSERT_THROW(src->inflate(Offset, packedLen - 4), Error);
+    ASSERT_THROW(src->inflate(Offset, packedLen, false, 1000), Error);
+    ASSERT_THROW(src->inflate(0, packedLen), Error);
+
+    // Raw deflate data without the zlib header
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    ASSERT_EQ(Z_OK, deflateInit2(&strm, 6, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY));
+    strm.next_in = (Bytef*)data.data();
+    strm.avail_in = data.size();
+    strm.next_out = packed.data();
+    strm.avail_out = packed.size();
+    ASSERT_EQ(Z_STREAM_END, deflate(&strm, Z_FINISH));
+    packedLen = strm.total_out;
+    deflateEnd(&strm);
+
+    memcpy(mst.ptr() + Offset, packed.data(), packedLen);
+    inflated = src->inflate(Offset, packedLen, true);
+    ASSERT_EQ(data.size(), inflated->size());
+    ASSERT_EQ(0, memcmp(data.data(), inflated->ptr(), data.size()));
+}
+
+TEST(SOURCE, RecordIndex)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    const char* path = "/tmp/record_index_utest.bin";
+    FileSourceTest fst;
+    fst.make(path);
+    ASSERT_EQ(4, write(fst.fd(), "data", 4));
+
+    const std::string sidecar = std::string(path) + ".ids.bidx";
+    unlink(sidecar.c_str());
+    {
+        RecordIndex index(path, "ids");
+        ASSERT_FALSE(index.load());
+
+        index.add(0, (int64_t)30);
+        index.add(10, (int64_t)-5);
+        index.add(20, (int64_t)30);
+        ASSERT_THROW(index.add(30, std::string("x")), Error);
+        ASSERT_TRUE(index.save());
+        ASSERT_EQ(sidecar, index.sidecar());
+    }
+
+    RecordIndex index(path, "ids");
+    ASSERT_TRUE(index.load());
+    ASSERT_EQ(3u, index.count());
+    ASSERT_EQ(RecordIndex::KeyInt, index.key_type());
+    ASSERT_EQ(10u, index.offset(1));
+    ASSERT_EQ(-5, index.int_key(1));
+    ASSERT_EQ(0u, index.find((int64_t)30));
+    ASSERT_EQ(1u, index.find((int64_t)-5));
+    ASSERT_EQ(RecordIndex::npos, index.find((int64_t)7));
+    ASSERT_EQ(RecordIndex::npos, index.find(std::string("30")));
+
+    RecordIndex names(path, "names");
+    names.add(4, std::string("beta"));
+    names.add(8, std::string("alpha"));
+    names.add(12, std::string(""));
+    ASSERT_TRUE(names.save());
+    ASSERT_EQ(1u, names.find(std::string("alpha")));
+    ASSERT_EQ(2u, names.find(std::string("")));
+    ASSERT_EQ(RecordIndex::npos, names.find(std::string("gamma")));
+    ASSERT_EQ("beta", names.str_key(0));
+
+    // A part of the file, kept in an index directory
+    const char* indexDir = "/tmp/record_index_utest.idx";
+    mkdir(indexDir, 0700);
+    RecordIndex part(path, "ids", 16, indexDir);
+    ASSERT_EQ(std::string(indexDir) + "/%tmp%record_index_utest.bin.ids@16.bidx", part.sidecar());
+    part.add(0, (int64_t)1);
+    ASSERT_TRUE(part.save());
+    ASSERT_TRUE(RecordIndex(path, "ids", 16, indexDir).load());
+    unlink(part.sidecar().c_str());
+    rmdir(indexDir);
+
+    // A changed file makes the sidecars stale
+    ASSERT_EQ(4, write(fst.fd(), "more", 4));
+    ASSERT_FALSE(index.load());
+    ASSERT_FALSE(names.load());
+
+    unlink(sidecar.c_str());
+    unlink((std::string(path) + ".names.bidx").c_str());
+}
+
+TEST(SOURCE, ResultStore)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    const char* path = "/tmp/result_store_utest.bin";
+    const char* storePath = "/tmp/result_store_utest.store";
+    FileSourceTest fst;
+    const std::string cfg = fst.make(path);
+    ASSERT_EQ(4, write(fst.fd(), "data", 4));
+
+    struct stat st;
+    ASSERT_EQ(0, stat(path, &st));
+
+    FileResult result;
+    result.output = "line\n";
+    result.sums.resize(2);
+    result.sums[0].name = "count";
+    result.sums[0].intValue = 3;
+    result.sums[1].name = "total";
+    result.sums[1].isInt = false;
+    result.sums[1].floatValue = 2.5;
+    {
+        ResultStore store(storePath, 42);
+        store.load();
+        ASSERT_EQ(nullptr, store.find(cfg, st));
+        store.put(cfg, st, result);
+        ASSERT_TRUE(store.save());
+    }
 
+    ResultStore store(storePath, 42);
+    store.load();
+    const FileResult* found = store.find(cfg, st);
+    ASSERT_NE(nullptr, found);
+    ASSERT_EQ("line\n", found->output);
+    ASSERT_EQ(2u, found->sums.size());
+    ASSERT_EQ(3, found->sums[0].intValue);
+    ASSERT_FALSE(found->sums[1].isInt);
+    ASSERT_EQ(2.5, found->sums[1].floatValue);
 
+    // Another script or a changed file do not match
+    ResultStore other(storePath, 43);
+    other.load();
+    ASSERT_EQ(nullptr, other.find(cfg, st));
+
+    ASSERT_EQ(4, write(fst.fd(), "more", 4));
+    ASSERT_EQ(0, stat(path, &st));
+    ASSERT_EQ(nullptr, store.find(cfg, st));
+
+    unlink(storePath);
+}
+
+TEST(SOURCE, OutputCapture)
+{
+    std::string output;
+    OutputCapture capture;
+    ASSERT_TRUE(capture.start());
+    printf("captured %d", 1);
+    capture.finish(output);
+    ASSERT_EQ("captured 1", output);
+}
+
+TEST(SOURCE, DuplicateFinder)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    auto write_file = [](const char* path, const std::string& data) {
+        FILE* f = fopen(path, "wb");
+        ASSERT_NE(nullptr, f);
+        ASSERT_EQ(data.size(), fwrite(data.data(), 1, data.size(), f));
+        fclose(f);
+    };
+
+    const std::string small(1000, 's');
+    std::string big(1024 * 1024, 'b');
+    write_file("/tmp/dup_utest_1", small);
+    write_file("/tmp/dup_utest_2", small);
+    write_file("/tmp/dup_utest_3", small + "x");
+    write_file("/tmp/dup_utest_4", big);
+    write_file("/tmp/dup_utest_5", big);
+
+    // Differs only outside of the samples
+    big[100 * 1024] = 'c';
+    write_file("/tmp/dup_utest_6", big);
+
+    DuplicateFinder finder;
+    ASSERT_EQ("", finder.find("/tmp/dup_utest_1"));
+    ASSERT_EQ("/tmp/dup_utest_1", finder.find("/tmp/dup_utest_2"));
+    ASSERT_EQ("", finder.find("/tmp/dup_utest_3"));
+    ASSERT_EQ("", finder.find("/tmp/dup_utest_4"));
+    ASSERT_EQ("", finder.find("/tmp/dup_utest_6"));
+    ASSERT_EQ("/tmp/dup_utest_4", finder.find("/tmp/dup_utest_5"));
+    ASSERT_EQ("", finder.find("/tmp/dup_utest_missing"));
+
+    // A matching hash alone is not a duplicate: the bytes are compared
+    write_file("/tmp/dup_utest_1", std::string(1000, 't'));
+    write_file("/tmp/dup_utest_7", small);
+    ASSERT_EQ("", finder.find("/tmp/dup_utest_7"));
+
+    for (int i = 1; i <= 7; i++) {
+        unlink(("/tmp/dup_utest_" + std::to_string(i)).c_str());
+    }
+}
+
+TEST(SOURCE, Where)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    init_structs();
+    auto decl = [](const char* name, const char* fields) {
+        auto sp = std::make_shared<FieldList>();
+        parse_fields_str(fields, *sp);
+        add_struct(name, sp);
+    };
+    decl("hdr", "u32:magic str:name u8*3:pad u16:ver");
+    decl("rec", "i32:x f64:y");
+
+    MallocSourceTest mst;
+    const std::string cfg = mst.make(64);
+    char* ptr = mst.ptr();
+    memset(ptr, 0, mst.size());
+
+    const uint32_t magic = 0xCAFE;
+    const uint16_t ver = 3;
+    const int32_t x = -5;
+    const double y = 2.5;
+    memcpy(ptr, &magic, 4);
+    memcpy(ptr + 4, "abc", 4);
+    memcpy(ptr + 11, &ver, 2);
+    memcpy(ptr + 13, &x, 4);
+    memcpy(ptr + 17, &y, 8);
+
+    SourcePtr src = make_source(cfg.c_str());
+    src->set_pos(7);
+
+    auto match = [&src](const char* expr) {
+        Predicate p(expr);
+        p.compile();
+        return p.match(*src);
+    };
+
+    ASSERT_TRUE(match("hdr.magic == 0xCAFE"));
+    ASSERT_TRUE(match("hdr.name == 'abc' and hdr.ver >= 3"));
+    ASSERT_FALSE(match("hdr.name == \"abd\" or hdr.ver < 3"));
+    ASSERT_TRUE(match("hdr+rec: x == -5 and y > 2.25"));
+    ASSERT_TRUE(match("hdr.ver != 4 and not (rec.x ~= -5) and rec.y == 2.5"));
+    ASSERT_TRUE(match("hdr+rec: ver > y and x < ver"));
+    ASSERT_FALSE(match("hdr+rec+rec: rec.x == -5 and hdr.magic == 0"));
+    ASSERT_EQ(7u, src->pos());
+
+    // Every comparison, both ways
+    ASSERT_TRUE(match("hdr.ver < 4 and hdr.ver <= 3 and hdr.ver > 2 and hdr.ver >= 3"));
+    ASSERT_FALSE(match("hdr.ver < 3 or hdr.ver <= 2 or hdr.ver > 3 or hdr.ver >= 4"));
+    ASSERT_TRUE(match("hdr.ver ~= 4 and hdr.ver != 2"));
+    ASSERT_FALSE(match("hdr.ver ~= 3 or hdr.ver != 3 or hdr.ver == 4"));
+    ASSERT_TRUE(match("hdr.magic == 51966 and hdr.magic > 0xCAFD"));
+    ASSERT_TRUE(match("hdr+rec: x < 0 and x >= -5 and y < 3 and y ~= 2"));
+    ASSERT_FALSE(match("hdr+rec: y < 2.5 or y > 2.5 or x > -5"));
+
+    // Strings compare by bytes
+    ASSERT_TRUE(match("hdr.name < 'abd' and hdr.name > 'ab' and hdr.name <= 'abc' and hdr.name >= 'ABC'"));
+    ASSERT_FALSE(match("hdr.name ~= 'abc' or hdr.name == 'ab' or hdr.name > 'b'"));
+
+    // "and" binds tighter than "or", "not" applies to one comparison
+    ASSERT_TRUE(match("hdr.ver == 3 or hdr.ver == 4 and hdr.magic == 0"));
+    ASSERT_FALSE(match("(hdr.ver == 3 or hdr.ver == 4) and hdr.magic == 0"));
+    ASSERT_TRUE(match("not hdr.ver == 4 and hdr.ver == 3"));
+    ASSERT_FALSE(match("not (hdr.ver == 3 or hdr.magic == 0)"));
+
+    // Headers that run past the end of data do not match and keep the position
+    Predicate header("hdr.ver == 0");
+    header.compile();
+    ASSERT_TRUE(header.match(*src, 40));
+    ASSERT_TRUE(header.match(*src, 54));
+    ASSERT_FALSE(header.match(*src, 55));
+    ASSERT_FALSE(header.match(*src, 64));
+    ASSERT_FALSE(header.match(*src, 1000));
+    ASSERT_EQ(7u, src->pos());
+
+    // Data shorter than the layout does not match
+    Predicate tail("rec.x == 0");
+    tail.compile();
+    ASSERT_TRUE(tail.match(*src, 40));
+    ASSERT_FALSE(tail.match(*src, 61));
+
+    ASSERT_THROW(Predicate("hdr.ver =="), Error);
+    ASSERT_THROW(Predicate("hdr.ver == 'x"), Error);
+    ASSERT_THROW(Predicate("(hdr.ver == 1"), Error);
+    ASSERT_THROW(Predicate("hdr.name == 'a' xor 1 == 1"), Error);
+    ASSERT_THROW(Predicate("hdr.name == 1").compile(), Error);
+    ASSERT_THROW(Predicate("hdr.pad == 1").compile(), Error);
+    ASSERT_THROW(Predicate("hdr.missing == 1").compile(), Error);
+    ASSERT_THROW(Predicate("nope.x == 1").compile(), Error);
+    ASSERT_THROW(Predicate("1 == 1").compile(), Error);
+}
+
+TEST(SOURCE, Sampler)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    std::vector<std::string> cfgs;
+    for (int i = 0; i < 10000; i++) cfgs.push_back("/data/file" + std::to_string(i));
+
+    // The same seed picks the same sources
+    Sampler a;
+    a.set_rate(0.1);
+    Sampler b;
+    b.set_rate(0.1);
+    size_t taken = 0;
+    for (const std::string& cfg: cfgs) {
+        const bool picked = a.pick_source(cfg);
+        ASSERT_EQ(picked, b.pick_source(cfg));
+        if (picked) taken++;
+    }
+    ASSERT_GT(taken, 800u);
+    ASSERT_LT(taken, 1200u);
+
+    // A number of sources in the input order, whatever the order is
+    Sampler c;
+    c.set_count(50);
+    const std::vector<std::string> picked = c.pick_sources(cfgs);
+    ASSERT_EQ(50u, picked.size());
+    for (size_t i = 1; i < picked.size(); i++) {
+        ASSERT_LT(std::find(cfgs.begin(), cfgs.end(), picked[i-1]), std::find(cfgs.begin(), cfgs.end(), picked[i]));
+    }
+    std::vector<std::string> reversed(cfgs.rbegin(), cfgs.rend());
+    std::vector<std::string> again = c.pick_sources(reversed);
+    std::sort(again.begin(), again.end());
+    std::vector<std::string> sorted = picked;
+    std::sort(sorted.begin(), sorted.end());
+    ASSERT_EQ(sorted, again);
+
+    // All sources: the estimate is the sum without an error
+    Sampler all;
+    for (int i = 1; i <= 10; i++) {
+        all.add("bytes", i);
+        all.end_source();
+    }
+    ASSERT_DOUBLE_EQ(55, all.estimate("bytes").value);
+    ASSERT_DOUBLE_EQ(0, all.estimate("bytes").bound);
+    ASSERT_DOUBLE_EQ(0, all.estimate("missing").value);
+
+    // Every record counts 1, so the estimate is the number of records
+    Sampler records;
+    const size_t Records = 100000;
+    size_t pos = 0;
+    while (pos < Records) {
+        pos += records.skip_records("big", 0.01, Records - pos);
+        if (pos == Records) break;
+        records.add("count", 1);
+        pos++;
+    }
+    records.end_source();
+    const Estimate e = records.estimate("count");
+    ASSERT_NEAR(Records, e.value, 0.2 * Records);
+    ASSERT_NEAR(0, e.bound, 1e-6); // No variance between records
+
+    // Records of different sizes
+    Sampler sizes;
+    for (size_t i = 0; i < Records; i++) {
+        if (sizes.pick_record("big", 0.05)) sizes.add("size", i % 100);
+    }
+    sizes.end_source();
+    const Estimate s = sizes.estimate("size");
+    const double total = 49.5 * Records;
+    ASSERT_GT(s.bound, 0);
+    ASSERT_LT(s.bound, 0.05 * total);
+    ASSERT_NEAR(total, s.value, 3 * s.bound);
+
+    // Parts of a source sampled on threads of their own and merged
+    Sampler merged;
+    std::vector<Sampler> parts;
+    for (uint64_t i = 0; i < 4; i++) parts.push_back(merged.part(i));
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < parts.size(); i++) {
+        threads.emplace_back([&parts, i] {
+            use_sampler(&parts[i]);
+            for (size_t k = 0; k < Records / 4; k++) {
+                if (sampler().pick_record("big", 0.05)) sampler().add("size", k % 100);
+            }
+            use_sampler(nullptr);
+        });
+    }
+    for (std::thread& t: threads) t.join();
+    for (const Sampler& part: parts) merged.merge(part);
+    merged.end_source();
+    const Estimate m = merged.estimate("size");
+    ASSERT_GT(m.bound, 0);
+    ASSERT_NEAR(total, m.value, 3 * m.bound);
+}
+
+TEST(SOURCE, Chunks)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    auto records = [](size_t pos) { return (pos + 15) / 16 * 16; };
+    std::vector<ChunkRange> ranges = split_chunks(1000, 4, records);
+    ASSERT_EQ(4u, ranges.size());
+    const size_t offsets[] = { 0, 256, 512, 752 };
+    size_t total = 0;
+    for (size_t i = 0; i < ranges.size(); i++) {
+        ASSERT_EQ(offsets[i], ranges[i].offset);
+        total += ranges[i].size;
+    }
+    ASSERT_EQ(1000u, total);
+
+    // Only one boundary: the rest is in the last range
+    auto one = [](size_t pos) { return pos <= 300 ? 300 : Source::nopos(); };
+    ranges = split_chunks(1000, 8, one);
+    ASSERT_EQ(2u, ranges.size());
+    ASSERT_EQ(300u, ranges[1].offset);
+    ASSERT_EQ(700u, ranges[1].size);
+
+    // More chunks than bytes
+    ranges = split_chunks(3, 10, [](size_t pos) { return pos; });
+    ASSERT_EQ(3u, ranges.size());
+    ranges = split_chunks(0, 4, [](size_t pos) { return pos; });
+    ASSERT_EQ(1u, ranges.size());
+    ASSERT_EQ(0u, ranges[0].size);
+
+    // Results are in the order of the ranges
+    ranges = split_chunks(1000, 4, records);
+    std::vector<ChunkResult> results = run_chunks(ranges, [](size_t index, const ChunkRange& range, ChunkResult& result) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10 * (4 - index)));
+        result.output = std::to_string(range.offset);
+        if (index == 2) throwex("failed");
+    });
+    ASSERT_EQ(4u, results.size());
+    ASSERT_EQ("0", results[0].output);
+    ASSERT_EQ("752", results[3].output);
+    ASSERT_EQ("failed", results[2].error);
+    ASSERT_TRUE(results[1].error.empty());
+}
+
+TEST(SOURCE, FindMasked)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    const size_t Size = 200 * 1024;
+    MallocSourceTest mst;
+    const std::string cfg = mst.make(Size);
+    char* ptr = mst.ptr();
+    memset(ptr, 0, Size);
+
+    // MPEG audio style sync: 11 bits set
+    const size_t frames[] = { 100, 64 * 1024 - 1, 150000, Size - 2 };
+    for (size_t pos: frames) {
+        ptr[pos] = '\xFF';
+        ptr[pos + 1] = '\xE3';
+    }
+    ptr[5000] = '\xFF'; // Not followed by the 3 bits
+
+    SourcePtr src = make_source(cfg.c_str());
+    const std::string pattern("\xFF\xE0", 2);
+    const std::string mask("\xFF\xE0", 2);
+
+    size_t pos = 0;
+    for (size_t frame: frames) {
+        pos = src->find_masked(pos, pattern, mask);
+        ASSERT_EQ(frame, pos);
+        pos++;
+    }
+    ASSERT_EQ(Source::nopos(), src->find_masked(pos, pattern, mask));
+    ASSERT_EQ(0u, src->pos());
+
+    // A mask that does not fix the first byte
+    const std::string low("\x03", 1);
+    ptr[7] = '\x07';
+    ASSERT_EQ(7u, src->find_masked(0, low, low));
+    ASSERT_EQ(Source::nopos(), src->find_masked(0, pattern, std::string("\xFF", 1)));
+}
+
+TEST(SOURCE, WorkerPool)
+{
+    //TempLogLevel tll(LL_DEBUG);
+
+    // Set before the fork, so the workers see it
+    std::string prefix = "prefix:";
+
+    auto task = [&prefix](const std::string& cfg, FileResult& result) {
+        if (cfg == "die") _exit(1);
+
+        // Later sources finish first
+        usleep(1000 * (10 - std::stoi(cfg.substr(0, 1))));
+        result.output = prefix + cfg + ";";
+        Contribution sum;
+        sum.name = "count";
+        sum.intValue = 1;
+        result.sums.push_back(sum);
+        return cfg != "5bad";
+    };
+
+    auto run = [&task](const std::vector<std::string>& cfgs, std::string& output, int64_t& count) {
+        WorkerPool pool(3, task);
+        EXPECT_EQ(3u, pool.size());
+
+        size_t i = 0;
+        auto next = [&cfgs, &i](std::string& cfg) {
+            if (i >= cfgs.size()) return false;
+            cfg = cfgs[i++];
+            return true;
+        };
+        output.clear();
+        count = 0;
+        return pool.run(next, [&output, &count](const std::string&, const FileResult& result) {
+            output += result.output;
+            count += result.sums.at(0).intValue;
+        });
+    };
+
+    std::vector<std::string> cfgs;
+    std::string expected;
+    for (int i = 0; i < 10; i++) {
+        cfgs.push_back(std::to_string(i) + "file");
+        expected += "prefix:" + cfgs.back() + ";";
+    }
+
+    std::string output;
+    int64_t count = 0;
+    ASSERT_TRUE(run(cfgs, output, count));
+    ASSERT_EQ(expected, output);
+    ASSERT_EQ(10, count);
+
+    // A failed source is passed on, but no more sources are handed out
+    ASSERT_FALSE(run({ "1a", "5bad", "2b", "3c", "4d", "6e", "7f", "8g" }, output, count));
+    ASSERT_EQ(0u, output.find("prefix:1a;prefix:5bad;"));
+    ASSERT_EQ(std::string::npos, output.find("8g"));
+
+    // A worker that dies stops the run, the sources after it that
+    // other workers ran are still passed on
+    ASSERT_FALSE(run({ "1a", "die", "2b", "3c" }, output, count));
+    ASSERT_EQ("prefix:1a;prefix:2b;", output);
+    ASSERT_EQ(2, count);
+
+    // SIGPIPE is only ignored while the pool lives
+    struct sigaction old;
+    ASSERT_EQ(0, sigaction(SIGPIPE, nullptr, &old));
+    ASSERT_TRUE(old.sa_handler == SIG_DFL);
+}
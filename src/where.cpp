@@ -0,0 +1,525 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "where.h"
+#include "error.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+namespace brie {
+
+struct Predicate::Value
+{
+    bool isStr = false;
+    bool isFloat = false;
+    int64_t intValue = 0;
+    double floatValue = 0;
+    std::string str;
+};
+
+struct Predicate::Node
+{
+    enum Kind { Or, And, Not, Compare };
+
+    struct Operand
+    {
+        int ref = -1; // Field reference or -1 for the constant
+        Value constant;
+    };
+
+    Kind kind = Compare;
+    std::unique_ptr<Node> left;
+    std::unique_ptr<Node> right;
+    std::string op;
+    Operand a;
+    Operand b;
+};
+
+/**********************************************************************
+ *   Parsing
+ */
+namespace {
+
+struct Token
+{
+    enum Kind { Name, Number, String, Symbol, End };
+    Kind kind;
+    std::string text;
+};
+
+std::vector<Token> tokenize(const std::string& expr)
+{
+    std::vector<Token> tokens;
+    size_t i = 0;
+    while (i < expr.size()) {
+        const char c = expr[i];
+        if (isspace((unsigned char)c)) {
+            i++;
+        } else if (isalpha((unsigned char)c) || c == '_') {
+            size_t start = i;
+            while (i < expr.size() && (isalnum((unsigned char)expr[i]) || expr[i] == '_')) i++;
+            tokens.push_back(Token{ Token::Name, expr.substr(start, i - start) });
+        } else if (isdigit((unsigned char)c) || (c == '-' && i + 1 < expr.size() && isdigit((unsigned char)expr[i + 1]))) {
+            size_t start = i++;
+            while (i < expr.size() && (isalnum((unsigned char)expr[i]) || expr[i] == '.')) i++;
+            tokens.push_back(Token{ Token::Number, expr.substr(start, i - start) });
+        } else if (c == '\'' || c == '"') {
+            size_t end = expr.find(c, i + 1);
+            if (end == std::string::npos) throwex("--where: unterminated string");
+            tokens.push_back(Token{ Token::String, expr.substr(i + 1, end - i - 1) });
+            i = end + 1;
+        } else {
+            static const char* symbols[] = { "==", "~=", "!=", "<=", ">=", "<", ">", "(", ")", "+", ":", "." };
+            const char* found = nullptr;
+            for (const char* symbol: symbols) {
+                if (expr.compare(i, strlen(symbol), symbol) == 0) {
+                    found = symbol;
+                    break;
+                }
+            }
+            if (found == nullptr) throwex(std::string("--where: unexpected character '") + c + "'");
+            tokens.push_back(Token{ Token::Symbol, found });
+            i += strlen(found);
+        }
+    }
+
+    tokens.push_back(Token{ Token::End, "" });
+    return tokens;
+}
+
+} // namespace
+
+class WhereParser
+{
+public:
+    using Node = Predicate::Node;
+
+    WhereParser(const std::string& expr, std::vector<std::string>& layout, std::vector<std::pair<std::string, std::string>>& refs)
+        : m_tokens(tokenize(expr)), m_pos(0), m_layout(layout), m_refs(refs) {}
+
+    std::unique_ptr<Node> parse()
+    {
+        parse_layout();
+        std::unique_ptr<Node> root = parse_or();
+        if (peek().kind != Token::End) fail("unexpected '" + peek().text + "'");
+        return root;
+    }
+
+private:
+    const Token& peek(size_t ahead = 0) const
+    {
+        return m_tokens[std::min(m_pos + ahead, m_tokens.size() - 1)];
+    }
+
+    bool is_symbol(const char* symbol, size_t ahead = 0) const
+    {
+        return peek(ahead).kind == Token::Symbol && peek(ahead).text == symbol;
+    }
+
+    bool is_keyword(const char* word) const
+    {
+        return peek().kind == Token::Name && peek().text == word;
+    }
+
+    [[noreturn]] void fail(const std::string& msg) const
+    {
+        throwex("--where: " + msg);
+    }
+
+    // Layout "name+name:" if the expression starts with one
+    void parse_layout()
+    {
+        size_t n = 0;
+        while (peek(n).kind == Token::Name && (is_symbol("+", n + 1) || is_symbol(":", n + 1))) {
+            if (is_symbol(":", n + 1)) {
+                for (size_t i = 0; i <= n; i += 2) m_layout.push_back(peek(i).text);
+                m_pos += n + 2;
+                return;
+            }
+            n += 2;
+        }
+    }
+
+    std::unique_ptr<Node> parse_or()
+    {
+        std::unique_ptr<Node> left = parse_and();
+        while (is_keyword("or")) {
+            m_pos++;
+            left = join(Node::Or, std::move(left), parse_and());
+        }
+        return left;
+    }
+
+    std::unique_ptr<Node> parse_and()
+    {
+        std::unique_ptr<Node> left = parse_not();
+        while (is_keyword("and")) {
+            m_pos++;
+            left = join(Node::And, std::move(left), parse_not());
+        }
+        return left;
+    }
+
+    std::unique_ptr<Node> parse_not()
+    {
+        if (is_keyword("not")) {
+            m_pos++;
+            return join(Node::Not, parse_not(), nullptr);
+        }
+
+        if (is_symbol("(")) {
+            m_pos++;
+            std::unique_ptr<Node> node = parse_or();
+            if (!is_symbol(")")) fail("missing ')'");
+            m_pos++;
+            return node;
+        }
+
+        auto node = std::make_unique<Node>();
+        node->kind = Node::Compare;
+        node->a = parse_operand();
+
+        static const char* ops[] = { "==", "~=", "!=", "<", "<=", ">", ">=" };
+        const Token& op = peek();
+        if (op.kind != Token::Symbol || std::find_if(std::begin(ops), std::end(ops), [&op](const char* s) { return op.text == s; }) == std::end(ops)) {
+            fail("comparison expected");
+        }
+        node->op = op.text == "!=" ? "~=" : op.text;
+        m_pos++;
+
+        node->b = parse_operand();
+        return node;
+    }
+
+    Node::Operand parse_operand()
+    {
+        Node::Operand operand;
+        const Token token = peek();
+        m_pos++;
+
+        if (token.kind == Token::String) {
+            operand.constant.isStr = true;
+            operand.constant.str = token.text;
+        } else if (token.kind == Token::Number) {
+            char* end = nullptr;
+            const bool isFloat = token.text.find_first_of(".eE") != std::string::npos && token.text.find("0x") == std::string::npos;
+            if (isFloat) {
+                operand.constant.isFloat = true;
+                operand.constant.floatValue = strtod(token.text.c_str(), &end);
+            } else {
+                operand.constant.intValue = strtoll(token.text.c_str(), &end, 0);
+            }
+            if (*end != '\0') fail("invalid number " + token.text);
+        } else if (token.kind == Token::Name) {
+            std::string structName;
+            std::string field = token.text;
+            if (is_symbol(".") && peek(1).kind == Token::Name) {
+                structName = token.text;
+                field = peek(1).text;
+                m_pos += 2;
+            }
+            operand.ref = m_refs.size();
+            m_refs.emplace_back(structName, field);
+        } else {
+            fail(token.kind == Token::End ? "unexpected end" : "unexpected '" + token.text + "'");
+        }
+
+        return operand;
+    }
+
+    static std::unique_ptr<Node> join(Node::Kind kind, std::unique_ptr<Node> left, std::unique_ptr<Node> right)
+    {
+        auto node = std::make_unique<Node>();
+        node->kind = kind;
+        node->left = std::move(left);
+        node->right = std::move(right);
+        return node;
+    }
+
+private:
+    std::vector<Token> m_tokens;
+    size_t m_pos;
+    std::vector<std::string>& m_layout;
+    std::vector<std::pair<std::string, std::string>>& m_refs;
+};
+
+/**********************************************************************
+ */
+Predicate::Predicate(const std::string& expr) : m_expr(expr), m_compiled(false)
+{
+    std::vector<std::pair<std::string, std::string>> refs;
+    WhereParser parser(expr, m_layoutNames, refs);
+    m_root = parser.parse();
+
+    for (const auto& ref: refs) {
+        FieldRef fieldRef;
+        fieldRef.structName = ref.first;
+        fieldRef.field = ref.second;
+        m_refs.push_back(fieldRef);
+    }
+}
+
+Predicate::~Predicate()
+{
+}
+
+static bool is_string(Type type)
+{
+    return type == STRING || type == WSTRING;
+}
+
+static bool has_func(const FieldList& fields)
+{
+    for (const Field& f: fields) {
+        if (f.type == FUNC) return true;
+        if (f.type == UNDEFINED_TYPE && has_func(*get_struct(f.typeName))) return true;
+    }
+    return false;
+}
+
+void Predicate::compile()
+{
+    std::vector<std::string> names = m_layoutNames;
+    if (names.empty()) {
+        for (const FieldRef& ref: m_refs) {
+            if (!ref.structName.empty() && std::find(names.begin(), names.end(), ref.structName) == names.end()) {
+                names.push_back(ref.structName);
+            }
+        }
+    }
+    if (names.empty()) throwex("--where: no struct is named");
+
+    m_layout.clear();
+    for (const std::string& name: names) {
+        LayoutStruct lay;
+        lay.name = name;
+        lay.fields = get_struct(name);
+        lay.refs.assign(lay.fields->size(), -1);
+        m_layout.push_back(std::move(lay));
+    }
+
+    for (size_t r = 0; r < m_refs.size(); r++) {
+        FieldRef& ref = m_refs[r];
+        bool found = false;
+        for (size_t l = 0; l < m_layout.size() && !found; l++) {
+            LayoutStruct& lay = m_layout[l];
+            if (!ref.structName.empty() && lay.name != ref.structName) continue;
+
+            for (size_t f = 0; f < lay.fields->size() && !found; f++) {
+                const Field& field = (*lay.fields)[f];
+                if (field.name != ref.field) continue;
+
+                if (field.count != 1 || field.type == VOID || field.type == FUNC || field.type == UNDEFINED_TYPE) {
+                    throwex("--where: field " + ref.field + " is not a number or a string");
+                }
+                ref.layoutIndex = l;
+                ref.fieldIndex = f;
+                ref.type = field.type;
+                if (lay.refs[f] < 0) lay.refs[f] = r;
+                found = true;
+            }
+        }
+        if (!found) throwex("--where: unknown field " + ref.field);
+    }
+
+    // A field referenced twice is read once
+    for (size_t r = 0; r < m_refs.size(); r++) {
+        const int first = m_layout[m_refs[r].layoutIndex].refs[m_refs[r].fieldIndex];
+        m_refs[r].same = first != (int)r ? first : -1;
+    }
+
+    // Functions would have to run Lua to find the size of a field
+    for (size_t l = 0; l < m_layout.size(); l++) {
+        if (has_func(*m_layout[l].fields)) throwex("--where: struct " + m_layout[l].name + " has a function field");
+    }
+
+    // Comparisons are between values of one kind
+    std::vector<const Node*> stack = { m_root.get() };
+    while (!stack.empty()) {
+        const Node* node = stack.back();
+        stack.pop_back();
+        if (node->kind != Node::Compare) {
+            if (node->left) stack.push_back(node->left.get());
+            if (node->right) stack.push_back(node->right.get());
+            continue;
+        }
+
+        const bool aStr = node->a.ref >= 0 ? is_string(m_refs[node->a.ref].type) : node->a.constant.isStr;
+        const bool bStr = node->b.ref >= 0 ? is_string(m_refs[node->b.ref].type) : node->b.constant.isStr;
+        if (aStr != bStr) throwex("--where: a string is compared with a number");
+    }
+
+    m_compiled = true;
+}
+
+/**********************************************************************
+ *   Evaluation
+ */
+static void skip_field(Source& src, const Field& f)
+{
+    switch (f.type) {
+        case STRING:
+            if (f.size != 0) {
+                src.set_pos(src.pos() + f.size * f.count);
+            } else {
+                for (size_t i = 0; i < f.count; i++) src.read_str();
+            }
+            break;
+
+        case WSTRING:
+            for (size_t i = 0; i < f.count; i++) src.read_wstr(f.size);
+            break;
+
+        case VOID:
+            src.set_pos(src.pos() + f.size * f.count);
+            break;
+
+        case UNDEFINED_TYPE: {
+            const StructPtr sp = get_struct(f.typeName);
+            for (size_t i = 0; i < f.count; i++) {
+                for (const Field& nested: *sp) skip_field(src, nested);
+            }
+            break;
+        }
+
+        case FUNC:
+            throwex("--where: cannot skip a function field");
+            break;
+
+        default:
+            src.set_pos(src.pos() + type_length(f.type) * f.count);
+            break;
+    }
+}
+
+bool Predicate::read_values(Source& src, std::vector<Value>& values) const
+{
+    size_t left = 0;
+    for (const LayoutStruct& lay: m_layout) {
+        left += std::count_if(lay.refs.begin(), lay.refs.end(), [](int ref) { return ref >= 0; });
+    }
+
+    for (const LayoutStruct& lay: m_layout) {
+        for (size_t i = 0; i < lay.fields->size() && left > 0; i++) {
+            const Field& f = (*lay.fields)[i];
+            if (lay.refs[i] < 0) {
+                skip_field(src, f);
+                continue;
+            }
+
+            Value& value = values[lay.refs[i]];
+            switch (f.type) {
+                case STRING:
+                    value.isStr = true;
+                    value.str = src.read_str(f.size);
+                    break;
+                case WSTRING:
+                    value.isStr = true;
+                    value.str = src.read_wstr(f.size);
+                    break;
+                case F32:
+                case F64:
+                    value.isFloat = true;
+                    value.floatValue = src.read_float(f.type);
+                    break;
+                default:
+                    value.intValue = src.read_int(f.type);
+                    break;
+            }
+            left--;
+        }
+    }
+
+    // Values of fields referenced more than once
+    for (size_t r = 0; r < m_refs.size(); r++) {
+        if (m_refs[r].same >= 0) values[r] = values[m_refs[r].same];
+    }
+
+    return true;
+}
+
+static int compare(const Predicate::Value& a, const Predicate::Value& b)
+{
+    if (a.isStr) return a.str.compare(b.str);
+
+    if (a.isFloat || b.isFloat) {
+        const double x = a.isFloat ? a.floatValue : a.intValue;
+        const double y = b.isFloat ? b.floatValue : b.intValue;
+        return x < y ? -1 : (x > y ? 1 : 0);
+    }
+    return a.intValue < b.intValue ? -1 : (a.intValue > b.intValue ? 1 : 0);
+}
+
+static bool evaluate(const Predicate::Node& node, const std::vector<Predicate::Value>& values)
+{
+    using Node = Predicate::Node;
+    switch (node.kind) {
+        case Node::Or: return evaluate(*node.left, values) || evaluate(*node.right, values);
+        case Node::And: return evaluate(*node.left, values) && evaluate(*node.right, values);
+        case Node::Not: return !evaluate(*node.left, values);
+        case Node::Compare: break;
+    }
+
+    const Predicate::Value& a = node.a.ref >= 0 ? values[node.a.ref] : node.a.constant;
+    const Predicate::Value& b = node.b.ref >= 0 ? values[node.b.ref] : node.b.constant;
+    const int cmp = compare(a, b);
+
+    if (node.op == "==") return cmp == 0;
+    if (node.op == "~=") return cmp != 0;
+    if (node.op == "<") return cmp < 0;
+    if (node.op == "<=") return cmp <= 0;
+    if (node.op == ">") return cmp > 0;
+    return cmp >= 0;
+}
+
+bool Predicate::match(Source& src, size_t pos) const
+{
+    if (!m_compiled) throwex("--where: the expression is not compiled");
+
+    const size_t saved = src.pos();
+    bool result = false;
+    try {
+        src.set_pos(pos);
+        std::vector<Value> values(m_refs.size());
+        result = read_values(src, values) && evaluate(*m_root, values);
+    } catch (const Error&) {
+        result = false;
+    }
+
+    try {
+        src.set_pos(saved);
+    } catch (const Error&) {
+    }
+
+    return result;
+}
+
+static std::unique_ptr<Predicate> thePredicate;
+
+void set_where(std::unique_ptr<Predicate> predicate)
+{
+    thePredicate = std::move(predicate);
+}
+
+Predicate* where_predicate()
+{
+    return thePredicate.get();
+}
+
+} // namespace brie
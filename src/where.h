@@ -0,0 +1,104 @@
+/* 
+ * This file is part of the BRIE distribution (https://github.com/michael-popov/brie).
+ * Copyright (c) 2023 Michael Popov.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "source.h"
+#include "structs.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace brie {
+
+/*****************************************************************
+ *   Filter given with --where. It compares fields of structs declared
+ *   with decl() to constants and is evaluated natively on the data,
+ *   so sources that fail it skip the body without running any Lua.
+ *
+ *     where   := [layout ':'] or
+ *     layout  := struct ('+' struct)*
+ *     or      := and ('or' and)*
+ *     and     := not ('and' not)*
+ *     not     := 'not' not | '(' or ')' | operand op operand
+ *     op      := '==' | '~=' | '!=' | '<' | '<=' | '>' | '>='
+ *     operand := [struct '.'] field | number | 'string' | "string"
+ *
+ *   The structs of the layout are read one after another from the
+ *   position being tested. Without a layout it is made of the structs
+ *   named in the expression in the order they first appear. A field
+ *   without a struct name is looked up in the layout structs in order.
+ *
+ *   The filter tests the start of each source (or of each part of a
+ *   ring), not every record in it. Scripts that read many records from
+ *   a source test each one with where_match(pos).
+ */
+class Predicate
+{
+public:
+    // Parse the expression; throws on syntax errors.
+    explicit Predicate(const std::string& expr);
+    ~Predicate();
+
+    // Find the fields in the declared structs. Call after the structs
+    // are declared; throws if a field or struct is unknown or cannot
+    // be compared.
+    void compile();
+
+    // Test the data at "pos" of "src". The position of the source is
+    // not changed. Data too short for the layout does not match.
+    // May be called from several threads once compiled.
+    bool match(Source& src, size_t pos = 0) const;
+
+    struct Node;
+    struct Value;
+
+private:
+    struct FieldRef
+    {
+        std::string structName; // Empty if not given
+        std::string field;
+        size_t layoutIndex = 0; // Struct in m_layout
+        size_t fieldIndex = 0;  // Field in the struct
+        Type type = UNDEFINED_TYPE;
+        int same = -1;          // Earlier reference to the same field
+    };
+
+    struct LayoutStruct
+    {
+        std::string name;
+        StructPtr fields;
+        std::vector<int> refs; // Reference number of each field or -1
+    };
+
+    bool read_values(Source& src, std::vector<Value>& values) const;
+
+private:
+    std::string m_expr;
+    std::vector<std::string> m_layoutNames;
+    std::vector<LayoutStruct> m_layout;
+    std::vector<FieldRef> m_refs;
+    std::unique_ptr<Node> m_root;
+    bool m_compiled;
+};
+
+// The filter given with --where, null if none. The same filter is
+// offered to scripts as where_match(pos) to test single records.
+void set_where(std::unique_ptr<Predicate> predicate);
+Predicate* where_predicate();
+
+} // namespace brie